@@ -379,6 +379,7 @@ void initializeXRayInstrumentationPass(PassRegistry&);
 
 // NVM
 void initializeExpandAllocasPass(PassRegistry &);
+void initializeGasMeteringPass(PassRegistry &);
 void initializeStripTlsPass(PassRegistry &);
 void initializeSandboxIndirectCallsPass(PassRegistry &);
 void initializeSandboxMemoryAccessesPass(PassRegistry &);
@@ -21,8 +21,28 @@ namespace llvm {
 
 class ModulePass;
 
+/// How SandboxMemoryAccesses confines contract pointers. Both modes keep the
+/// low 32 bits of a pointer and add __sfi_memory_base, so the sandbox itself
+/// is 4 GiB; they differ in what the host must reserve past it.
+enum class SandboxMode {
+  /// Constant offsets up to 64 KiB are added after confinement. Needs a
+  /// 64 KiB guard region after the sandbox.
+  Truncate,
+  /// Constant offsets below 4 GiB and scaled variable indices are added after
+  /// confinement, so they fold into addressing modes. Needs a guard region
+  /// of 4 GiB + 64 KiB after the sandbox, turning faults in it into traps.
+  GuardRegion,
+  /// Keep the low SizeBits bits of a pointer instead, for sandboxes smaller
+  /// than 4 GiB. Constant offsets up to 64 KiB are added after confinement.
+  /// Needs the sandbox aligned to its size and a 64 KiB guard after it.
+  Mask,
+};
+
 ModulePass *createExpandAllocasPass();
+ModulePass *createGasMeteringPass();
 ModulePass *createSandboxIndirectCallsPass();
 ModulePass *createSandboxMemoryAccessesPass();
+ModulePass *createSandboxMemoryAccessesPass(SandboxMode Mode,
+                                            unsigned SizeBits = 32);
 ModulePass *createStripTlsPass();
 } // namespace llvm
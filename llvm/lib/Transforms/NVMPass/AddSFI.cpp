@@ -1,19 +1,46 @@
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
-// #include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/NVMPass.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <algorithm>
 
 using namespace llvm;
 
 // #define _ENABLE_DEBUG_LOG true
 
+// The host keeps __sfi_stack_limit at least this far above the real end of
+// the stack, so leaf functions with frames up to this size need no check:
+// their caller already checked that its own frame fits above the limit.
+static const uint64_t StackRedZone = 4096;
+
+// Frame size of functions that call out, even without allocas. Every call
+// level takes at least this much of the stack and is checked against the
+// limit, which bounds the recursion depth, and with it the native stack the
+// contract can use, to the stack size over this.
+static const uint64_t MinCallFrameSize = 64;
+
 namespace {
 // This is a ModulePass so that it can add global variables.
 class ExpandAllocas : public ModulePass {
+  Type *IntPtrType;
+  Value *StackPtr;
+  Value *StackLimitVar;
+  Constant *OverflowFunc;
+
+  void expandAllocas(Function *Func);
+  void insertOverflowCheck(Value *NewSP, Value *OldSP, Value *StackLimit,
+                           Instruction *InsertPt);
+  Value *expandDynamicAlloca(AllocaInst *Alloca, Value *StackLimit);
+
 public:
   static char ID; // Pass identification, replacement for typeid
   ExpandAllocas() : ModulePass(ID) {
@@ -28,86 +55,223 @@ char ExpandAllocas::ID = 0;
 INITIALIZE_PASS(ExpandAllocas, "expand-allocas",
                 "Expand out alloca instructions", false, false)
 
-static void expandAllocas(Function *Func, Type *IntPtrType, Value *StackPtr) {
+static bool isStaticAlloca(const AllocaInst *Alloca) {
+  return Alloca->getParent() == &Alloca->getFunction()->getEntryBlock() &&
+         isa<ConstantInt>(Alloca->getArraySize());
+}
+
+static unsigned getAllocaAlignment(const AllocaInst *Alloca,
+                                   const DataLayout &DL) {
+  unsigned Align = Alloca->getAlignment();
+  if (Align == 0)
+    Align = DL.getPrefTypeAlignment(Alloca->getAllocatedType());
+  return std::max(Align, 1u);
+}
+
+// Traps unless NewSP is still above the limit. A stack pointer that wrapped
+// around below zero ends up above OldSP.
+void ExpandAllocas::insertOverflowCheck(Value *NewSP, Value *OldSP,
+                                        Value *StackLimit,
+                                        Instruction *InsertPt) {
+  Value *BelowLimit = new ICmpInst(InsertPt, ICmpInst::ICMP_ULT, NewSP,
+                                   StackLimit, "stack_below_limit");
+  Value *Wrapped =
+      new ICmpInst(InsertPt, ICmpInst::ICMP_UGT, NewSP, OldSP, "stack_wrapped");
+  Value *Overflow = BinaryOperator::Create(BinaryOperator::Or, BelowLimit,
+                                           Wrapped, "stack_overflow", InsertPt);
+  MDNode *Unlikely =
+      MDBuilder(InsertPt->getContext()).createBranchWeights(1, 1 << 20);
+  TerminatorInst *Trap = SplitBlockAndInsertIfThen(
+      Overflow, InsertPt, /*Unreachable=*/true, Unlikely);
+  CallInst::Create(OverflowFunc, "", Trap)->setDoesNotReturn();
+}
+
+// Bump the stack pointer down by the allocation, which is freed when the
+// function returns or at the matching llvm.stackrestore.
+Value *ExpandAllocas::expandDynamicAlloca(AllocaInst *Alloca,
+                                          Value *StackLimit) {
+  const DataLayout &DL = Alloca->getModule()->getDataLayout();
+  uint64_t ElemSize = DL.getTypeAllocSize(Alloca->getAllocatedType());
+  unsigned Align = getAllocaAlignment(Alloca, DL);
+
+  Value *SP = new LoadInst(StackPtr, "sp", Alloca);
+  Value *Count = CastInst::CreateIntegerCast(Alloca->getArraySize(), IntPtrType,
+                                             /*isSigned=*/false, "", Alloca);
+  Value *Size = BinaryOperator::Create(BinaryOperator::Mul, Count,
+                                       ConstantInt::get(IntPtrType, ElemSize),
+                                       "", Alloca);
+  Value *NewSP =
+      BinaryOperator::Create(BinaryOperator::Sub, SP, Size, "", Alloca);
+  NewSP = BinaryOperator::Create(BinaryOperator::And, NewSP,
+                                 ConstantInt::get(IntPtrType, -(int64_t)Align),
+                                 "new_sp", Alloca);
+  insertOverflowCheck(NewSP, SP, StackLimit, Alloca);
+  new StoreInst(NewSP, StackPtr, Alloca);
+  return new IntToPtrInst(NewSP, Alloca->getType(), "", Alloca);
+}
+
+void ExpandAllocas::expandAllocas(Function *Func) {
   // Skip function declarations.
   if (Func->empty())
     return;
 
-  Instruction *FrameTop = NULL;
-
+  const DataLayout &DL = Func->getParent()->getDataLayout();
   BasicBlock *EntryBB = &Func->getEntryBlock();
 
+  // Static allocas get a slot in the frame; all others, and the stack
+  // save/restore intrinsics that scope them, go through the bump stack. A
+  // function that calls out has to publish its frame to the callee.
+  SmallVector<AllocaInst *, 16> StaticAllocas;
+  SmallVector<AllocaInst *, 4> DynamicAllocas;
+  SmallVector<IntrinsicInst *, 4> StackIntrinsics;
+  SmallVector<ReturnInst *, 4> Returns;
+  bool HasCalls = false;
+  for (Function::iterator BB = Func->begin(), E = Func->end(); BB != E; ++BB) {
+    for (BasicBlock::iterator Inst = BB->begin(), E = BB->end(); Inst != E;
+         ++Inst) {
+      if (AllocaInst *Alloca = dyn_cast<AllocaInst>(Inst)) {
+        if (isStaticAlloca(Alloca))
+          StaticAllocas.push_back(Alloca);
+        else
+          DynamicAllocas.push_back(Alloca);
+      } else if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(Inst)) {
+        if (II->getIntrinsicID() == Intrinsic::stacksave ||
+            II->getIntrinsicID() == Intrinsic::stackrestore)
+          StackIntrinsics.push_back(II);
+      } else if (isa<CallInst>(Inst) || isa<InvokeInst>(Inst)) {
+        HasCalls = true;
+      } else if (ReturnInst *Ret = dyn_cast<ReturnInst>(Inst)) {
+        Returns.push_back(Ret);
+      }
+    }
+  }
+  // Leaf functions neither move the stack pointer nor restore it: nothing
+  // runs on the stack below their frame.
+  bool IsLeaf =
+      !HasCalls && DynamicAllocas.empty() && StackIntrinsics.empty();
+  if (IsLeaf && StaticAllocas.empty())
+    return;
+
 #ifdef _ENABLE_DEBUG_LOG
   errs() << "EntryBB:";
   EntryBB->dump();
   errs() << "end EntryBB.\n";
 #endif
 
-  unsigned FrameOffset = 0;
-  for (BasicBlock::iterator Iter = EntryBB->begin(), E = EntryBB->end();
-       Iter != E;) {
-#ifdef _ENABLE_DEBUG_LOG
-    errs() << "EntryBB->Iterator:";
-    Iter->dump();
-    errs() << "end EntryBB->Iterator.\n";
-#endif
+  // Lay the frame out by decreasing alignment, which keeps padding to the
+  // minimum the alignments allow.
+  std::stable_sort(StaticAllocas.begin(), StaticAllocas.end(),
+                   [&](AllocaInst *A, AllocaInst *B) {
+                     return getAllocaAlignment(A, DL) >
+                            getAllocaAlignment(B, DL);
+                   });
+  SmallVector<uint64_t, 16> Offsets;
+  uint64_t FrameSize = 0;
+  unsigned FrameAlign = 1;
+  for (AllocaInst *Alloca : StaticAllocas) {
+    unsigned Align = getAllocaAlignment(Alloca, DL);
+    uint64_t Count = cast<ConstantInt>(Alloca->getArraySize())->getZExtValue();
+    FrameSize = alignTo(FrameSize, Align);
+    Offsets.push_back(FrameSize);
+    FrameSize += DL.getTypeAllocSize(Alloca->getAllocatedType()) * Count;
+    FrameAlign = std::max(FrameAlign, Align);
+  }
+  FrameSize = alignTo(FrameSize, FrameAlign);
+  if (HasCalls)
+    FrameSize = std::max(FrameSize, MinCallFrameSize);
+  bool NeedsCheck = FrameSize != 0 && (!IsLeaf || FrameSize > StackRedZone);
 
-    if (AllocaInst *Alloca = dyn_cast<AllocaInst>(&*Iter)) {
-      // XXX: error reporting
-      ConstantInt *CI = cast<ConstantInt>(Alloca->getArraySize());
-      // TODO: handle alignment
-      FrameOffset += CI->getZExtValue();
+  // The frame is set up ahead of everything but the allocas it replaces.
+  BasicBlock::iterator It = EntryBB->getFirstInsertionPt();
+  while (isa<AllocaInst>(It) && isStaticAlloca(cast<AllocaInst>(&*It)))
+    ++It;
+  Instruction *InsertPt = &*It;
+  Instruction *FrameTop = new LoadInst(StackPtr, "frame_top", InsertPt);
+  Value *StackLimit = nullptr;
+  if (NeedsCheck || !DynamicAllocas.empty()) {
+    // The limit is fixed by the host for the whole call.
+    LoadInst *Limit = new LoadInst(StackLimitVar, "stack_limit", InsertPt);
+    Limit->setMetadata(LLVMContext::MD_invariant_load,
+                       MDNode::get(Func->getContext(), None));
+    StackLimit = Limit;
+  }
 
-      if (!FrameTop) {
-        FrameTop = new LoadInst(StackPtr, "frame_top");
-        EntryBB->getInstList().push_front(FrameTop);
-      }
-      Value *Var = BinaryOperator::Create(
-          BinaryOperator::Add, FrameTop,
-          ConstantInt::get(IntPtrType, FrameOffset), "", Alloca);
-      Var = new IntToPtrInst(Var, Alloca->getType(), "", Alloca);
-      Var->takeName(Alloca);
-      Alloca->replaceAllUsesWith(Var);
-      Iter = Alloca->eraseFromParent();
-    } else {
-      ++Iter;
-    }
+  Value *FrameBottom = FrameTop;
+  if (FrameSize != 0) {
+    FrameBottom = BinaryOperator::Create(
+        BinaryOperator::Sub, FrameTop, ConstantInt::get(IntPtrType, FrameSize),
+        "", InsertPt);
+    FrameBottom = BinaryOperator::Create(
+        BinaryOperator::And, FrameBottom,
+        ConstantInt::get(IntPtrType, -(int64_t)FrameAlign), "frame_bottom",
+        InsertPt);
   }
-  if (FrameTop) {
+
+  for (unsigned I = 0, E = StaticAllocas.size(); I != E; ++I) {
+    AllocaInst *Alloca = StaticAllocas[I];
+    Value *Var = BinaryOperator::Create(
+        BinaryOperator::Add, FrameBottom,
+        ConstantInt::get(IntPtrType, Offsets[I]), "", InsertPt);
+    Var = new IntToPtrInst(Var, Alloca->getType(), "", InsertPt);
+    Var->takeName(Alloca);
+    Alloca->replaceAllUsesWith(Var);
+    Alloca->eraseFromParent();
+  }
+
+  // The only check for the static frame, before anything is stored in it.
+  if (NeedsCheck)
+    insertOverflowCheck(FrameBottom, FrameTop, StackLimit, InsertPt);
+
+  if (!IsLeaf) {
     // Adjust stack pointer.
-    // TODO: Could omit this in leaf functions.
-    Instruction *FrameBottom = BinaryOperator::Create(
-        BinaryOperator::Add, FrameTop,
-        ConstantInt::get(IntPtrType, -FrameOffset), "frame_bottom");
-    FrameBottom->insertAfter(FrameTop);
-    (new StoreInst(FrameBottom, StackPtr))->insertAfter(FrameBottom);
-
-    for (Function::iterator BB = Func->begin(), E = Func->end(); BB != E;
-         ++BB) {
-      for (BasicBlock::iterator Inst = BB->begin(), E = BB->end(); Inst != E;
-           ++Inst) {
-        if (isa<AllocaInst>(Inst)) {
-          report_fatal_error("TODO: handle dynamic alloca");
-        } else if (ReturnInst *Ret = dyn_cast<ReturnInst>(Inst)) {
-          // Restore stack pointer.
-          new StoreInst(FrameTop, StackPtr, Ret);
-        }
-      }
+    if (FrameSize != 0)
+      new StoreInst(FrameBottom, StackPtr, InsertPt);
+    for (ReturnInst *Ret : Returns) {
+      // Restore stack pointer.
+      new StoreInst(FrameTop, StackPtr, Ret);
     }
   }
+
+  for (AllocaInst *Alloca : DynamicAllocas) {
+    Value *Var = expandDynamicAlloca(Alloca, StackLimit);
+    Var->takeName(Alloca);
+    Alloca->replaceAllUsesWith(Var);
+    Alloca->eraseFromParent();
+  }
+
+  for (IntrinsicInst *II : StackIntrinsics) {
+    if (II->getIntrinsicID() == Intrinsic::stacksave) {
+      Value *SP = new LoadInst(StackPtr, "sp", II);
+      Value *Saved = new IntToPtrInst(SP, II->getType(), "", II);
+      Saved->takeName(II);
+      II->replaceAllUsesWith(Saved);
+    } else {
+      Value *SP = new PtrToIntInst(II->getArgOperand(0), IntPtrType, "", II);
+      new StoreInst(SP, StackPtr, II);
+    }
+    II->eraseFromParent();
+  }
 }
 
 bool ExpandAllocas::runOnModule(Module &M) {
-  Type *IntPtrType = Type::getInt64Ty(M.getContext()); // XXX
-  // uint64_t InitialStackPtr = 0x40000000;
-  Value *StackPtr =
-      new GlobalVariable(M, IntPtrType, /*isConstant=*/false,
-                         GlobalVariable::ExternalLinkage, NULL, "__sfi_stack");
+  LLVMContext &Context = M.getContext();
+  IntPtrType = Type::getInt64Ty(Context); // XXX
+  StackPtr = M.getOrInsertGlobal("__sfi_stack", IntPtrType);
+  StackLimitVar = M.getOrInsertGlobal("__sfi_stack_limit", IntPtrType);
+  OverflowFunc = M.getOrInsertFunction(
+      "__nvm_stack_overflow",
+      FunctionType::get(Type::getVoidTy(Context), /*isVarArg=*/false));
 
   for (Module::iterator Func = M.begin(), E = M.end(); Func != E; ++Func) {
-    expandAllocas(&(*Func), IntPtrType, StackPtr);
+    expandAllocas(&(*Func));
   }
 
+  // Don't make hosts bind what no function ended up checking against.
+  if (StackLimitVar->use_empty())
+    cast<GlobalVariable>(StackLimitVar)->eraseFromParent();
+  if (OverflowFunc->use_empty())
+    cast<Function>(OverflowFunc)->eraseFromParent();
+
   return true;
 }
 
@@ -0,0 +1,225 @@
+//===- GasMetering.cpp - Charge gas for executed contract code -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Instruments every function with gas accounting. Each basic block charges
+// its statically computed cost once, on entry, into a function-local counter
+// that is promoted to a register. The counter is only written back to the
+// host-visible __nvm_gas_used around calls and returns, and compared against
+// __nvm_gas_limit only at loop back-edges and call sites, which is enough to
+// bound execution. Bulk memory intrinsics are charged for their length, and
+// checked, before they run. Running out of gas calls the __nvm_gas_exhausted
+// hook, which must not return.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/NVMPass.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+using namespace llvm;
+
+namespace {
+// This is a ModulePass so that it can add global variables.
+class GasMetering : public ModulePass {
+  Value *GasUsedVar;
+  Value *GasLimitVar;
+  Constant *ExhaustedFunc;
+
+  void meterFunc(Function *Func);
+  void insertCheck(Instruction *InsertPt, AllocaInst *GasSlot,
+                   Value *GasLimit);
+
+public:
+  static char ID; // Pass identification, replacement for typeid
+  GasMetering() : ModulePass(ID) {
+    initializeGasMeteringPass(*PassRegistry::getPassRegistry());
+  }
+
+  virtual bool runOnModule(Module &M);
+};
+} // namespace
+
+char GasMetering::ID = 0;
+INITIALIZE_PASS(GasMetering, "gas-metering",
+                "Charge gas for executed contract code", false, false)
+
+// Static cost of an instruction. Gas must be deterministic, so this only
+// depends on the IR, never on the target or the execution tier.
+static uint64_t getInstructionCost(const Instruction &Inst) {
+  if (isa<PHINode>(Inst) || isa<DbgInfoIntrinsic>(Inst))
+    return 0;
+
+  switch (Inst.getOpcode()) {
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+  case Instruction::FDiv:
+  case Instruction::FRem:
+    return 8;
+  case Instruction::Call:
+    return 4;
+  default:
+    return 1;
+  }
+}
+
+static bool isMeteredCall(const Instruction &Inst) {
+  const CallInst *Call = dyn_cast<CallInst>(&Inst);
+  return Call && !isa<IntrinsicInst>(Call) && !Call->isInlineAsm();
+}
+
+void GasMetering::insertCheck(Instruction *InsertPt, AllocaInst *GasSlot,
+                              Value *GasLimit) {
+  Value *Gas = new LoadInst(GasSlot, "gas", InsertPt);
+  Value *Exhausted = new ICmpInst(InsertPt, ICmpInst::ICMP_UGT, Gas, GasLimit,
+                                  "gas_exhausted");
+  MDNode *Unlikely =
+      MDBuilder(InsertPt->getContext()).createBranchWeights(1, 1 << 20);
+  TerminatorInst *Trap =
+      SplitBlockAndInsertIfThen(Exhausted, InsertPt, /*Unreachable=*/true,
+                                Unlikely);
+  // Let the host see how much gas was spent before trapping.
+  new StoreInst(Gas, GasUsedVar, Trap);
+  CallInst::Create(ExhaustedFunc, "", Trap)->setDoesNotReturn();
+}
+
+void GasMetering::meterFunc(Function *Func) {
+  // Skip function declarations.
+  if (Func->empty())
+    return;
+
+  Type *I64 = Type::getInt64Ty(Func->getContext());
+  BasicBlock *EntryBB = &Func->getEntryBlock();
+
+  // Charge every block's static cost once, on entry to the block.
+  AllocaInst *GasSlot = new AllocaInst(I64, 0, "gas_slot");
+  SmallVector<MemIntrinsic *, 4> MemOps;
+  for (Function::iterator BB = Func->begin(), E = Func->end(); BB != E; ++BB) {
+    uint64_t Cost = 0;
+    for (BasicBlock::iterator Inst = BB->begin(), E = BB->end(); Inst != E;
+         ++Inst) {
+      Cost += getInstructionCost(*Inst);
+      if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(Inst))
+        MemOps.push_back(MI);
+    }
+    if (Cost == 0)
+      continue;
+
+    Instruction *InsertPt = &*BB->getFirstInsertionPt();
+    Value *Gas = new LoadInst(GasSlot, "gas", InsertPt);
+    Gas = BinaryOperator::Create(BinaryOperator::Add, Gas,
+                                 ConstantInt::get(I64, Cost), "", InsertPt);
+    new StoreInst(Gas, GasSlot, InsertPt);
+  }
+
+  // Load the counter and the limit ahead of the entry block's charge.
+  Instruction *EntryPt = &*EntryBB->begin();
+  EntryBB->getInstList().insert(EntryPt->getIterator(), GasSlot);
+  new StoreInst(new LoadInst(GasUsedVar, "gas_used", EntryPt), GasSlot,
+                EntryPt);
+  // The limit is fixed by the host for the whole call.
+  LoadInst *GasLimit = new LoadInst(GasLimitVar, "gas_limit", EntryPt);
+  GasLimit->setMetadata(LLVMContext::MD_invariant_load,
+                        MDNode::get(Func->getContext(), None));
+
+  // Bulk memory intrinsics additionally pay for their length, one gas per 8
+  // bytes, and are checked before they run rather than at the next check
+  // point. The length is contract controlled, so the charge saturates
+  // instead of wrapping the counter around below the limit.
+  for (MemIntrinsic *MI : MemOps) {
+    Value *Len = CastInst::CreateZExtOrBitCast(MI->getLength(), I64, "", MI);
+    Value *LenCost = BinaryOperator::Create(BinaryOperator::LShr, Len,
+                                            ConstantInt::get(I64, 3), "", MI);
+    Value *Gas = new LoadInst(GasSlot, "gas", MI);
+    Value *Charged =
+        BinaryOperator::Create(BinaryOperator::Add, Gas, LenCost, "", MI);
+    Value *Wrapped =
+        new ICmpInst(MI, ICmpInst::ICMP_ULT, Charged, Gas, "gas_wrapped");
+    Charged = SelectInst::Create(Wrapped, ConstantInt::get(I64, UINT64_MAX),
+                                 Charged, "", MI);
+    new StoreInst(Charged, GasSlot, MI);
+    insertCheck(MI, GasSlot, GasLimit);
+  }
+
+  // Collect check points before splitting any block.
+  SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 8> BackEdges;
+  FindFunctionBackedges(*Func, BackEdges);
+
+  // A block with several back-edges is only checked once.
+  SmallVector<Instruction *, 8> LoopChecks;
+  SmallPtrSet<const BasicBlock *, 8> Latches;
+  SmallVector<CallInst *, 16> Calls;
+  SmallVector<ReturnInst *, 4> Returns;
+  for (auto &Edge : BackEdges) {
+    if (Latches.insert(Edge.first).second)
+      LoopChecks.push_back(
+          const_cast<BasicBlock *>(Edge.first)->getTerminator());
+  }
+  for (Function::iterator BB = Func->begin(), E = Func->end(); BB != E; ++BB) {
+    for (BasicBlock::iterator Inst = BB->begin(), E = BB->end(); Inst != E;
+         ++Inst) {
+      // Leave the traps of the checks inserted above alone.
+      if (isMeteredCall(*Inst) &&
+          cast<CallInst>(Inst)->getCalledValue() != ExhaustedFunc) {
+        Calls.push_back(cast<CallInst>(&*Inst));
+      } else if (ReturnInst *Ret = dyn_cast<ReturnInst>(Inst)) {
+        Returns.push_back(Ret);
+      }
+    }
+  }
+
+  // The callee charges into __nvm_gas_used directly, so write the counter
+  // back before the call and pick the total up again afterwards.
+  for (CallInst *Call : Calls) {
+    new StoreInst(new LoadInst(GasSlot, "gas", Call), GasUsedVar, Call);
+    Instruction *Reload = new LoadInst(GasUsedVar, "gas_used");
+    Reload->insertAfter(Call);
+    (new StoreInst(Reload, GasSlot))->insertAfter(Reload);
+    insertCheck(Call, GasSlot, GasLimit);
+  }
+  for (ReturnInst *Ret : Returns) {
+    new StoreInst(new LoadInst(GasSlot, "gas", Ret), GasUsedVar, Ret);
+  }
+  for (Instruction *Term : LoopChecks) {
+    insertCheck(Term, GasSlot, GasLimit);
+  }
+
+  DominatorTree DT(*Func);
+  PromoteMemToReg(GasSlot, DT);
+}
+
+bool GasMetering::runOnModule(Module &M) {
+  LLVMContext &Context = M.getContext();
+  Type *I64 = Type::getInt64Ty(Context);
+  GasUsedVar = M.getOrInsertGlobal("__nvm_gas_used", I64);
+  GasLimitVar = M.getOrInsertGlobal("__nvm_gas_limit", I64);
+  ExhaustedFunc = M.getOrInsertFunction(
+      "__nvm_gas_exhausted",
+      FunctionType::get(Type::getVoidTy(Context), /*isVarArg=*/false));
+
+  for (Module::iterator Func = M.begin(), E = M.end(); Func != E; ++Func) {
+    if (&*Func == ExhaustedFunc)
+      continue;
+    meterFunc(&(*Func));
+  }
+  return true;
+}
+
+ModulePass *llvm::createGasMeteringPass() { return new GasMetering(); }
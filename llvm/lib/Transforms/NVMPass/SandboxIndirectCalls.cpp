@@ -7,25 +7,59 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// XXX
+// Confines indirect calls to the contract's own address-taken functions of
+// the called signature.
+//
+// Every signature that is address-taken or called indirectly gets a constant
+// table of functions of exactly that type. Its size is a power of two, slot 0
+// and the padding hold a stub that traps. A function pointer no longer holds
+// an address but the function's slot in its table, shifted left past a
+// signature number, which keeps pointers to different functions distinct and
+// null at 0. An indirect call masks the slot out of the pointer and calls the
+// table entry, so whatever the pointer holds, the callee is a function of the
+// call's signature, without any branch.
+//
+// Calls through a constant pointer are turned into direct calls here. As the
+// tables are constant, the optimizer does the same for pointers that only
+// become constant later, such as those loaded from constant dispatch tables.
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
-// #include "llvm/IR/Function.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
-// #include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Module.h"
-// #include "llvm/IR/Type.h"
 #include "llvm/Pass.h"
-#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Transforms/NVMPass.h"
 
 using namespace llvm;
 
 namespace {
-// This is a ModulePass so that XXX...
+// This is a ModulePass so that it can add global variables.
 class SandboxIndirectCalls : public ModulePass {
+  // The functions of one signature that indirect calls may reach.
+  struct FunctionTable {
+    unsigned Signature;
+    SmallVector<Function *, 8> Functions;
+    // Slot 0, the functions, then padding up to a power of two.
+    SmallVector<Constant *, 8> Slots;
+    GlobalVariable *Table = nullptr;
+  };
+
+  IntegerType *IntPtrType;
+  unsigned SignatureBits;
+  MapVector<FunctionType *, FunctionTable> Tables;
+
+  void buildTable(Module &M, FunctionType *FuncType, FunctionTable &T);
+  void sandboxCall(CallSite Call);
+
 public:
   static char ID; // Pass identification, replacement for typeid
   SandboxIndirectCalls() : ModulePass(ID) {
@@ -40,95 +74,203 @@ char SandboxIndirectCalls::ID = 0;
 INITIALIZE_PASS(SandboxIndirectCalls, "sandbox-indirect-calls",
                 "Add CFI to indirect function calls", false, false)
 
-bool SandboxIndirectCalls::runOnModule(Module &M) {
-  Type *I32 = Type::getInt32Ty(M.getContext());
-  Type *IntPtrType = I32; // XXX
-  PointerType *PtrType = Type::getInt8Ty(M.getContext())->getPointerTo();
-
-  SmallVector<Constant *, 20> FuncTable;
-  // Reserve index 0.
-  FuncTable.push_back(ConstantPointerNull::get(PtrType));
-
-  // Build a function table out of address-taken functions.
-  for (Module::iterator Func = M.begin(), E = M.end(); Func != E; ++Func) {
-    // Look for address-taking references to the function.
-    typedef SmallVector<Value::use_iterator, 10> Users_t;
-    Users_t Users;
-    for (Value::use_iterator U = Func->use_begin(), E = Func->use_end(); U != E;
-         ++U) {
-      if (CallInst *Call = dyn_cast<CallInst>(*U)) {
-        // In PNaCl's normal form, a function referenced by a CallInst
-        // can only appear as the callee, not an argument.
-        if (U->getOperandNo() != Call->getNumArgOperands()) {
-          errs() << "Value: " << **U << "\n";
-          report_fatal_error("SandboxIndirectCalls: Bad function reference");
-        }
-      } else {
-        // In PNaCl's normal form, all other references are PtrToInt
-        // instructions or ConstantExprs.
-        if (!(isa<PtrToIntInst>(*U) ||
-              (isa<ConstantExpr>(*U) &&
-               cast<ConstantExpr>(*U)->getOpcode() == Instruction::PtrToInt))) {
-          errs() << "Value: " << **U << "\n";
-          report_fatal_error("SandboxIndirectCalls: Bad function reference");
-        }
-        Users.push_back(U);
+static bool isCallee(const Use &U) {
+  ImmutableCallSite Call(U.getUser());
+  return Call && Call.isCallee(&U);
+}
+
+static bool isIndirectCall(ImmutableCallSite Call) {
+  const Value *Callee = Call.getCalledValue()->stripPointerCasts();
+  return !isa<Function>(Callee) && !isa<GlobalAlias>(Callee) &&
+         !isa<InlineAsm>(Callee);
+}
+
+// Constants that make up the special llvm.* arrays. Functions listed there
+// keep their real address.
+static void collectReservedConstants(Module &M,
+                                     SmallPtrSetImpl<Constant *> &Reserved) {
+  static const char *const Names[] = {"llvm.used", "llvm.compiler.used",
+                                      "llvm.global_ctors", "llvm.global_dtors"};
+  SmallVector<Constant *, 16> Worklist;
+  for (const char *Name : Names) {
+    GlobalVariable *GV = M.getNamedGlobal(Name);
+    if (GV != nullptr && GV->hasInitializer())
+      Worklist.push_back(GV->getInitializer());
+  }
+  while (!Worklist.empty()) {
+    Constant *C = Worklist.pop_back_val();
+    if (isa<GlobalValue>(C) || !Reserved.insert(C).second)
+      continue;
+    for (Use &Op : C->operands())
+      Worklist.push_back(cast<Constant>(Op.get()));
+  }
+}
+
+static bool isAddressTaken(Constant *V,
+                           const SmallPtrSetImpl<Constant *> &Reserved);
+
+// Whether U takes the address of a function, or of a cast of one.
+static bool isAddressUse(const Use &U,
+                         const SmallPtrSetImpl<Constant *> &Reserved) {
+  User *Usr = U.getUser();
+  if (isCallee(U) || isa<Function>(Usr) || isa<GlobalAlias>(Usr))
+    return false;
+  if (ConstantExpr *CE = dyn_cast<ConstantExpr>(Usr))
+    if (CE->isCast())
+      return isAddressTaken(CE, Reserved);
+  if (Constant *C = dyn_cast<Constant>(Usr))
+    return isa<GlobalValue>(C) || !Reserved.count(C);
+  return true;
+}
+
+static bool isAddressTaken(Constant *V,
+                           const SmallPtrSetImpl<Constant *> &Reserved) {
+  for (const Use &U : V->uses())
+    if (isAddressUse(U, Reserved))
+      return true;
+  return false;
+}
+
+// Replace the uses of V that take its address with Encoded. Calls of V stay
+// direct. Replacing an operand of a constant rebuilds the constant, so look
+// the uses up again after every replacement.
+static void replaceAddressUses(Constant *V, Constant *Encoded,
+                               const SmallPtrSetImpl<Constant *> &Reserved) {
+  for (;;) {
+    Use *Found = nullptr;
+    for (Use &U : V->uses()) {
+      if (isAddressUse(U, Reserved)) {
+        Found = &U;
+        break;
       }
     }
+    if (Found == nullptr)
+      return;
 
-    // If the function is address-taken, allocate it an ID by adding
-    // it to the function table.
-    if (!Users.empty()) {
-      Value *FuncIndex = ConstantInt::get(IntPtrType, FuncTable.size());
-      // XXX: Remove bitcast when we use multiple tables.
-      FuncTable.push_back(ConstantExpr::getBitCast(&(*Func), PtrType));
-
-      for (Users_t::iterator U = Users.begin(), E = Users.end(); U != E; ++U) {
-        Users_t::value_type VU = *U;
-        (*VU)->replaceAllUsesWith(FuncIndex);
-        // XXX: assumes cast is only used once.
-        if (Instruction *Inst = dyn_cast<PtrToIntInst>(*VU))
-          Inst->eraseFromParent();
-      }
+    User *Usr = Found->getUser();
+    ConstantExpr *CE = dyn_cast<ConstantExpr>(Usr);
+    if (GlobalVariable *GV = dyn_cast<GlobalVariable>(Usr))
+      GV->setInitializer(Encoded);
+    else if (CE != nullptr && CE->isCast())
+      replaceAddressUses(
+          CE, ConstantExpr::getCast(CE->getOpcode(), Encoded, CE->getType()),
+          Reserved);
+    else if (Constant *C = dyn_cast<Constant>(Usr))
+      C->handleOperandChange(V, Encoded);
+    else
+      Found->set(Encoded);
+  }
+}
+
+// Fills the unused slots of a table. Calling it traps.
+static Function *createTrapStub(Module &M, FunctionType *FuncType) {
+  Function *Stub = Function::Create(FuncType, GlobalValue::InternalLinkage,
+                                    "__sfi_bad_indirect_call", &M);
+  BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", Stub);
+  CallInst::Create(Intrinsic::getDeclaration(&M, Intrinsic::trap), "", BB)
+      ->setDoesNotReturn();
+  new UnreachableInst(M.getContext(), BB);
+  return Stub;
+}
+
+void SandboxIndirectCalls::buildTable(Module &M, FunctionType *FuncType,
+                                      FunctionTable &T) {
+  Function *Stub = createTrapStub(M, FuncType);
+  uint64_t Size = PowerOf2Ceil(T.Functions.size() + 1);
+
+  T.Slots.push_back(Stub);
+  T.Slots.append(T.Functions.begin(), T.Functions.end());
+  T.Slots.resize(Size, Stub);
+
+  ArrayType *TableType = ArrayType::get(FuncType->getPointerTo(), Size);
+  T.Table = new GlobalVariable(M, TableType, /*isConstant=*/true,
+                               GlobalVariable::InternalLinkage,
+                               ConstantArray::get(TableType, T.Slots),
+                               "__sfi_function_table");
+}
+
+void SandboxIndirectCalls::sandboxCall(CallSite Call) {
+  Instruction *Inst = Call.getInstruction();
+  Value *Callee = Call.getCalledValue();
+  FunctionType *FuncType =
+      cast<FunctionType>(Callee->getType()->getPointerElementType());
+  FunctionTable &T = Tables[FuncType];
+  uint64_t Mask = T.Slots.size() - 1;
+
+  // Devirtualize calls through a constant pointer.
+  if (Constant *C = dyn_cast<Constant>(Callee)) {
+    Constant *Addr = ConstantExpr::getPtrToInt(C, IntPtrType);
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(Addr)) {
+      uint64_t Slot = (CI->getZExtValue() >> SignatureBits) & Mask;
+      Call.setCalledFunction(T.Slots[Slot]);
+      return;
     }
   }
 
-  Constant *TableArray =
-      ConstantArray::get(ArrayType::get(PtrType, FuncTable.size()), FuncTable);
-  Value *FuncTableGV = new GlobalVariable(
-      M, TableArray->getType(), /*isConstant=*/true,
-      GlobalVariable::InternalLinkage, TableArray, "__sfi_function_table");
-
-  // Convert indirect function call instructions.
-  for (Module::iterator Func = M.begin(), E = M.end(); Func != E; ++Func) {
-    for (Function::iterator BB = Func->begin(), E = Func->end(); BB != E;
-         ++BB) {
-      for (BasicBlock::iterator Inst = BB->begin(), E = BB->end(); Inst != E;
-           ++Inst) {
-        assert(!isa<InvokeInst>(Inst));
-        if (CallInst *Call = dyn_cast<CallInst>(Inst)) {
-          Value *Callee = Call->getCalledValue();
-          if (!isa<Function>(Callee)) {
-            // assert...
-            IntToPtrInst *Cast = cast<IntToPtrInst>(Callee);
-            Value *FuncIndex = Cast->getOperand(0);
-
-            Value *Indexes[] = {ConstantInt::get(I32, 0), FuncIndex};
-            Value *Ptr = GetElementPtrInst::Create(
-                Callee->getType(), FuncTableGV, Indexes, "func_gep", Call);
-            Value *FuncPtr = new LoadInst(Ptr, "func", Call);
-            // XXX: Remove bitcast when we use multiple tables.
-            Value *Bitcast =
-                new BitCastInst(FuncPtr, Cast->getType(), "func_bc", Call);
-            Call->setCalledFunction(Bitcast);
-            // XXX: assumes cast is only used once.
-            Cast->eraseFromParent();
-          }
-        }
+  Value *Index = new PtrToIntInst(Callee, IntPtrType, "func_addr", Inst);
+  if (SignatureBits != 0)
+    Index = BinaryOperator::Create(BinaryOperator::LShr, Index,
+                                   ConstantInt::get(IntPtrType, SignatureBits),
+                                   "func_slot", Inst);
+  Index = BinaryOperator::Create(BinaryOperator::And, Index,
+                                 ConstantInt::get(IntPtrType, Mask),
+                                 "func_index", Inst);
+  Value *Indexes[] = {ConstantInt::get(IntPtrType, 0), Index};
+  Value *Ptr = GetElementPtrInst::CreateInBounds(
+      T.Table->getValueType(), T.Table, Indexes, "func_gep", Inst);
+  Call.setCalledFunction(new LoadInst(Ptr, "func", Inst));
+}
+
+bool SandboxIndirectCalls::runOnModule(Module &M) {
+  IntPtrType = M.getDataLayout().getIntPtrType(M.getContext());
+  Tables.clear();
+
+  SmallPtrSet<Constant *, 16> Reserved;
+  collectReservedConstants(M, Reserved);
+
+  // Every signature that is address-taken or called indirectly needs a
+  // table, even if it ends up with nothing but the stub.
+  SmallVector<CallSite, 16> IndirectCalls;
+  for (Function &Func : M) {
+    if (!Func.isIntrinsic() && isAddressTaken(&Func, Reserved))
+      Tables[Func.getFunctionType()].Functions.push_back(&Func);
+
+    for (BasicBlock &BB : Func) {
+      for (Instruction &Inst : BB) {
+        CallSite Call(&Inst);
+        if (!Call || !isIndirectCall(Call))
+          continue;
+        IndirectCalls.push_back(Call);
+        Tables[cast<FunctionType>(
+            Call.getCalledValue()->getType()->getPointerElementType())];
       }
     }
   }
+  if (Tables.empty())
+    return false;
+
+  SignatureBits = Log2_64_Ceil(Tables.size());
+  unsigned Signature = 0;
+  for (auto &Entry : Tables) {
+    FunctionTable &T = Entry.second;
+    T.Signature = Signature++;
+    for (unsigned i = 0, e = T.Functions.size(); i != e; ++i) {
+      Function *Func = T.Functions[i];
+      uint64_t Encoded = (uint64_t(i + 1) << SignatureBits) | T.Signature;
+      replaceAddressUses(
+          Func,
+          ConstantExpr::getIntToPtr(ConstantInt::get(IntPtrType, Encoded),
+                                    Func->getType()),
+          Reserved);
+    }
+  }
+
+  // The tables are the only place left that holds the real addresses.
+  for (auto &Entry : Tables)
+    buildTable(M, Entry.first, Entry.second);
 
+  for (CallSite Call : IndirectCalls)
+    sandboxCall(Call);
   return true;
 }
 
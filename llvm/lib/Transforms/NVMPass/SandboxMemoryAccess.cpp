@@ -7,33 +7,107 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// XXX
+// Confines every load, store and memory intrinsic to the sandbox at
+// __sfi_memory_base. Accesses at small constant offsets from the same root
+// pointer share one confined base, computed where it dominates all of them
+// and outside of loops the root is invariant in.
+//
+// In mask mode, the sandbox is 2^SizeBits bytes and pointers are confined by
+// masking them to that many bits instead of truncating them to 32.
+//
+// Pointers passed to host functions are confined as well, null pointers
+// excepted. The __sfi_* cells of the runtime, which ExpandAllocas accesses,
+// live outside the sandbox and are left alone.
+//
+// In guard-region mode, larger constant offsets and a 32-bit scaled index are
+// added to the confined base as well. Wrapping accesses then land in the
+// guard region after the sandbox instead of being folded back into it.
+//
+// Memory intrinsics only have their start confined, and their length is up to
+// the contract, so they are also checked to end inside the sandbox; those that
+// would not fault on the first byte of the guard region instead of running.
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 // #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/NVMPass.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 using namespace llvm;
 
+static cl::opt<SandboxMode> SandboxModeOpt(
+    "sandbox-mode", cl::desc("How to confine contract memory accesses"),
+    cl::init(SandboxMode::Truncate),
+    cl::values(clEnumValN(SandboxMode::Truncate, "truncate",
+                          "Keep the low 32 bits of pointers"),
+               clEnumValN(SandboxMode::GuardRegion, "guard-region",
+                          "Rely on a 4 GiB guard region after the sandbox"),
+               clEnumValN(SandboxMode::Mask, "mask",
+                          "Mask pointers to the sandbox size")));
+
+static cl::opt<unsigned> SandboxSizeBitsOpt(
+    "sandbox-size-bits",
+    cl::desc("log2 of the sandbox size in mask mode (16 to 32)"),
+    cl::init(28));
+
+// A pointer is confined by keeping its low 32 bits, which lands it inside the
+// 4 GiB sandbox. Constant offsets below the guard size are added after
+// confinement instead: at worst they reach into the guard region.
+static const uint64_t TruncateGuardSize = 0x10000;
+static const uint64_t GuardRegionGuardSize = uint64_t(1) << 32;
+
 namespace {
+// A memory access operand, as a root pointer plus either a constant offset
+// or a scaled index.
+struct SandboxedAccess {
+  Instruction *Inst;
+  unsigned OpNum;
+  uint64_t Offset;
+  Value *Index;
+  uint64_t Scale;
+};
+
 // This is a ModulePass so that XXX...
 class SandboxMemoryAccesses : public ModulePass {
+  SandboxMode Mode;
+  unsigned SizeBits;
+  uint64_t GuardSize;
   Value *MemBaseVar;
   Value *MemBase;
 
-  Value *sandboxPtr(Value *Ptr, Instruction *InsertPt);
-  void sandboxOperand(Instruction *Inst, unsigned OpNum);
+  Value *getRoot(Value *Ptr, uint64_t &Offset, Value *&Index, uint64_t &Scale,
+                 const DataLayout &DL);
+  Instruction *getBaseInsertPt(Value *Root,
+                               ArrayRef<SandboxedAccess> Accesses,
+                               DominatorTree &DT, LoopInfo &LI);
+  Value *sandboxRoot(Value *Root, Instruction *InsertPt);
+  void insertRangeCheck(MemIntrinsic *MI, Value *Addr);
   void convertFunc(Function *Func);
 
 public:
   static char ID; // Pass identification, replacement for typeid
-  SandboxMemoryAccesses() : ModulePass(ID) {
+  SandboxMemoryAccesses(SandboxMode Mode = SandboxModeOpt,
+                        unsigned SizeBits = SandboxSizeBitsOpt)
+      : ModulePass(ID), Mode(Mode),
+        SizeBits(Mode == SandboxMode::Mask ? SizeBits : 32),
+        GuardSize(Mode == SandboxMode::GuardRegion ? GuardRegionGuardSize
+                                                   : TruncateGuardSize) {
+    if (this->SizeBits < 16 || this->SizeBits > 32)
+      report_fatal_error("sandbox size must be between 2^16 and 2^32 bytes");
     initializeSandboxMemoryAccessesPass(*PassRegistry::getPassRegistry());
   }
 
@@ -45,16 +119,33 @@ char SandboxMemoryAccesses::ID = 0;
 INITIALIZE_PASS(SandboxMemoryAccesses, "sandbox-memory-accesses",
                 "Add SFI sandboxing to memory accesses", false, false)
 
-Value *SandboxMemoryAccesses::sandboxPtr(Value *Ptr, Instruction *InsertPt) {
-  if (!MemBase) {
-    Function *Func = InsertPt->getParent()->getParent();
-    Instruction *MemBaseInst = new LoadInst(MemBaseVar, "mem_base");
-    Func->getEntryBlock().getInstList().push_front(MemBaseInst);
-    MemBase = MemBaseInst;
-  }
+// The stack cells ExpandAllocas reads and writes. Contracts cannot name them.
+static bool isRuntimeCell(Value *Ptr) {
+  GlobalVariable *GV = dyn_cast<GlobalVariable>(Ptr->stripPointerCasts());
+  return GV && GV->getName().startswith("__sfi_");
+}
 
-  Type *I32 = Type::getInt32Ty(InsertPt->getContext());
-  Type *I64 = Type::getInt64Ty(InsertPt->getContext());
+// Calls to functions of the host, outside the sandbox.
+static bool isHostCall(Instruction *Inst) {
+  CallInst *Call = dyn_cast<CallInst>(Inst);
+  Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+  return Callee && Callee->isDeclaration() && !Callee->isIntrinsic();
+}
+
+static Value *setNoOffset(Value *Ptr, uint64_t &Offset) {
+  Offset = 0;
+  return Ptr;
+}
+
+// Split Ptr into a root and a small constant offset, so that all accesses off
+// the same root share one confined base. In guard-region mode, a GEP whose
+// only variable index is the last one is split into its pointer operand and
+// the scaled index instead.
+Value *SandboxMemoryAccesses::getRoot(Value *Ptr, uint64_t &Offset,
+                                      Value *&Index, uint64_t &Scale,
+                                      const DataLayout &DL) {
+  Index = nullptr;
+  Scale = 0;
 
   // Look for the pattern produced by ExpandGetElementPtr.
   // TODO: ExpandGetElementPtr should really put a "nuw" attr on the
@@ -63,49 +154,270 @@ Value *SandboxMemoryAccesses::sandboxPtr(Value *Ptr, Instruction *InsertPt) {
     if (BinaryOperator *Op = dyn_cast<BinaryOperator>(Cast->getOperand(0))) {
       if (Op->getOpcode() == Instruction::Add) {
         if (ConstantInt *CI = dyn_cast<ConstantInt>(Op->getOperand(1))) {
-          uint64_t Addend = CI->getZExtValue();
-          if (Addend < 0x10000) {
-            Value *ZExt = new ZExtInst(Op->getOperand(0), I64, "", InsertPt);
-            Value *Add1 = BinaryOperator::Create(BinaryOperator::Add, MemBase,
-                                                 ZExt, "", InsertPt);
-            Value *Add2 = BinaryOperator::Create(BinaryOperator::Add, Add1,
-                                                 ConstantInt::get(I64, Addend),
-                                                 "", InsertPt);
-            return new IntToPtrInst(Add2, Ptr->getType(), "", InsertPt);
+          if (CI->getValue().ult(GuardSize)) {
+            Offset = CI->getZExtValue();
+            return Op->getOperand(0);
           }
         }
       }
     }
   }
 
-  Value *Truncated = new PtrToIntInst(Ptr, I32, "", InsertPt);
-  Value *ZExt = new ZExtInst(Truncated, I64, "", InsertPt);
-  Value *Added =
-      BinaryOperator::Create(BinaryOperator::Add, MemBase, ZExt, "", InsertPt);
-  return new IntToPtrInst(Added, Ptr->getType(), "", InsertPt);
+  // Constant-index GEPs and bitcasts off the same pointer. A GEP with a
+  // variable index is its own base, at offset 0; leave it to the index
+  // folding below.
+  int64_t ByteOffset = 0;
+  Value *Base = GetPointerBaseWithConstantOffset(Ptr, ByteOffset, DL);
+  GEPOperator *BaseGEP = dyn_cast<GEPOperator>(Base);
+  bool FoldIndex = Mode == SandboxMode::GuardRegion && ByteOffset == 0 &&
+                   BaseGEP && !BaseGEP->hasAllConstantIndices();
+  if (!FoldIndex && ByteOffset >= 0 && uint64_t(ByteOffset) < GuardSize) {
+    Offset = ByteOffset;
+    return Base;
+  }
+
+  // The confined root and the scaled index are both below 4 GiB, so their sum
+  // stays within the sandbox and its guard region. Negative indices would
+  // wrap into the guard region instead of back into the sandbox, so the
+  // index must be known to be non-negative.
+  GEPOperator *GEP = dyn_cast<GEPOperator>(Ptr->stripPointerCasts());
+  if (Mode != SandboxMode::GuardRegion || !GEP || GEP->hasAllConstantIndices())
+    return setNoOffset(Ptr, Offset);
+
+  Value *LastIdx = *(GEP->idx_end() - 1);
+  SmallVector<Value *, 4> Leading(GEP->idx_begin(), GEP->idx_end() - 1);
+  for (Value *Idx : Leading)
+    if (!isa<ConstantInt>(Idx))
+      return setNoOffset(Ptr, Offset);
+  if (!isKnownNonNegative(LastIdx, DL))
+    return setNoOffset(Ptr, Offset);
+
+  Type *ElemTy = GEP->getSourceElementType();
+  if (!Leading.empty()) {
+    if (DL.getIndexedOffsetInType(ElemTy, Leading) != 0)
+      return setNoOffset(Ptr, Offset);
+    SequentialType *Seq = dyn_cast_or_null<SequentialType>(
+        GetElementPtrInst::getIndexedType(ElemTy, Leading));
+    if (!Seq)
+      return setNoOffset(Ptr, Offset);
+    ElemTy = Seq->getElementType();
+  }
+  uint64_t ElemSize = DL.getTypeAllocSize(ElemTy);
+  if (ElemSize >= GuardRegionGuardSize)
+    return setNoOffset(Ptr, Offset);
+
+  Offset = 0;
+  Index = LastIdx;
+  Scale = ElemSize;
+  return GEP->getPointerOperand();
+}
+
+// Pick where to confine Root once for all of its accesses: the nearest point
+// dominating them, hoisted out of every loop Root is invariant in. Returns
+// null if Root is not available there.
+Instruction *
+SandboxMemoryAccesses::getBaseInsertPt(Value *Root,
+                                       ArrayRef<SandboxedAccess> Accesses,
+                                       DominatorTree &DT, LoopInfo &LI) {
+  BasicBlock *BB = Accesses.front().Inst->getParent();
+  SmallPtrSet<Instruction *, 8> AccessInsts;
+  for (const SandboxedAccess &Access : Accesses) {
+    BB = DT.findNearestCommonDominator(BB, Access.Inst->getParent());
+    AccessInsts.insert(Access.Inst);
+  }
+
+  // Right before the first access in that block, if there is one.
+  Instruction *InsertPt = BB->getTerminator();
+  for (Instruction &Inst : *BB) {
+    if (AccessInsts.count(&Inst)) {
+      InsertPt = &Inst;
+      break;
+    }
+  }
+
+  Instruction *RootInst = dyn_cast<Instruction>(Root);
+  if (RootInst && !DT.dominates(RootInst, InsertPt))
+    return nullptr;
+
+  while (Loop *L = LI.getLoopFor(InsertPt->getParent())) {
+    BasicBlock *Preheader = L->getLoopPreheader();
+    if (!Preheader || (RootInst && L->contains(RootInst)))
+      break;
+    if (RootInst && !DT.dominates(RootInst, Preheader->getTerminator()))
+      break;
+    InsertPt = Preheader->getTerminator();
+  }
+  return InsertPt;
+}
+
+// Confine Root to the sandbox, returning the address as an i64.
+Value *SandboxMemoryAccesses::sandboxRoot(Value *Root, Instruction *InsertPt) {
+  Type *I32 = Type::getInt32Ty(InsertPt->getContext());
+  Type *I64 = Type::getInt64Ty(InsertPt->getContext());
+
+  Value *Confined;
+  if (Mode == SandboxMode::Mask) {
+    Value *Int;
+    if (Root->getType()->isPointerTy())
+      Int = new PtrToIntInst(Root, I64, "", InsertPt);
+    else
+      Int = CastInst::CreateIntegerCast(Root, I64, /*isSigned=*/false, "",
+                                        InsertPt);
+    uint64_t Mask = (uint64_t(1) << SizeBits) - 1;
+    Confined = BinaryOperator::Create(BinaryOperator::And, Int,
+                                      ConstantInt::get(I64, Mask), "",
+                                      InsertPt);
+  } else {
+    Value *Truncated;
+    if (Root->getType()->isPointerTy())
+      Truncated = new PtrToIntInst(Root, I32, "", InsertPt);
+    else
+      Truncated = CastInst::CreateIntegerCast(Root, I32, /*isSigned=*/false,
+                                              "", InsertPt);
+    Confined = new ZExtInst(Truncated, I64, "", InsertPt);
+  }
+  return BinaryOperator::Create(BinaryOperator::Add, MemBase, Confined, "",
+                                InsertPt);
 }
 
-void SandboxMemoryAccesses::sandboxOperand(Instruction *Inst, unsigned OpNum) {
-  Inst->setOperand(OpNum, sandboxPtr(Inst->getOperand(OpNum), Inst));
+// Fault on the guard region unless the Len bytes of MI at the confined Addr
+// end inside the sandbox.
+void SandboxMemoryAccesses::insertRangeCheck(MemIntrinsic *MI, Value *Addr) {
+  Type *I8 = Type::getInt8Ty(MI->getContext());
+  Type *I64 = Type::getInt64Ty(MI->getContext());
+  Constant *Size = ConstantInt::get(I64, uint64_t(1) << SizeBits);
+
+  Value *Len = CastInst::CreateZExtOrBitCast(MI->getLength(), I64, "", MI);
+  Value *Off = BinaryOperator::Create(BinaryOperator::Sub, Addr, MemBase, "",
+                                      MI);
+  Value *PastEnd = new ICmpInst(MI, ICmpInst::ICMP_UGT, Off, Size);
+  Value *Room = BinaryOperator::Create(BinaryOperator::Sub, Size, Off, "", MI);
+  Value *TooLong = new ICmpInst(MI, ICmpInst::ICMP_UGT, Len, Room);
+  Value *OutOfBounds = BinaryOperator::Create(BinaryOperator::Or, PastEnd,
+                                              TooLong, "out_of_bounds", MI);
+
+  MDNode *Unlikely =
+      MDBuilder(MI->getContext()).createBranchWeights(1, 1 << 20);
+  TerminatorInst *Trap = SplitBlockAndInsertIfThen(
+      OutOfBounds, MI, /*Unreachable=*/true, Unlikely);
+  Value *Guard = BinaryOperator::Create(BinaryOperator::Add, MemBase, Size,
+                                        "", Trap);
+  Guard = new IntToPtrInst(Guard, PointerType::getUnqual(I8), "", Trap);
+  new LoadInst(Guard, "", /*isVolatile=*/true, Trap);
 }
 
 void SandboxMemoryAccesses::convertFunc(Function *Func) {
-  MemBase = NULL;
+  // Skip function declarations.
+  if (Func->empty())
+    return;
+
+  const DataLayout &DL = Func->getParent()->getDataLayout();
+
+  // Group the accesses by root, in program order.
+  MapVector<Value *, SmallVector<SandboxedAccess, 4>> Roots;
+  SmallVector<CallInst *, 8> HostCalls;
+  auto addAccess = [&](Instruction *Inst, unsigned OpNum) {
+    if (isRuntimeCell(Inst->getOperand(OpNum)))
+      return;
+    uint64_t Offset, Scale;
+    Value *Index;
+    Value *Root = getRoot(Inst->getOperand(OpNum), Offset, Index, Scale, DL);
+    Roots[Root].push_back({Inst, OpNum, Offset, Index, Scale});
+  };
   for (Function::iterator BB = Func->begin(), E = Func->end(); BB != E; ++BB) {
     for (BasicBlock::iterator Inst = BB->begin(), E = BB->end(); Inst != E;
          ++Inst) {
       if (isa<LoadInst>(Inst)) {
-        sandboxOperand(&(*Inst), 0);
+        addAccess(&(*Inst), 0);
       } else if (isa<StoreInst>(Inst)) {
-        sandboxOperand(&(*Inst), 1);
+        addAccess(&(*Inst), 1);
       } else if (isa<MemCpyInst>(Inst) || isa<MemMoveInst>(Inst)) {
-        sandboxOperand(&(*Inst), 0);
-        sandboxOperand(&(*Inst), 1);
+        addAccess(&(*Inst), 0);
+        addAccess(&(*Inst), 1);
       } else if (isa<MemSetInst>(Inst)) {
-        sandboxOperand(&(*Inst), 0);
+        addAccess(&(*Inst), 0);
+      } else if (isa<AtomicCmpXchgInst>(Inst) || isa<AtomicRMWInst>(Inst)) {
+        addAccess(&(*Inst), 0);
+      } else if (isHostCall(&(*Inst))) {
+        HostCalls.push_back(cast<CallInst>(&(*Inst)));
       }
     }
   }
+  if (Roots.empty() && HostCalls.empty())
+    return;
+
+  Instruction *MemBaseInst = new LoadInst(MemBaseVar, "mem_base");
+  // The sandbox does not move while contract code runs.
+  MemBaseInst->setMetadata(LLVMContext::MD_invariant_load,
+                           MDNode::get(Func->getContext(), None));
+  Func->getEntryBlock().getInstList().push_front(MemBaseInst);
+  MemBase = MemBaseInst;
+
+  // Only instructions are inserted from here on, so the analyses stay valid.
+  DominatorTree DT(*Func);
+  LoopInfo LI(DT);
+  Type *I32 = Type::getInt32Ty(Func->getContext());
+  Type *I64 = Type::getInt64Ty(Func->getContext());
+  SmallVector<std::pair<MemIntrinsic *, Value *>, 4> RangeChecks;
+  for (auto &Entry : Roots) {
+    Value *Root = Entry.first;
+    Instruction *InsertPt = getBaseInsertPt(Root, Entry.second, DT, LI);
+    Value *Base = InsertPt ? sandboxRoot(Root, InsertPt) : nullptr;
+
+    for (const SandboxedAccess &Access : Entry.second) {
+      Instruction *Inst = Access.Inst;
+      Value *Addr = Base ? Base : sandboxRoot(Root, Inst);
+      // Kept as plain arithmetic so it folds into the addressing mode.
+      if (Access.Offset != 0)
+        Addr = BinaryOperator::Create(BinaryOperator::Add, Addr,
+                                      ConstantInt::get(I64, Access.Offset),
+                                      "", Inst);
+      if (Access.Index != nullptr) {
+        // Scale in 32 bits so the byte offset stays below 4 GiB.
+        Value *Idx = CastInst::CreateIntegerCast(Access.Index, I32,
+                                                 /*isSigned=*/false, "", Inst);
+        Idx = BinaryOperator::Create(BinaryOperator::Mul, Idx,
+                                     ConstantInt::get(I32, Access.Scale), "",
+                                     Inst);
+        Idx = new ZExtInst(Idx, I64, "", Inst);
+        Addr = BinaryOperator::Create(BinaryOperator::Add, Addr, Idx, "", Inst);
+      }
+      Type *PtrTy = Inst->getOperand(Access.OpNum)->getType();
+      Inst->setOperand(Access.OpNum, new IntToPtrInst(Addr, PtrTy, "", Inst));
+
+      // Without an index, a constant length reaching no further than the
+      // offsets getRoot folds stays within the guard region.
+      if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(Inst)) {
+        ConstantInt *Len = dyn_cast<ConstantInt>(MI->getLength());
+        if (!Len || Access.Index != nullptr ||
+            Access.Offset > TruncateGuardSize ||
+            Len->getValue().ugt(TruncateGuardSize - Access.Offset))
+          RangeChecks.push_back({MI, Addr});
+      }
+    }
+  }
+
+  // Host functions may take null for an optional argument, and function
+  // pointers never point into the sandbox.
+  for (CallInst *Call : HostCalls) {
+    for (unsigned I = 0, E = Call->getNumArgOperands(); I != E; ++I) {
+      Value *Arg = Call->getArgOperand(I);
+      PointerType *PtrTy = dyn_cast<PointerType>(Arg->getType());
+      if (!PtrTy || PtrTy->getElementType()->isFunctionTy() ||
+          isa<ConstantPointerNull>(Arg))
+        continue;
+      Value *Confined =
+          new IntToPtrInst(sandboxRoot(Arg, Call), PtrTy, "", Call);
+      Value *IsNull = new ICmpInst(Call, ICmpInst::ICMP_EQ, Arg,
+                                   ConstantPointerNull::get(PtrTy));
+      Call->setArgOperand(I, SelectInst::Create(IsNull, Arg, Confined, "",
+                                                Call));
+    }
+  }
+
+  // Splits blocks, so last.
+  for (auto &Check : RangeChecks)
+    insertRangeCheck(Check.first, Check.second);
 }
 
 bool SandboxMemoryAccesses::runOnModule(Module &M) {
@@ -120,3 +432,8 @@ bool SandboxMemoryAccesses::runOnModule(Module &M) {
 ModulePass *llvm::createSandboxMemoryAccessesPass() {
   return new SandboxMemoryAccesses();
 }
+
+ModulePass *llvm::createSandboxMemoryAccessesPass(SandboxMode Mode,
+                                                  unsigned SizeBits) {
+  return new SandboxMemoryAccesses(Mode, SizeBits);
+}
@@ -0,0 +1,12 @@
+// Host imports available to the benchmark contracts. Every contract exports
+// its workload as
+//
+//   int bench_main(size_t len, const uint8_t *data);
+
+#include <stddef.h>
+#include <stdint.h>
+
+int64_t nvm_storage_get(const uint8_t *key, uint64_t keyLen, uint8_t *value,
+                        uint64_t capacity);
+void nvm_storage_put(const uint8_t *key, uint64_t keyLen,
+                     const uint8_t *value, uint64_t valueLen);
@@ -0,0 +1,33 @@
+// Deep and branchy recursion: dominated by calls, where the per-call gas
+// write-back and the stack checks show up.
+
+#include "nvm_bench.h"
+
+static int fib(int n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }
+
+static unsigned ackermann(unsigned m, unsigned n) {
+  if (m == 0)
+    return n + 1;
+  if (n == 0)
+    return ackermann(m - 1, 1);
+  return ackermann(m - 1, ackermann(m, n - 1));
+}
+
+// Sums a path through an implicit binary tree, using a stack frame with an
+// array to exercise frame layout.
+static uint64_t walk(unsigned depth, uint64_t node) {
+  uint64_t scratch[8];
+  for (int i = 0; i < 8; ++i)
+    scratch[i] = node * (i + 1);
+  if (depth == 0)
+    return scratch[node & 7];
+  return scratch[depth & 7] + walk(depth - 1, node * 2) +
+         walk(depth - 1, node * 2 + 1) % 3;
+}
+
+int bench_main(size_t len, const uint8_t *data) {
+  int result = fib(24);
+  result += (int)ackermann(2, 200);
+  result += (int)(walk(14, 1) & 0xffff);
+  return result;
+}
@@ -0,0 +1,62 @@
+// A contract-side hash map mirrored into storage: many small memory accesses
+// and host calls with short keys.
+
+#include "nvm_bench.h"
+
+#define SLOTS 8192
+#define ENTRIES 4096
+#define LOOKUPS 20000
+
+struct entry {
+  uint64_t key;
+  uint64_t value;
+  int used;
+};
+
+static struct entry table[SLOTS];
+
+static uint64_t hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static struct entry *find(uint64_t key) {
+  uint64_t slot = hash(key) & (SLOTS - 1);
+  while (table[slot].used && table[slot].key != key)
+    slot = (slot + 1) & (SLOTS - 1);
+  return &table[slot];
+}
+
+static void put(uint64_t key, uint64_t value) {
+  struct entry *e = find(key);
+  e->key = key;
+  e->value = value;
+  e->used = 1;
+  nvm_storage_put((const uint8_t *)&key, sizeof(key),
+                  (const uint8_t *)&value, sizeof(value));
+}
+
+int bench_main(size_t len, const uint8_t *data) {
+  for (uint64_t i = 0; i < ENTRIES; ++i)
+    put(i * 7919, i);
+
+  uint64_t hits = 0;
+  for (uint64_t i = 0; i < LOOKUPS; ++i) {
+    uint64_t key = (i % (2 * ENTRIES)) * 7919;
+    struct entry *e = find(key);
+    if (!e->used)
+      continue;
+    // Every tenth lookup goes to storage instead.
+    if (i % 10 == 0) {
+      uint64_t value = 0;
+      nvm_storage_get((const uint8_t *)&key, sizeof(key), (uint8_t *)&value,
+                      sizeof(value));
+      hits += value == e->value;
+    } else {
+      ++hits;
+    }
+  }
+  return (int)hits;
+}
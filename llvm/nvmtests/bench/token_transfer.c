@@ -0,0 +1,66 @@
+// Token transfers between accounts kept in contract storage, the shape of
+// most contract calls on chain.
+
+#include "nvm_bench.h"
+
+#define ACCOUNTS 256
+#define TRANSFERS 4000
+
+static uint32_t seed = 12345;
+
+static uint32_t next_random() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static void account_key(uint32_t account, uint8_t key[12]) {
+  const char prefix[] = "balance:";
+  for (int i = 0; i < 8; ++i)
+    key[i] = prefix[i];
+  key[8] = account >> 24;
+  key[9] = account >> 16;
+  key[10] = account >> 8;
+  key[11] = account;
+}
+
+static uint64_t get_balance(uint32_t account) {
+  uint8_t key[12];
+  uint64_t balance = 0;
+  account_key(account, key);
+  if (nvm_storage_get(key, sizeof(key), (uint8_t *)&balance,
+                      sizeof(balance)) < 0)
+    return 0;
+  return balance;
+}
+
+static void set_balance(uint32_t account, uint64_t balance) {
+  uint8_t key[12];
+  account_key(account, key);
+  nvm_storage_put(key, sizeof(key), (const uint8_t *)&balance,
+                  sizeof(balance));
+}
+
+static int transfer(uint32_t from, uint32_t to, uint64_t amount) {
+  uint64_t balance = get_balance(from);
+  if (balance < amount || from == to)
+    return 0;
+  set_balance(from, balance - amount);
+  set_balance(to, get_balance(to) + amount);
+  return 1;
+}
+
+int bench_main(size_t len, const uint8_t *data) {
+  for (uint32_t i = 0; i < ACCOUNTS; ++i)
+    set_balance(i, 1000000);
+
+  int succeeded = 0;
+  for (int i = 0; i < TRANSFERS; ++i)
+    succeeded += transfer(next_random() % ACCOUNTS, next_random() % ACCOUNTS,
+                          next_random() % 10000);
+
+  // Transfers never create or destroy tokens.
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < ACCOUNTS; ++i)
+    total += get_balance(i);
+  return total == (uint64_t)ACCOUNTS * 1000000 ? succeeded : -1;
+}
@@ -0,0 +1,9 @@
+; llvm.round lowers to a libcall; at fp128 that is a soft-float routine no
+; import table declares.
+define void @nebulas_main() {
+entry:
+  %r = call fp128 @llvm.round.f128(fp128 0xL00000000000000003FFF800000000000)
+  ret void
+}
+
+declare fp128 @llvm.round.f128(fp128)
@@ -0,0 +1,8 @@
+; Overflow checked 128-bit multiplication lowers to the compiler runtime.
+define void @nebulas_main() {
+entry:
+  %r = call { i128, i1 } @llvm.umul.with.overflow.i128(i128 3, i128 5)
+  ret void
+}
+
+declare { i128, i1 } @llvm.umul.with.overflow.i128(i128, i128)
@@ -0,0 +1,19 @@
+; Variable arguments are read off the native stack, outside the sandbox.
+define i32 @sum(i32 %n, ...) {
+entry:
+  %ap = alloca i8*
+  %ap1 = bitcast i8** %ap to i8*
+  call void @llvm.va_start(i8* %ap1)
+  %v = va_arg i8** %ap, i32
+  call void @llvm.va_end(i8* %ap1)
+  ret i32 %v
+}
+
+define void @nebulas_main() {
+entry:
+  %s = call i32 (i32, ...) @sum(i32 1, i32 2)
+  ret void
+}
+
+declare void @llvm.va_start(i8*)
+declare void @llvm.va_end(i8*)
@@ -1,26 +1,46 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Host function, see nebulas_log. Contracts format their output themselves.
+void nvm_log(const uint8_t *msg, uint64_t len);
+
+#define LOG(literal) nvm_log((const uint8_t *)(literal), sizeof(literal) - 1)
+
+static void log_int(int v) {
+  char buf[12];
+  size_t pos = sizeof(buf);
+  unsigned int u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+  do {
+    buf[--pos] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (v < 0)
+    buf[--pos] = '-';
+  nvm_log((const uint8_t *)buf + pos, sizeof(buf) - pos);
+}
 
-#include <stdio.h>
-
-
-void func_a() { printf("called to func_a.\n"); }
+void func_a() { LOG("called to func_a.\n"); }
 
 void func_b() {
   int v = 0;
-  printf("called to func_b, dice is %d.\n", v);
+  LOG("called to func_b, dice is ");
+  log_int(v);
+  LOG(".\n");
 }
 
 void func_c_with_param(int a){
-  printf("called to func_c_with_param: %d.\n", a);
+  LOG("called to func_c_with_param: ");
+  log_int(a);
+  LOG(".\n");
 }
 
 int func_d_with_ret(){
-  printf("called to func_d_with_ret.\n");
+  LOG("called to func_d_with_ret.\n");
   return 0;
 }
 
 void nebulas_main(){
-  printf("called to main.\n");
+  LOG("called to main.\n");
   func_a();
   func_b();
 }
-
@@ -0,0 +1,99 @@
+; RUN: opt < %s -expand-allocas -S | FileCheck %s
+
+declare void @callee(i8*)
+
+; The frame is laid out by decreasing alignment, checked against the limit
+; before it is used, and published to the callee.
+define void @frame() {
+; CHECK-LABEL: define void @frame(
+; CHECK-NEXT: %frame_top = load i64, i64* @__sfi_stack
+; CHECK-NEXT: %stack_limit = load i64, i64* @__sfi_stack_limit, !invariant.load
+; CHECK-NEXT: [[SUB:%.*]] = sub i64 %frame_top, 64
+; CHECK-NEXT: %frame_bottom = and i64 [[SUB]], -8
+; CHECK-NEXT: [[QUAD:%.*]] = add i64 %frame_bottom, 0
+; CHECK-NEXT: %quad = inttoptr i64 [[QUAD]] to i64*
+; CHECK-NEXT: [[PAIR:%.*]] = add i64 %frame_bottom, 8
+; CHECK-NEXT: %pair = inttoptr i64 [[PAIR]] to [2 x i32]*
+; CHECK-NEXT: [[BYTE:%.*]] = add i64 %frame_bottom, 16
+; CHECK-NEXT: %byte = inttoptr i64 [[BYTE]] to i8*
+; CHECK-NEXT: %stack_below_limit = icmp ult i64 %frame_bottom, %stack_limit
+; CHECK-NEXT: %stack_wrapped = icmp ugt i64 %frame_bottom, %frame_top
+; CHECK-NEXT: %stack_overflow = or i1 %stack_below_limit, %stack_wrapped
+; CHECK-NEXT: br i1 %stack_overflow, label %[[TRAP:.*]], label %[[OK:.*]], !prof
+; CHECK: [[TRAP]]:
+; CHECK-NEXT: call void @__nvm_stack_overflow() [[NORETURN:#[0-9]+]]
+; CHECK-NEXT: unreachable
+; CHECK: [[OK]]:
+; CHECK-NEXT: store i64 %frame_bottom, i64* @__sfi_stack
+; CHECK-NEXT: call void @callee(i8* %byte)
+; CHECK-NEXT: store i64 %frame_top, i64* @__sfi_stack
+; CHECK-NEXT: ret void
+  %byte = alloca i8
+  %quad = alloca i64
+  %pair = alloca [2 x i32]
+  call void @callee(i8* %byte)
+  ret void
+}
+
+; Small leaf frames fit in the red zone below the limit: no check, and the
+; stack pointer stays where it is.
+define i32 @leaf(i32 %x) {
+; CHECK-LABEL: define i32 @leaf(
+; CHECK-NEXT: %frame_top = load i64, i64* @__sfi_stack
+; CHECK-NOT: @__sfi_stack_limit
+; CHECK-NOT: @__nvm_stack_overflow
+; CHECK-NOT: store i64 {{.*}} @__sfi_stack
+; CHECK: ret i32
+  %slot = alloca i32
+  store i32 %x, i32* %slot
+  %v = load i32, i32* %slot
+  ret i32 %v
+}
+
+; Larger ones do not.
+define void @big_leaf() {
+; CHECK-LABEL: define void @big_leaf(
+; CHECK: %stack_limit = load i64, i64* @__sfi_stack_limit
+; CHECK: %frame_bottom = and i64 {{.*}}, -1
+; CHECK: icmp ult i64 %frame_bottom, %stack_limit
+; CHECK: call void @__nvm_stack_overflow()
+; CHECK-NOT: store i64 {{.*}} @__sfi_stack
+; CHECK: ret void
+  %buf = alloca [8192 x i8]
+  %p = getelementptr [8192 x i8], [8192 x i8]* %buf, i64 0, i64 0
+  store i8 0, i8* %p
+  ret void
+}
+
+; Functions that call out take a minimum frame even without allocas, so that
+; recursion runs into the limit.
+define i32 @recurse(i32 %n) {
+; CHECK-LABEL: define i32 @recurse(
+; CHECK-NEXT: %frame_top = load i64, i64* @__sfi_stack
+; CHECK-NEXT: %stack_limit = load i64, i64* @__sfi_stack_limit, !invariant.load
+; CHECK-NEXT: [[SUB:%.*]] = sub i64 %frame_top, 64
+; CHECK-NEXT: %frame_bottom = and i64 [[SUB]], -1
+; CHECK-NEXT: %stack_below_limit = icmp ult i64 %frame_bottom, %stack_limit
+; CHECK: br i1 %stack_overflow, label %[[TRAP:.*]], label %[[OK:.*]], !prof
+; CHECK: [[TRAP]]:
+; CHECK-NEXT: call void @__nvm_stack_overflow() [[NORETURN]]
+; CHECK: [[OK]]:
+; CHECK-NEXT: store i64 %frame_bottom, i64* @__sfi_stack
+; CHECK: %r = call i32 @recurse(i32 %m)
+; CHECK-NEXT: store i64 %frame_top, i64* @__sfi_stack
+; CHECK-NEXT: ret i32 %r
+  %m = add i32 %n, 1
+  %r = call i32 @recurse(i32 %m)
+  ret i32 %r
+}
+
+; Leaves without allocas are left alone.
+define i32 @plain(i32 %n) {
+; CHECK-LABEL: define i32 @plain(
+; CHECK-NEXT: %m = add i32 %n, 1
+; CHECK-NEXT: ret i32 %m
+  %m = add i32 %n, 1
+  ret i32 %m
+}
+
+; CHECK: attributes [[NORETURN]] = { noreturn }
@@ -0,0 +1,82 @@
+; RUN: opt < %s -gas-metering -S | FileCheck %s
+
+declare void @llvm.memset.p0i8.i64(i8*, i8, i64, i32, i1)
+declare void @callee()
+
+; Each block charges its static cost on entry; only the loop latch checks the
+; limit.
+define i32 @loop(i32 %n) {
+; CHECK-LABEL: define i32 @loop(
+; CHECK: entry:
+; CHECK-NEXT: %gas_used = load i64, i64* @__nvm_gas_used
+; CHECK-NEXT: %gas_limit = load i64, i64* @__nvm_gas_limit, !invariant.load
+; CHECK-NEXT: [[ENTRY:%.*]] = add i64 %gas_used, 1
+; CHECK-NEXT: br label %loop
+; CHECK: loop:
+; CHECK-NEXT: [[GAS:%.*]] = phi i64 [ [[ENTRY]], %entry ], [ [[BODY:%.*]], %{{.*}} ]
+; CHECK: [[BODY]] = add i64 [[GAS]], 11
+; CHECK: %gas_exhausted = icmp ugt i64 [[BODY]], %gas_limit
+; CHECK-NEXT: br i1 %gas_exhausted, label %[[TRAP:.*]], label %{{.*}}, !prof
+; CHECK: [[TRAP]]:
+; CHECK-NEXT: store i64 [[BODY]], i64* @__nvm_gas_used
+; CHECK-NEXT: call void @__nvm_gas_exhausted() [[NORETURN:#[0-9]+]]
+; CHECK-NEXT: unreachable
+; CHECK: exit:
+; CHECK-NEXT: [[EXIT:%.*]] = add i64 [[BODY]], 1
+; CHECK-NEXT: store i64 [[EXIT]], i64* @__nvm_gas_used
+; CHECK-NEXT: ret i32
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %next = add i32 %i, 1
+  %sdiv = sdiv i32 %next, 1
+  %done = icmp eq i32 %next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %i
+}
+
+; Calls publish the counter, check it and pick up what the callee spent.
+define void @call() {
+; CHECK-LABEL: define void @call(
+; CHECK: [[GAS:%.*]] = add i64 %gas_used, 9
+; CHECK-NEXT: store i64 [[GAS]], i64* @__nvm_gas_used
+; CHECK-NEXT: %gas_exhausted = icmp ugt i64 [[GAS]], %gas_limit
+; CHECK-NEXT: br i1 %gas_exhausted
+; CHECK: call void @callee()
+; CHECK-NEXT: [[AFTER:%.*]] = load i64, i64* @__nvm_gas_used
+; CHECK-NEXT: store i64 [[AFTER]], i64* @__nvm_gas_used
+; CHECK-NEXT: icmp ugt i64 [[AFTER]], %gas_limit
+; CHECK: call void @callee()
+; CHECK-NEXT: [[LAST:%.*]] = load i64, i64* @__nvm_gas_used
+; CHECK-NEXT: store i64 [[LAST]], i64* @__nvm_gas_used
+; CHECK-NEXT: ret void
+  call void @callee()
+  call void @callee()
+  ret void
+}
+
+; Bulk memory pays one gas per 8 bytes, saturating, and is checked before it
+; runs.
+define void @fill(i8* %p, i64 %n) {
+; CHECK-LABEL: define void @fill(
+; CHECK: [[BLOCK:%.*]] = add i64 %gas_used, 5
+; CHECK: [[LEN:%.*]] = lshr i64 %{{.*}}, 3
+; CHECK-NEXT: [[SUM:%.*]] = add i64 [[BLOCK]], [[LEN]]
+; CHECK-NEXT: %gas_wrapped = icmp ult i64 [[SUM]], [[BLOCK]]
+; CHECK-NEXT: [[GAS:%.*]] = select i1 %gas_wrapped, i64 -1, i64 [[SUM]]
+; CHECK-NEXT: %gas_exhausted = icmp ugt i64 [[GAS]], %gas_limit
+; CHECK-NEXT: br i1 %gas_exhausted, label %[[TRAP:.*]], label %[[RUN:.*]], !prof
+; CHECK: [[TRAP]]:
+; CHECK-NEXT: store i64 [[GAS]], i64* @__nvm_gas_used
+; CHECK-NEXT: call void @__nvm_gas_exhausted()
+; CHECK: [[RUN]]:
+; CHECK-NEXT: call void @llvm.memset.p0i8.i64(i8* %p, i8 0, i64 %n, i32 1, i1 false)
+  call void @llvm.memset.p0i8.i64(i8* %p, i8 0, i64 %n, i32 1, i1 false)
+  ret void
+}
+
+; CHECK: attributes [[NORETURN]] = { noreturn }
@@ -0,0 +1,62 @@
+; RUN: opt < %s -sandbox-indirect-calls -S | FileCheck %s
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+
+; Two signatures take one bit. A function pointer holds the function's slot
+; in the table of its signature, shifted past that bit, and the signature.
+; CHECK: @ops = global [2 x i32 (i32)*] [i32 (i32)* inttoptr (i64 2 to i32 (i32)*), i32 (i32)* inttoptr (i64 4 to i32 (i32)*)]
+; CHECK: @hook = global void ()* inttoptr (i64 3 to void ()*)
+
+; Tables are padded to a power of two with a trapping stub, also in slot 0.
+; CHECK: @__sfi_function_table = internal constant [4 x i32 (i32)*] [i32 (i32)* @[[BAD:__sfi_bad_indirect_call]], i32 (i32)* @one, i32 (i32)* @two, i32 (i32)* @[[BAD]]]
+; CHECK: @[[VOIDS:__sfi_function_table.*]] = internal constant [2 x void ()*] [void ()* @[[BADVOID:__sfi_bad_indirect_call.*]], void ()* @nop]
+
+define i32 @one(i32 %x) {
+  ret i32 1
+}
+
+define i32 @two(i32 %x) {
+  ret i32 2
+}
+
+define void @nop() {
+  ret void
+}
+
+@ops = global [2 x i32 (i32)*] [i32 (i32)* @one, i32 (i32)* @two]
+@hook = global void ()* @nop
+
+; Indirect calls mask the slot out and call the table entry.
+define i32 @dispatch(i32 (i32)* %f, i32 %x) {
+; CHECK-LABEL: define i32 @dispatch(
+; CHECK-NEXT: %func_addr = ptrtoint i32 (i32)* %f to i64
+; CHECK-NEXT: %func_slot = lshr i64 %func_addr, 1
+; CHECK-NEXT: %func_index = and i64 %func_slot, 3
+; CHECK-NEXT: %func_gep = getelementptr inbounds [4 x i32 (i32)*], [4 x i32 (i32)*]* @__sfi_function_table, i64 0, i64 %func_index
+; CHECK-NEXT: %func = load i32 (i32)*, i32 (i32)** %func_gep
+; CHECK-NEXT: %r = call i32 %func(i32 %x)
+  %r = call i32 %f(i32 %x)
+  ret i32 %r
+}
+
+define i32 @direct() {
+; CHECK-LABEL: define i32 @direct(
+; CHECK-NEXT: %r = call i32 @one(i32 0)
+  %r = call i32 @one(i32 0)
+  ret i32 %r
+}
+
+define void @run_hook() {
+; CHECK-LABEL: define void @run_hook(
+; CHECK: %func_index = and i64 %func_slot, 1
+; CHECK-NEXT: %func_gep = getelementptr inbounds [2 x void ()*], [2 x void ()*]* @[[VOIDS]], i64 0, i64 %func_index
+  %f = load void ()*, void ()** @hook
+  call void %f()
+  ret void
+}
+
+; CHECK: define internal i32 @[[BAD]](i32)
+; CHECK-NEXT: entry:
+; CHECK-NEXT: call void @llvm.trap()
+; CHECK-NEXT: unreachable
+; CHECK: define internal void @[[BADVOID]]()
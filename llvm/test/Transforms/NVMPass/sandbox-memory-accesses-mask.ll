@@ -0,0 +1,36 @@
+; RUN: opt < %s -sandbox-memory-accesses -sandbox-mode=mask -sandbox-size-bits=20 -S | FileCheck %s
+
+declare void @llvm.memcpy.p0i8.p0i8.i64(i8*, i8*, i64, i32, i1)
+
+; Pointers keep as many low bits as the sandbox is large, in 64 bits.
+define i32 @load(i32* %p) {
+; CHECK-LABEL: define i32 @load(
+; CHECK-NEXT: %mem_base = load i64, i64* @__sfi_memory_base, !invariant.load
+; CHECK-NEXT: [[INT:%.*]] = ptrtoint i32* %p to i64
+; CHECK-NEXT: [[OFF:%.*]] = and i64 [[INT]], 1048575
+; CHECK-NEXT: [[ADDR:%.*]] = add i64 %mem_base, [[OFF]]
+; CHECK-NEXT: [[PTR:%.*]] = inttoptr i64 [[ADDR]] to i32*
+; CHECK-NEXT: %v = load i32, i32* [[PTR]]
+  %v = load i32, i32* %p
+  ret i32 %v
+}
+
+; Both ends of a copy must end inside the 1 MiB sandbox.
+define void @copy(i8* %d, i8* %s, i64 %n) {
+; CHECK-LABEL: define void @copy(
+; CHECK: [[DST:%.*]] = add i64 %mem_base, {{%.*}}
+; CHECK: [[SRC:%.*]] = add i64 %mem_base, {{%.*}}
+; CHECK: [[DOFF:%.*]] = sub i64 [[DST]], %mem_base
+; CHECK-NEXT: icmp ugt i64 [[DOFF]], 1048576
+; CHECK-NEXT: sub i64 1048576, [[DOFF]]
+; CHECK: load volatile i8
+; CHECK: [[SOFF:%.*]] = sub i64 [[SRC]], %mem_base
+; CHECK-NEXT: icmp ugt i64 [[SOFF]], 1048576
+; CHECK-NEXT: sub i64 1048576, [[SOFF]]
+; CHECK: [[GUARD:%.*]] = add i64 %mem_base, 1048576
+; CHECK-NEXT: [[GUARDPTR:%.*]] = inttoptr i64 [[GUARD]] to i8*
+; CHECK-NEXT: load volatile i8, i8* [[GUARDPTR]]
+; CHECK: call void @llvm.memcpy.p0i8.p0i8.i64(
+  call void @llvm.memcpy.p0i8.p0i8.i64(i8* %d, i8* %s, i64 %n, i32 1, i1 false)
+  ret void
+}
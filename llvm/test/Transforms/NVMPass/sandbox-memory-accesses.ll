@@ -0,0 +1,128 @@
+; RUN: opt < %s -sandbox-memory-accesses -S | FileCheck %s -check-prefixes=CHECK,TRUNC
+; RUN: opt < %s -sandbox-memory-accesses -sandbox-mode=guard-region -S | FileCheck %s -check-prefixes=CHECK,GUARD
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+
+declare void @llvm.memset.p0i8.i64(i8*, i8, i64, i32, i1)
+declare void @host(i8*)
+
+; Pointers keep their low 32 bits, added to the sandbox base.
+define i32 @load(i32* %p) {
+; CHECK-LABEL: define i32 @load(
+; CHECK-NEXT: %mem_base = load i64, i64* @__sfi_memory_base, !invariant.load
+; CHECK-NEXT: [[LOW:%.*]] = ptrtoint i32* %p to i32
+; CHECK-NEXT: [[OFF:%.*]] = zext i32 [[LOW]] to i64
+; CHECK-NEXT: [[ADDR:%.*]] = add i64 %mem_base, [[OFF]]
+; CHECK-NEXT: [[PTR:%.*]] = inttoptr i64 [[ADDR]] to i32*
+; CHECK-NEXT: %v = load i32, i32* [[PTR]]
+  %v = load i32, i32* %p
+  ret i32 %v
+}
+
+; Fields of the same pointer share one confined base, plus their offset.
+define void @fields({ i32, i32 }* %s) {
+; CHECK-LABEL: define void @fields(
+; CHECK: [[LOW:%.*]] = ptrtoint { i32, i32 }* %s to i32
+; CHECK-NEXT: [[OFF:%.*]] = zext i32 [[LOW]] to i64
+; CHECK-NEXT: [[BASE:%.*]] = add i64 %mem_base, [[OFF]]
+; CHECK-NEXT: [[A:%.*]] = inttoptr i64 [[BASE]] to i32*
+; CHECK-NEXT: store i32 1, i32* [[A]]
+; CHECK-NEXT: [[BADDR:%.*]] = add i64 [[BASE]], 4
+; CHECK-NEXT: [[B:%.*]] = inttoptr i64 [[BADDR]] to i32*
+; CHECK-NEXT: store i32 2, i32* [[B]]
+  %a = getelementptr { i32, i32 }, { i32, i32 }* %s, i32 0, i32 0
+  %b = getelementptr { i32, i32 }, { i32, i32 }* %s, i32 0, i32 1
+  store i32 1, i32* %a
+  store i32 2, i32* %b
+  ret void
+}
+
+; The base of a loop invariant pointer is confined ahead of the loop.
+define i32 @sum(i32* %p, i32 %n) {
+; CHECK-LABEL: define i32 @sum(
+; CHECK: entry:
+; CHECK: [[BASE:%.*]] = add i64 %mem_base, {{%.*}}
+; CHECK-NEXT: br label %loop
+; CHECK: loop:
+; CHECK-NOT: ptrtoint
+; CHECK: [[PTR:%.*]] = inttoptr i64 [[BASE]] to i32*
+; CHECK-NEXT: %v = load i32, i32* [[PTR]]
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %sum, %loop ]
+  %v = load i32, i32* %p
+  %sum = add i32 %acc, %v
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %sum
+}
+
+; Only guard-region mode adds a non-negative scaled index after confining
+; the array, in 32 bits.
+define i32 @index([16 x i32]* %a, i32 %i) {
+; CHECK-LABEL: define i32 @index(
+; TRUNC: [[LOW:%.*]] = ptrtoint i32* %p to i32
+; TRUNC-NEXT: [[OFF:%.*]] = zext i32 [[LOW]] to i64
+; TRUNC-NEXT: [[ADDR:%.*]] = add i64 %mem_base, [[OFF]]
+; GUARD: [[LOW:%.*]] = ptrtoint [16 x i32]* %a to i32
+; GUARD-NEXT: [[OFF:%.*]] = zext i32 [[LOW]] to i64
+; GUARD-NEXT: [[BASE:%.*]] = add i64 %mem_base, [[OFF]]
+; GUARD-NEXT: [[IDX:%.*]] = trunc i64 %idx to i32
+; GUARD-NEXT: [[SCALED:%.*]] = mul i32 [[IDX]], 4
+; GUARD-NEXT: [[BYTES:%.*]] = zext i32 [[SCALED]] to i64
+; GUARD-NEXT: [[ADDR:%.*]] = add i64 [[BASE]], [[BYTES]]
+; CHECK-NEXT: [[PTR:%.*]] = inttoptr i64 [[ADDR]] to i32*
+; CHECK-NEXT: %v = load i32, i32* [[PTR]]
+  %idx = zext i32 %i to i64
+  %p = getelementptr [16 x i32], [16 x i32]* %a, i64 0, i64 %idx
+  %v = load i32, i32* %p
+  ret i32 %v
+}
+
+; A variable length must end inside the 4 GiB sandbox, or the first guard
+; byte is read instead. Short constant lengths stay within the guard.
+define void @fill(i8* %p, i64 %n) {
+; CHECK-LABEL: define void @fill(
+; CHECK: [[ADDR:%.*]] = add i64 %mem_base, {{%.*}}
+; CHECK-NEXT: [[PTR:%.*]] = inttoptr i64 [[ADDR]] to i8*
+; CHECK-NEXT: [[LEN:%.*]] = bitcast i64 %n to i64
+; CHECK-NEXT: [[OFF:%.*]] = sub i64 [[ADDR]], %mem_base
+; CHECK-NEXT: [[PAST:%.*]] = icmp ugt i64 [[OFF]], 4294967296
+; CHECK-NEXT: [[ROOM:%.*]] = sub i64 4294967296, [[OFF]]
+; CHECK-NEXT: [[LONG:%.*]] = icmp ugt i64 [[LEN]], [[ROOM]]
+; CHECK-NEXT: %out_of_bounds = or i1 [[PAST]], [[LONG]]
+; CHECK-NEXT: br i1 %out_of_bounds, label %[[TRAP:.*]], label %[[RUN:.*]], !prof
+; CHECK: [[TRAP]]:
+; CHECK-NEXT: [[GUARD:%.*]] = add i64 %mem_base, 4294967296
+; CHECK-NEXT: [[GUARDPTR:%.*]] = inttoptr i64 [[GUARD]] to i8*
+; CHECK-NEXT: load volatile i8, i8* [[GUARDPTR]]
+; CHECK-NEXT: unreachable
+; CHECK: [[RUN]]:
+; CHECK-NEXT: call void @llvm.memset.p0i8.i64(i8* [[PTR]], i8 0, i64 %n, i32 1, i1 false)
+; CHECK-NOT: out_of_bounds
+; CHECK: call void @llvm.memset.p0i8.i64(i8* {{%.*}}, i8 0, i64 64, i32 1, i1 false)
+; CHECK-NEXT: ret void
+  call void @llvm.memset.p0i8.i64(i8* %p, i8 0, i64 %n, i32 1, i1 false)
+  call void @llvm.memset.p0i8.i64(i8* %p, i8 0, i64 64, i32 1, i1 false)
+  ret void
+}
+
+; Pointers passed to the host are confined too, unless they are null.
+define void @call(i8* %p) {
+; CHECK-LABEL: define void @call(
+; CHECK: [[ADDR:%.*]] = add i64 %mem_base, {{%.*}}
+; CHECK-NEXT: [[PTR:%.*]] = inttoptr i64 [[ADDR]] to i8*
+; CHECK-NEXT: [[NULL:%.*]] = icmp eq i8* %p, null
+; CHECK-NEXT: [[ARG:%.*]] = select i1 [[NULL]], i8* %p, i8* [[PTR]]
+; CHECK-NEXT: call void @host(i8* [[ARG]])
+; CHECK-NEXT: call void @host(i8* null)
+  call void @host(i8* %p)
+  call void @host(i8* null)
+  ret void
+}
@@ -0,0 +1,92 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+// nvm-aot compiles contracts ahead of time, at deploy: it runs the NVM pass
+// pipeline and codegen once and writes a relocatable object with a manifest
+// embedded, which engines load through AddObjectFile without compiling.
+
+#include "engine.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/raw_ostream.h"
+#include <string>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required,
+                                      cl::desc("<contract IR or bitcode>"));
+
+static cl::opt<std::string>
+    OutputFile("o", cl::desc("Output object file, <input>.o by default"),
+               cl::value_desc("filename"), cl::init(""));
+
+// Values line up with exe_level_t.
+enum ExeLevel {
+  g = exe_level_g,
+  O1 = exe_level_O1,
+  O2 = exe_level_O2,
+  O3 = exe_level_O3
+};
+
+static cl::opt<ExeLevel> OptimizationLevel(
+    cl::desc("Choose execution level:"),
+    cl::values(clEnumVal(g, "No optimizations, enable debugging"),
+               clEnumVal(O1, "Enable trivial optimizations"),
+               clEnumVal(O2, "Enable default optimizations"),
+               clEnumVal(O3, "Enable expensive optimizations")),
+    cl::init(O2));
+
+int main(int argc, const char *argv[]) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "NVM ahead-of-time compiler\n");
+
+  Initialize();
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Input =
+      MemoryBuffer::getFileOrSTDIN(InputFile);
+  if (!Input) {
+    errs() << InputFile << ": " << Input.getError().message() << "\n";
+    return 1;
+  }
+
+  std::string Output = OutputFile;
+  if (Output.empty()) {
+    if (InputFile == "-") {
+      errs() << "an output file is required when reading stdin.\n";
+      return 1;
+    }
+    SmallString<128> Path(InputFile);
+    sys::path::replace_extension(Path, "o");
+    Output = Path.str();
+  }
+
+  const MemoryBuffer &Contract = **Input;
+  if (CompileContractToFile(
+          reinterpret_cast<const uint8_t *>(Contract.getBufferStart()),
+          Contract.getBufferSize(), OptimizationLevel, Output.c_str()) != 0) {
+    errs() << "\n";
+    return 1;
+  }
+  return 0;
+}
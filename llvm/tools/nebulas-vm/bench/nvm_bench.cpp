@@ -0,0 +1,450 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+// nvm-bench compiles and runs a corpus of contracts through the engine and
+// reports the time spent in every phase of loading and running them, as
+// JSON. Given the JSON of an earlier run as a baseline, it also flags phases
+// that got slower and fails if any did.
+
+#include "engine.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/YAMLParser.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> Contracts(cl::Positional, cl::OneOrMore,
+                                       cl::desc("<contract IR or bitcode>"));
+
+static cl::opt<std::string> EntryPoint("entry",
+                                       cl::desc("Contract function to run"),
+                                       cl::init("bench_main"));
+
+static cl::opt<unsigned>
+    CompileRuns("compile-runs",
+                cl::desc("Times every contract is loaded into a new engine"),
+                cl::init(5));
+
+static cl::opt<unsigned>
+    ExecuteRuns("execute-runs", cl::desc("Times every contract is run"),
+                cl::init(20));
+
+static cl::opt<std::string> OutputFile("o", cl::desc("Output JSON file"),
+                                       cl::value_desc("filename"),
+                                       cl::init("-"));
+
+static cl::opt<std::string>
+    BaselineFile("baseline",
+                 cl::desc("JSON of an earlier run to compare against"),
+                 cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<double>
+    Threshold("threshold",
+              cl::desc("Slowdown in percent that counts as a regression"),
+              cl::init(10));
+
+static cl::opt<unsigned long long> NoiseFloor(
+    "noise-floor",
+    cl::desc("Ignore changes of a phase smaller than this, in nanoseconds"),
+    cl::init(100000));
+
+// Values line up with exe_level_t.
+enum ExeLevel {
+  g = exe_level_g,
+  O1 = exe_level_O1,
+  O2 = exe_level_O2,
+  O3 = exe_level_O3
+};
+
+static cl::opt<ExeLevel> OptimizationLevel(
+    cl::desc("Choose execution level:"),
+    cl::values(clEnumVal(g, "No optimizations, enable debugging"),
+               clEnumVal(O1, "Enable trivial optimizations"),
+               clEnumVal(O2, "Enable default optimizations"),
+               clEnumVal(O3, "Enable expensive optimizations")),
+    cl::init(O2));
+
+static cl::opt<bool> SandboxMemory(
+    "sandbox-memory",
+    cl::desc("Confine contract memory accesses to the arena, truncating"),
+    cl::init(false));
+
+static cl::opt<bool>
+    SlabCodeMemory("slab-code-memory",
+                   cl::desc("Allocate JIT code from recycled slabs"),
+                   cl::init(false));
+
+// Metrics in report order. Phases are medians over the runs.
+static const char *const kMetrics[] = {
+    "parse_ns",    "passes_ns",  "codegen_ns", "link_ns",
+    "finalize_ns", "execute_ns", "gas_used",   "code_bytes",
+    "data_bytes",  "sandbox_pages", "peak_rss_kb"};
+
+typedef std::map<std::string, uint64_t> Metrics;
+
+// Contract storage, emptied before every run.
+static StringMap<std::string> Storage;
+
+static int64_t StorageGet(const uint8_t *Key, uint64_t KeyLen, uint8_t *Value,
+                          uint64_t Capacity) {
+  CheckArenaAccess(Key, KeyLen);
+  CheckArenaAccess(Value, Capacity);
+  auto It = Storage.find(StringRef((const char *)Key, KeyLen));
+  if (It == Storage.end())
+    return -1;
+  const std::string &V = It->second;
+  memcpy(Value, V.data(), std::min<uint64_t>(Capacity, V.size()));
+  return V.size();
+}
+
+static void StoragePut(const uint8_t *Key, uint64_t KeyLen,
+                       const uint8_t *Value, uint64_t ValueLen) {
+  CheckArenaAccess(Key, KeyLen);
+  CheckArenaAccess(Value, ValueLen);
+  Storage[StringRef((const char *)Key, KeyLen)] =
+      std::string((const char *)Value, ValueLen);
+}
+
+static void GasExhausted() { AbortArenaExecution(call_out_of_gas); }
+
+static void StackOverflow() { AbortArenaExecution(call_stack_overflow); }
+
+static uint64_t GasUsed;
+static uint64_t GasLimit = ~uint64_t(0);
+
+static uint64_t GetPeakRSS() {
+  struct rusage Usage;
+  getrusage(RUSAGE_SELF, &Usage);
+#if defined(__APPLE__)
+  return Usage.ru_maxrss / 1024;
+#else
+  return Usage.ru_maxrss;
+#endif
+}
+
+static uint64_t Median(std::vector<uint64_t> Values) {
+  std::sort(Values.begin(), Values.end());
+  return Values[Values.size() / 2];
+}
+
+static Engine *LoadContract(const MemoryBuffer &Contract, SandboxArena *Arena) {
+  Engine *e = CreateEngine();
+  if (SetExecutionLevel(e, OptimizationLevel) != 0) {
+    DeleteEngine(e);
+    return NULL;
+  }
+  EnableEngineStats(e);
+  if (SlabCodeMemory)
+    EnableSlabCodeMemory(e);
+  BindArena(e, Arena);
+  if (SandboxMemory && SetSandboxMode(e, sandbox_truncate) != 0) {
+    DeleteEngine(e);
+    return NULL;
+  }
+  BindSymbol(e, "__nvm_gas_used", &GasUsed);
+  BindSymbol(e, "__nvm_gas_limit", &GasLimit);
+  BindSymbol(e, "__nvm_gas_exhausted", (void *)GasExhausted);
+  BindSymbol(e, "__nvm_stack_overflow", (void *)StackOverflow);
+  BindSymbol(e, "nvm_storage_get", (void *)StorageGet);
+  BindSymbol(e, "nvm_storage_put", (void *)StoragePut);
+
+  if (AddModuleBuffer(e, (const uint8_t *)Contract.getBufferStart(),
+                      Contract.getBufferSize()) != 0) {
+    DeleteEngine(e);
+    return NULL;
+  }
+  FinalizeEngine(e);
+  return e;
+}
+
+static bool BenchContract(const std::string &Path, ArenaPool *Arenas,
+                          SandboxArena *&Arena, Metrics &Result) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Contract =
+      MemoryBuffer::getFile(Path);
+  if (!Contract) {
+    errs() << Path << ": " << Contract.getError().message() << "\n";
+    return false;
+  }
+
+  std::vector<uint64_t> Phases[5];
+  Engine *e = NULL;
+  for (unsigned Run = 0; Run < std::max(1u, (unsigned)CompileRuns); ++Run) {
+    if (e != NULL)
+      DeleteEngine(e);
+    e = LoadContract(*Contract.get(), Arena);
+    if (e == NULL) {
+      errs() << Path << ": failed to load contract.\n";
+      return false;
+    }
+    EngineStats Stats;
+    GetEngineStats(e, &Stats);
+    Phases[0].push_back(Stats.phases.parse_ns);
+    Phases[1].push_back(Stats.phases.passes_ns);
+    Phases[2].push_back(Stats.phases.codegen_ns);
+    Phases[3].push_back(Stats.phases.link_ns);
+    Phases[4].push_back(Stats.phases.finalize_ns);
+    Result["code_bytes"] = Stats.code_bytes;
+    Result["data_bytes"] = Stats.data_bytes;
+  }
+  for (unsigned i = 0; i < 5; ++i)
+    Result[kMetrics[i]] = Median(Phases[i]);
+
+  std::vector<uint64_t> Executions;
+  for (unsigned Run = 0; Run < std::max(1u, (unsigned)ExecuteRuns); ++Run) {
+    Storage.clear();
+    GasUsed = 0;
+    int Ret = 0;
+    auto Start = std::chrono::steady_clock::now();
+    int Trap = RunFunctionInArena(e, Arena, EntryPoint.c_str(), 0, NULL, &Ret);
+    auto End = std::chrono::steady_clock::now();
+    Executions.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(End - Start)
+            .count());
+    if (Run == 0) {
+      EngineStats Stats;
+      GetEngineStats(e, &Stats);
+      Result["gas_used"] = GasUsed;
+      Result["sandbox_pages"] = Stats.sandbox_pages_touched;
+    }
+
+    if (SandboxMemory) {
+      // The globals of a sandboxed engine live in its arena, which it keeps.
+      ResetArena(Arena);
+    } else {
+      // Every load of the engine is bound to this arena, so it must come
+      // back.
+      ReleaseArena(Arenas, Arena);
+      SandboxArena *Next = AcquireArena(Arenas);
+      if (Next != Arena) {
+        errs() << "sandbox arena was not recycled.\n";
+        Arena = Next;
+        DeleteEngine(e);
+        return false;
+      }
+    }
+    if (Trap != 0) {
+      errs() << Path << ": contract trapped with status " << Trap << ".\n";
+      DeleteEngine(e);
+      return false;
+    }
+  }
+  Result["execute_ns"] = Median(Executions);
+  Result["peak_rss_kb"] = GetPeakRSS();
+
+  DeleteEngine(e);
+  return true;
+}
+
+static void WriteJSON(raw_ostream &OS,
+                      const std::vector<std::pair<std::string, Metrics>> &All,
+                      uint64_t PeakRSS) {
+  OS << "{\n";
+  OS << "  \"version\": 1,\n";
+  OS << "  \"level\": " << (int)OptimizationLevel << ",\n";
+  OS << "  \"sandbox_memory\": " << (SandboxMemory ? "true" : "false") << ",\n";
+  OS << "  \"peak_rss_kb\": " << PeakRSS << ",\n";
+  OS << "  \"contracts\": [";
+  for (size_t i = 0; i < All.size(); ++i) {
+    OS << (i == 0 ? "\n" : ",\n");
+    OS << "    {\"name\": \"";
+    OS.write_escaped(All[i].first);
+    OS << "\"";
+    for (const char *Metric : kMetrics) {
+      auto It = All[i].second.find(Metric);
+      if (It != All[i].second.end())
+        OS << ", \"" << Metric << "\": " << It->second;
+    }
+    OS << "}";
+  }
+  OS << "\n  ]\n}\n";
+}
+
+static bool GetScalar(yaml::Node *Node, std::string &Value) {
+  yaml::ScalarNode *Scalar = dyn_cast_or_null<yaml::ScalarNode>(Node);
+  if (Scalar == nullptr)
+    return false;
+  SmallString<32> Storage;
+  Value = Scalar->getValue(Storage);
+  return true;
+}
+
+// Read the metrics of every contract of an earlier run. The run-wide peak RSS
+// is kept under the empty name.
+static bool ReadBaseline(const std::string &Path,
+                         std::map<std::string, Metrics> &Baseline) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(Path);
+  if (!Buffer) {
+    errs() << Path << ": " << Buffer.getError().message() << "\n";
+    return false;
+  }
+
+  // JSON is a subset of YAML.
+  SourceMgr SM;
+  yaml::Stream Stream(Buffer.get()->getBuffer(), SM);
+  yaml::document_iterator Doc = Stream.begin();
+  if (Doc == Stream.end())
+    return false;
+  yaml::MappingNode *Root = dyn_cast_or_null<yaml::MappingNode>(Doc->getRoot());
+  if (Root == nullptr) {
+    errs() << Path << ": not a benchmark result.\n";
+    return false;
+  }
+
+  for (yaml::KeyValueNode &Entry : *Root) {
+    std::string Key, Value;
+    if (!GetScalar(Entry.getKey(), Key))
+      continue;
+    if (Key == "peak_rss_kb" && GetScalar(Entry.getValue(), Value)) {
+      Baseline[""]["peak_rss_kb"] = strtoull(Value.c_str(), nullptr, 10);
+      continue;
+    }
+    yaml::SequenceNode *List =
+        dyn_cast_or_null<yaml::SequenceNode>(Entry.getValue());
+    if (Key != "contracts" || List == nullptr)
+      continue;
+
+    for (yaml::Node &Item : *List) {
+      yaml::MappingNode *Contract = dyn_cast<yaml::MappingNode>(&Item);
+      if (Contract == nullptr)
+        continue;
+      std::string Name;
+      Metrics Values;
+      for (yaml::KeyValueNode &Field : *Contract) {
+        std::string FieldName, FieldValue;
+        if (!GetScalar(Field.getKey(), FieldName) ||
+            !GetScalar(Field.getValue(), FieldValue))
+          continue;
+        if (FieldName == "name")
+          Name = FieldValue;
+        else
+          Values[FieldName] = strtoull(FieldValue.c_str(), nullptr, 10);
+      }
+      Baseline[Name] = std::move(Values);
+    }
+  }
+  return !Stream.failed();
+}
+
+// Print how every metric changed and return whether any regressed. Gas must
+// not change at all: it is charged on chain.
+static bool CompareWithBaseline(
+    const std::vector<std::pair<std::string, Metrics>> &All,
+    std::map<std::string, Metrics> &Baseline) {
+  bool Regressed = false;
+  for (auto &Contract : All) {
+    auto Base = Baseline.find(Contract.first);
+    if (Base == Baseline.end()) {
+      errs() << Contract.first << ": not in baseline\n";
+      continue;
+    }
+    for (const char *Metric : kMetrics) {
+      auto Old = Base->second.find(Metric);
+      auto New = Contract.second.find(Metric);
+      if (Old == Base->second.end() || New == Contract.second.end())
+        continue;
+
+      bool Bad;
+      if (StringRef(Metric) == "gas_used") {
+        Bad = Old->second != New->second;
+      } else {
+        double Limit = Old->second * (1 + Threshold / 100);
+        bool Noise = StringRef(Metric).endswith("_ns") &&
+                     New->second < Old->second + NoiseFloor;
+        Bad = New->second > Limit && !Noise;
+      }
+      double Change =
+          Old->second == 0
+              ? 0
+              : ((double)New->second - Old->second) * 100 / Old->second;
+      const char *Name =
+          Contract.first.empty() ? "(total)" : Contract.first.c_str();
+      errs() << format("%-16s %-12s %12llu -> %12llu %+7.1f%%%s\n", Name,
+                       Metric,
+                       (unsigned long long)Old->second,
+                       (unsigned long long)New->second, Change,
+                       Bad ? "  REGRESSION" : "");
+      Regressed |= Bad;
+    }
+  }
+  return Regressed;
+}
+
+int main(int argc, const char *argv[]) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "NVM phase benchmark\n");
+
+  Initialize();
+
+  ArenaPool *Arenas = CreateArenaPool(1);
+  SandboxArena *Arena = AcquireArena(Arenas);
+  if (Arena == NULL) {
+    errs() << "failed to reserve sandbox memory.\n";
+    return 1;
+  }
+
+  std::vector<std::pair<std::string, Metrics>> All;
+  int Status = 0;
+  for (const std::string &Path : Contracts) {
+    Metrics Result;
+    if (!BenchContract(Path, Arenas, Arena, Result)) {
+      Status = 1;
+      continue;
+    }
+    All.emplace_back(sys::path::stem(Path), std::move(Result));
+  }
+  ReleaseArena(Arenas, Arena);
+  DeleteArenaPool(Arenas);
+
+  uint64_t PeakRSS = GetPeakRSS();
+  std::error_code EC;
+  raw_fd_ostream OS(OutputFile, EC, sys::fs::F_Text);
+  if (EC) {
+    errs() << OutputFile << ": " << EC.message() << "\n";
+    return 1;
+  }
+  WriteJSON(OS, All, PeakRSS);
+
+  if (!BaselineFile.empty()) {
+    std::map<std::string, Metrics> Baseline;
+    if (!ReadBaseline(BaselineFile, Baseline))
+      return 1;
+    // Compare the run-wide peak RSS along with the contracts.
+    All.emplace_back("", Metrics{{"peak_rss_kb", PeakRSS}});
+    if (CompareWithBaseline(All, Baseline))
+      Status = 1;
+  }
+  return Status;
+}
@@ -0,0 +1,348 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+#include "checker/contract_validator.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/SHA1.h"
+#include <mutex>
+
+using namespace llvm;
+namespace nebulas {
+
+// Verdicts kept before the cache starts over.
+static const size_t kMaxCachedVerdicts = 4096;
+
+static std::mutex verdictLock;
+static StringMap<std::string> verdicts;
+
+// Names the NVM passes and the runtime use for their own state. A contract
+// that could reach them could reset its gas or move its sandbox.
+static bool IsReservedName(StringRef name) {
+  return name.startswith("__sfi_") || name == "__nvm_gas_used" ||
+         name == "__nvm_gas_limit" || name == "__nvm_gas_exhausted" ||
+         name == "__nvm_stack_overflow";
+}
+
+// Intrinsics that compile to plain code, or that the NVM passes handle.
+static bool IsAllowedIntrinsic(Intrinsic::ID id) {
+  switch (id) {
+  case Intrinsic::memcpy:
+  case Intrinsic::memmove:
+  case Intrinsic::memset:
+  case Intrinsic::stacksave:
+  case Intrinsic::stackrestore:
+  case Intrinsic::lifetime_start:
+  case Intrinsic::lifetime_end:
+  case Intrinsic::invariant_start:
+  case Intrinsic::invariant_end:
+  case Intrinsic::dbg_declare:
+  case Intrinsic::dbg_value:
+  case Intrinsic::assume:
+  case Intrinsic::expect:
+  case Intrinsic::objectsize:
+  case Intrinsic::donothing:
+  case Intrinsic::trap:
+  case Intrinsic::sadd_with_overflow:
+  case Intrinsic::uadd_with_overflow:
+  case Intrinsic::ssub_with_overflow:
+  case Intrinsic::usub_with_overflow:
+  case Intrinsic::smul_with_overflow:
+  case Intrinsic::umul_with_overflow:
+  case Intrinsic::ctlz:
+  case Intrinsic::cttz:
+  case Intrinsic::ctpop:
+  case Intrinsic::bswap:
+  case Intrinsic::bitreverse:
+  case Intrinsic::fabs:
+  case Intrinsic::copysign:
+  case Intrinsic::sqrt:
+  case Intrinsic::floor:
+  case Intrinsic::ceil:
+  case Intrinsic::trunc:
+  case Intrinsic::rint:
+  case Intrinsic::nearbyint:
+  case Intrinsic::round:
+  case Intrinsic::minnum:
+  case Intrinsic::maxnum:
+  case Intrinsic::fma:
+  case Intrinsic::fmuladd:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The C math function an allowed intrinsic lowers to where the target has no
+// instruction for it, without the type suffix, or null if it always compiles
+// to plain code.
+static const char *GetMathLibcall(Intrinsic::ID id) {
+  switch (id) {
+  case Intrinsic::floor:
+    return "floor";
+  case Intrinsic::ceil:
+    return "ceil";
+  case Intrinsic::trunc:
+    return "trunc";
+  case Intrinsic::rint:
+    return "rint";
+  case Intrinsic::nearbyint:
+    return "nearbyint";
+  case Intrinsic::round:
+    return "round";
+  case Intrinsic::minnum:
+    return "fmin";
+  case Intrinsic::maxnum:
+    return "fmax";
+  case Intrinsic::fma:
+    return "fma";
+  default:
+    return nullptr;
+  }
+}
+
+// Suffix of the C math functions for a floating point type, or null if the C
+// library has none for it: half, fp128 and ppc_fp128 only have soft-float
+// routines, which are never declared.
+static const char *GetMathSuffix(const Type *type) {
+  type = type->getScalarType();
+  if (type->isFloatTy())
+    return "f";
+  if (type->isDoubleTy())
+    return "";
+  if (type->isX86_FP80Ty())
+    return "l";
+  return nullptr;
+}
+
+static bool Reject(std::string &error, const Twine &message) {
+  error = message.str();
+  return false;
+}
+
+// Allowed intrinsics are only admitted at types whose lowering stays within
+// plain code and the imports: floating point ones at types the C library has
+// functions for, and whatever function they may lower to has to be declared.
+// Overflow checked multiplication is limited to 64 bits, wider ones lower to
+// compiler runtime routines that are not declared.
+static bool CheckIntrinsic(const Function &func,
+                           const HostImportTable *imports,
+                           std::string &error) {
+  Intrinsic::ID id = func.getIntrinsicID();
+  if (!IsAllowedIntrinsic(id))
+    return Reject(error, "contract uses intrinsic " + func.getName() + ".");
+
+  Type *type = func.getReturnType();
+  switch (id) {
+  case Intrinsic::fabs:
+  case Intrinsic::copysign:
+  case Intrinsic::sqrt:
+  case Intrinsic::fmuladd:
+  case Intrinsic::floor:
+  case Intrinsic::ceil:
+  case Intrinsic::trunc:
+  case Intrinsic::rint:
+  case Intrinsic::nearbyint:
+  case Intrinsic::round:
+  case Intrinsic::minnum:
+  case Intrinsic::maxnum:
+  case Intrinsic::fma: {
+    const char *suffix = GetMathSuffix(type);
+    if (suffix == nullptr)
+      return Reject(error, "contract uses intrinsic " + func.getName() +
+                               ", which has no C library function.");
+    const char *libcall = GetMathLibcall(id);
+    if (libcall == nullptr || imports == nullptr)
+      return true;
+    std::string name = std::string(libcall) + suffix;
+    if (imports->lookup(name) == 0)
+      return Reject(error, "contract uses intrinsic " + func.getName() +
+                               ", which may call undeclared host function " +
+                               name + ".");
+    return true;
+  }
+  case Intrinsic::smul_with_overflow:
+  case Intrinsic::umul_with_overflow:
+    if (func.getFunctionType()->getParamType(0)->getScalarSizeInBits() > 64)
+      return Reject(error, "contract uses intrinsic " + func.getName() +
+                               ", which needs the compiler runtime.");
+    return true;
+  default:
+    return true;
+  }
+}
+
+// Whether v, a function or a cast of one, is only ever called.
+static bool IsOnlyCalled(const Constant *v) {
+  for (const Use &use : v->uses()) {
+    const User *user = use.getUser();
+    ImmutableCallSite call(user);
+    if (call && call.isCallee(&use))
+      continue;
+    const ConstantExpr *cast = dyn_cast<ConstantExpr>(user);
+    if (cast == nullptr || !cast->isCast() || !IsOnlyCalled(cast))
+      return false;
+  }
+  return true;
+}
+
+static bool CheckImport(const GlobalValue &gv, const HostImportTable *imports,
+                        std::string &error) {
+  if (imports != nullptr && imports->lookup(gv.getName()) == 0)
+    return Reject(error, Twine("contract imports undeclared host ") +
+                             (isa<Function>(gv) ? "function " : "variable ") +
+                             gv.getName() + ".");
+  return true;
+}
+
+static bool CheckFunction(const Function &func, std::string &error) {
+  if (func.hasPersonalityFn())
+    return Reject(error, "contract function " + func.getName() +
+                             " uses exception handling.");
+  // Variable arguments are read off the native stack, which no sandbox
+  // confines accesses to.
+  if (func.isVarArg())
+    return Reject(error, "contract function " + func.getName() +
+                             " takes variable arguments.");
+
+  const DataLayout &dl = func.getParent()->getDataLayout();
+  const BasicBlock *entry = &func.getEntryBlock();
+  uint64_t frameSize = 0;
+  for (const BasicBlock &bb : func) {
+    for (const Instruction &inst : bb) {
+      if (const AllocaInst *alloca = dyn_cast<AllocaInst>(&inst)) {
+        // Dynamic allocas are bounds checked when they run.
+        const ConstantInt *count =
+            dyn_cast<ConstantInt>(alloca->getArraySize());
+        if (&bb != entry || count == nullptr)
+          continue;
+        uint64_t size = SaturatingMultiply(
+            dl.getTypeAllocSize(alloca->getAllocatedType()),
+            count->getLimitedValue());
+        frameSize = SaturatingAdd(frameSize, size);
+      } else if (const CallInst *call = dyn_cast<CallInst>(&inst)) {
+        if (call->isInlineAsm())
+          return Reject(error, "contract function " + func.getName() +
+                                   " contains inline assembly.");
+      } else if (isa<InvokeInst>(inst) || isa<ResumeInst>(inst) ||
+                 inst.isEHPad()) {
+        return Reject(error, "contract function " + func.getName() +
+                                 " uses exception handling.");
+      } else if (isa<VAArgInst>(inst)) {
+        return Reject(error, "contract function " + func.getName() +
+                                 " takes variable arguments.");
+      } else if (isa<IndirectBrInst>(inst)) {
+        return Reject(error, "contract function " + func.getName() +
+                                 " uses an indirect branch.");
+      }
+
+      for (const Use &op : inst.operands()) {
+        if (isa<BlockAddress>(op.get()))
+          return Reject(error, "contract function " + func.getName() +
+                                   " takes the address of a block.");
+      }
+    }
+  }
+
+  if (frameSize > kMaxContractFrameSize)
+    return Reject(error, "contract function " + func.getName() + " has a " +
+                             Twine(frameSize) + " byte stack frame, more " +
+                             "than " + Twine(kMaxContractFrameSize) + ".");
+  return true;
+}
+
+bool check_contract(const Module &module, const HostImportTable *imports,
+                    std::string &error) {
+  if (!module.getModuleInlineAsm().empty())
+    return Reject(error, "contract contains module level assembly.");
+  if (!module.ifunc_empty())
+    return Reject(error, "contract defines an ifunc.");
+
+  for (const GlobalVariable &gv : module.globals()) {
+    if (IsReservedName(gv.getName()))
+      return Reject(error, "contract uses " + gv.getName() +
+                               ", which is reserved for the runtime.");
+    if (gv.isThreadLocal())
+      return Reject(error, "contract defines thread local variable " +
+                               gv.getName() + ".");
+    if (gv.isDeclaration() && !gv.use_empty() &&
+        !CheckImport(gv, imports, error))
+      return false;
+  }
+
+  for (const Function &func : module) {
+    if (func.isIntrinsic()) {
+      if (!func.use_empty() && !CheckIntrinsic(func, imports, error))
+        return false;
+      continue;
+    }
+    if (IsReservedName(func.getName()))
+      return Reject(error, "contract uses " + func.getName() +
+                               ", which is reserved for the runtime.");
+
+    if (!func.isDeclaration()) {
+      if (!CheckFunction(func, error))
+        return false;
+      continue;
+    }
+    if (func.use_empty())
+      continue;
+    if (!CheckImport(func, imports, error))
+      return false;
+    // Indirect calls only ever reach contract functions.
+    if (!IsOnlyCalled(&func))
+      return Reject(error, "contract takes the address of host function " +
+                               func.getName() + ".");
+  }
+  return true;
+}
+
+std::string get_contract_verdict_key(StringRef contract,
+                                     const HostImportTable *imports) {
+  SHA1 hasher;
+  if (imports != nullptr)
+    hasher.update(imports->version());
+  hasher.update(StringRef("|"));
+  hasher.update(contract);
+  return toHex(hasher.final());
+}
+
+bool find_contract_verdict(const std::string &key, std::string &error) {
+  std::lock_guard<std::mutex> guard(verdictLock);
+  auto it = verdicts.find(key);
+  if (it == verdicts.end())
+    return false;
+  error = it->second;
+  return true;
+}
+
+void record_contract_verdict(const std::string &key,
+                             const std::string &error) {
+  std::lock_guard<std::mutex> guard(verdictLock);
+  if (verdicts.size() >= kMaxCachedVerdicts)
+    verdicts.clear();
+  verdicts[key] = error;
+}
+
+} // namespace nebulas
@@ -0,0 +1,60 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include "host_imports.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include <string>
+
+namespace nebulas {
+
+// Largest stack frame, in bytes of static allocas, a contract function may
+// have.
+const uint64_t kMaxContractFrameSize = 0x40000;
+
+// Checks every admission rule in one walk over the contract, before it is
+// instrumented:
+//  - only allowed intrinsics, at types whose lowering needs no host
+//    function the import table does not declare, and only host functions
+//    and variables the import table declares, none of them reserved for the
+//    NVM runtime;
+//  - no thread local variables, inline or module level assembly, ifuncs or
+//    variadic functions, though variadic host functions may be called;
+//  - static frames of at most kMaxContractFrameSize bytes;
+//  - indirect calls and jumps only through contract functions: no address
+//    of host functions, no blockaddress or indirectbr, no exception
+//    handling.
+// Without an import table only the names of the imports are checked.
+// Returns false and describes the first violation in error.
+bool check_contract(const llvm::Module &module, const HostImportTable *imports,
+                    std::string &error);
+
+// Identifies a contract and the import table it is checked against.
+std::string get_contract_verdict_key(llvm::StringRef contract,
+                                     const HostImportTable *imports);
+
+// Verdicts of earlier check_contract calls, shared by all engines. Returns
+// whether the contract was checked before, and if so sets error to the
+// violation, or to empty if it passed.
+bool find_contract_verdict(const std::string &key, std::string &error);
+
+void record_contract_verdict(const std::string &key, const std::string &error);
+
+} // namespace nebulas
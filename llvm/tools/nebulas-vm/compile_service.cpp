@@ -0,0 +1,121 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "compile_service.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <thread>
+
+using namespace llvm;
+
+static unsigned GetThreadCount(unsigned Threads) {
+  if (Threads != 0)
+    return Threads;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+ContractCompileService::ContractCompileService(unsigned Threads)
+    : threads(GetThreadCount(Threads)) {}
+
+ContractCompileService::~ContractCompileService() { threads.wait(); }
+
+void ContractCompileService::submit(Engine *e, StringRef Contract) {
+  std::shared_ptr<Job> J = std::make_shared<Job>();
+  J->Contract = Contract.str();
+  J->Options = GetPipelineOptions(e);
+  J->Done = threads.async([J] {
+    J->Succeeded = CompileContractObject(J->Contract, J->Options, J->Result);
+    // The source is not needed anymore once compiled.
+    std::string().swap(J->Contract);
+  });
+
+  std::lock_guard<std::mutex> guard(lock);
+  jobs[GetEngineID(e)].push_back(std::move(J));
+}
+
+int ContractCompileService::link(Engine *e, bool Wait) {
+  // Take the engine's jobs out of the map, so that other engines can submit
+  // and link while this one waits.
+  std::vector<std::shared_ptr<Job>> Pending;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto It = jobs.find(GetEngineID(e));
+    if (It == jobs.end())
+      return 0;
+    Pending.swap(It->second);
+    jobs.erase(It);
+  }
+
+  bool Failed = false;
+  std::vector<std::shared_ptr<Job>> Running;
+  for (std::shared_ptr<Job> &J : Pending) {
+    if (Wait)
+      J->Done.wait();
+    else if (J->Done.wait_for(std::chrono::seconds(0)) !=
+             std::future_status::ready) {
+      Running.push_back(std::move(J));
+      continue;
+    }
+    if (!J->Succeeded || AddContractObject(e, J->Result) != 0)
+      Failed = true;
+  }
+
+  int Remaining = static_cast<int>(Running.size());
+  if (!Running.empty()) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::shared_ptr<Job>> &Queue = jobs[GetEngineID(e)];
+    Queue.insert(Queue.begin(), std::make_move_iterator(Running.begin()),
+                 std::make_move_iterator(Running.end()));
+  }
+  return Failed ? -1 : Remaining;
+}
+
+void ContractCompileService::forget(Engine *e) {
+  std::lock_guard<std::mutex> guard(lock);
+  jobs.erase(GetEngineID(e));
+}
+
+CompileService *CreateCompileService(unsigned threads) {
+  CompileService *s =
+      static_cast<CompileService *>(calloc(1, sizeof(CompileService)));
+  s->nvm_compiler = new ContractCompileService(threads);
+  return s;
+}
+
+void DeleteCompileService(CompileService *s) {
+  delete static_cast<ContractCompileService *>(s->nvm_compiler);
+  free(s);
+}
+
+void CompileServiceSubmit(CompileService *s, Engine *e, const uint8_t *data,
+                          size_t len) {
+  static_cast<ContractCompileService *>(s->nvm_compiler)
+      ->submit(e, StringRef(reinterpret_cast<const char *>(data), len));
+}
+
+int CompileServiceLink(CompileService *s, Engine *e, int wait) {
+  return static_cast<ContractCompileService *>(s->nvm_compiler)
+      ->link(e, wait != 0);
+}
+
+void CompileServiceForget(CompileService *s, Engine *e) {
+  static_cast<ContractCompileService *>(s->nvm_compiler)->forget(e);
+}
@@ -0,0 +1,127 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include "engine.h"
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/ThreadPool.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// A contract compiled to a relocatable object, ready to be linked into an
+/// MCJIT engine.
+struct CompiledContract {
+  std::unique_ptr<llvm::MemoryBuffer> Object;
+
+  /// Static constructors, in the order they have to run. They are given
+  /// external names, so the engine can find them once linked.
+  std::vector<std::string> Constructors;
+
+  /// Host functions and variables the object refers to. Informational: the
+  /// undefined symbols of the object are what is checked when it is linked.
+  std::vector<std::string> Imports;
+
+  /// Exported functions that follow the contract ABI.
+  std::vector<std::string> EntryPoints;
+
+  /// Exported functions that do not follow the contract ABI.
+  std::vector<std::string> NonEntryFunctions;
+};
+
+/// Everything about an engine that shapes the code compiled for it, besides
+/// the host target.
+struct PipelineOptions {
+  int Level = exe_level_O2;
+  int Sandbox = sandbox_none;
+  /// log2 of the size of the arena memory accesses are confined to.
+  unsigned SandboxSizeBits = 32;
+};
+
+/// Parse, instrument and compile a contract in an LLVMContext and with a
+/// TargetMachine of its own. The object carries a manifest of the above, so
+/// it can be loaded without this struct as well, by engines with the same
+/// pipeline options. Thread safe. Returns false and reports through errs()
+/// if the contract is not valid.
+bool CompileContractObject(llvm::StringRef Contract,
+                           const PipelineOptions &Options,
+                           CompiledContract &Result);
+
+/// The options an engine compiles contracts with.
+PipelineOptions GetPipelineOptions(Engine *e);
+
+/// Identifies an engine for its whole lifetime. Unlike its address, the ID of
+/// a deleted engine is never given to another one.
+uint64_t GetEngineID(Engine *e);
+
+/// Link a compiled contract into an engine, checking its imports against the
+/// engine's. Relocations are resolved and constructors run on the next
+/// FinalizeEngine. Returns non-zero on failure.
+int AddContractObject(Engine *e, CompiledContract &Contract);
+
+/// Compiles contracts on a pool of threads.
+///
+/// MCJIT emits code for all of an engine's modules under the engine's lock,
+/// one module after the other. Contracts that do not depend on each other
+/// are instead compiled here in parallel, each job in an LLVMContext of its
+/// own, and only the finished objects are handed to the engine. Linking
+/// still happens on the thread that owns the engine, in whatever order the
+/// jobs complete.
+class ContractCompileService {
+  ContractCompileService(const ContractCompileService &) = delete;
+  void operator=(const ContractCompileService &) = delete;
+
+public:
+  explicit ContractCompileService(unsigned Threads);
+
+  /// Waits for the running jobs.
+  ~ContractCompileService();
+
+  /// Queue a contract to be compiled for an engine, with the engine's
+  /// pipeline options.
+  void submit(Engine *e, llvm::StringRef Contract);
+
+  /// Link the contracts compiled for an engine so far, or all of them if
+  /// Wait is set. Returns the number of jobs still running for the engine,
+  /// or -1 if a contract failed to compile or link; the other completed
+  /// jobs are linked regardless.
+  int link(Engine *e, bool Wait);
+
+  /// Drop the jobs of an engine without linking them, e.g. before deleting
+  /// it. Jobs still running finish in the background.
+  void forget(Engine *e);
+
+private:
+  struct Job {
+    std::string Contract;
+    PipelineOptions Options;
+    bool Succeeded = false;
+    CompiledContract Result;
+    std::shared_future<void> Done;
+  };
+
+  std::mutex lock;
+  // Jobs not linked yet, in submission order, by engine ID.
+  std::map<uint64_t, std::vector<std::shared_ptr<Job>>> jobs;
+  llvm::ThreadPool threads;
+};
@@ -18,81 +18,348 @@
 //
 
 #include "engine.h"
+#include "checker/contract_validator.h"
+#include "compile_service.h"
+#include "lazy_jit.h"
 #include "memory_manager.h"
+#include "object_cache.h"
+#include "sandbox_arena.h"
 #include "llvm/Transforms/NVMPass.h"
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/Config/config.h>
 #include <llvm/ExecutionEngine/GenericValue.h>
+#include <llvm/ExecutionEngine/Interpreter.h>
+#include <llvm/ExecutionEngine/ObjectMemoryBuffer.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/Constants.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IRReader/IRReader.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA1.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Scalar/GVN.h>
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 using namespace llvm;
 
-void Initialize() {
-  // Initialization.
-  InitializeNativeTarget();
-  InitializeNativeTargetAsmParser();
-  InitializeNativeTargetAsmPrinter();
-  LLVMLinkInMCJIT();
+// Identifies the pass pipeline built by CreatePassManager, per execution
+// level, for engines that do not sandbox memory accesses. It is part of the
+// object cache key, so bump it whenever a pipeline or any NVM pass changes the
+// code it produces.
+static const char *const kPassPipelineIDs[] = {
+    // exe_level_g
+    "expand-allocas,sandbox-indirect-calls,gas-metering;10",
+    // exe_level_O1
+    "expand-allocas,sandbox-indirect-calls,gas-metering,mem2reg,instcombine,"
+    "simplifycfg,dce;10",
+    // exe_level_O2
+    "expand-allocas,sandbox-indirect-calls,gas-metering,constprop,instcombine,"
+    "mem2reg,simplifycfg,early-cse,licm,dce,gvn;10",
+    // exe_level_O3
+    "expand-allocas,sandbox-indirect-calls,gas-metering,constprop,instcombine,"
+    "mem2reg,simplifycfg,early-cse,licm,dce,gvn,inline,loop-rotate,licm,"
+    "indvars,loop-unroll,instcombine,gvn,dse,simplifycfg;10"};
+
+static std::atomic<uint64_t> nextEngineID(1);
+
+// Per-engine execution state, kept behind Engine::nvm_runtime.
+struct EngineRuntime {
+  // Unlike the address of the engine, never reused for another one.
+  uint64_t id = nextEngineID.fetch_add(1);
+
+  // Modules added since the last FinalizeEngine, whose static constructors
+  // have not been run yet.
+  std::vector<Module *> uninitializedModules;
+
+  // All modules added to the engine, for looking up entry point signatures.
+  std::vector<Module *> modules;
+
+  // Resolved native entry points, by function name.
+  StringMap<ContractEntry> entryPoints;
+
+  // Whether the engine interprets its module instead of JIT-ing it, and the
+  // gas trap hook to use while interpreting.
+  bool interpreted = false;
+  void (*gasExhaustedHook)() = nullptr;
+  void (*stackOverflowHook)() = nullptr;
+
+  // The globals of an interpreted engine, as captured by CaptureEngineImage.
+  std::vector<std::pair<uint8_t *, std::string>> globalImage;
+
+  // Execution level the pass pipeline and codegen are tuned for, and how
+  // memory accesses are sandboxed.
+  PipelineOptions pipeline;
+
+  // Statistics, only collected once enabled; the memory manager counts
+  // sections and symbols and the arena pages on its own.
+  bool collectStats = false;
+  EngineStats stats = {};
+  ContractArena *arena = nullptr;
+
+  // Objects linked from the compile service. Their relocations are resolved
+  // and their static constructors, by symbol name, run on the next
+  // FinalizeEngine.
+  bool unresolvedObjects = false;
+  std::vector<std::string> objectConstructors;
+
+  // Set once linking failed; nothing the engine loaded may run after that.
+  bool loadFailed = false;
+
+  // Objects, compiled ahead of time or loaded from the object cache, carry no
+  // IR, so the functions their manifests list as entry points are recorded
+  // here instead.
+  StringSet<> objectEntryPoints;
+};
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+// The current time if statistics are collected. Phases then add up to zero
+// when they are not.
+static TimePoint StatsNow(const EngineRuntime *runtime) {
+  return runtime->collectStats ? std::chrono::steady_clock::now()
+                               : TimePoint();
 }
 
-void SetTargetAndDataLayout(Module *module) {
-  std::string targetTriple = sys::getProcessTriple();
-  module->setTargetTriple(targetTriple);
+static uint64_t NanosecondsSince(TimePoint start, TimePoint end) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+      .count();
+}
 
-  std::string err;
-  auto target = TargetRegistry::lookupTarget(targetTriple, err);
+// The interpreter cannot call arbitrary native functions without libffi, but
+// it does look up "lle_X_<name>" handlers in the process symbol table. The
+// trap hooks are bridged that way so running out of gas or stack behaves the
+// same in both tiers; the engine being interpreted is kept per thread.
+static LLVM_THREAD_LOCAL EngineRuntime *interpretedRuntime = nullptr;
 
-  StringRef cpu = sys::getHostCPUName();
+static GenericValue InterpretedGasExhausted(FunctionType *,
+                                            ArrayRef<GenericValue>) {
+  if (interpretedRuntime->gasExhaustedHook != nullptr)
+    interpretedRuntime->gasExhaustedHook();
+  report_fatal_error("__nvm_gas_exhausted returned.");
+}
+
+static GenericValue InterpretedStackOverflow(FunctionType *,
+                                             ArrayRef<GenericValue>) {
+  if (interpretedRuntime->stackOverflowHook != nullptr)
+    interpretedRuntime->stackOverflowHook();
+  report_fatal_error("__nvm_stack_overflow returned.");
+}
+
+// External functions the interpreter implements itself, see
+// lib/ExecutionEngine/Interpreter/ExternalFunctions.cpp.
+static const char *const kInterpreterBuiltins[] = {
+    "atexit",  "exit",    "abort",  "printf",
+    "sprintf", "sscanf",  "scanf",  "fprintf",
+    "memset",  "memcpy",  "__nvm_gas_exhausted", "__nvm_stack_overflow"};
+
+// Description of the host target. Host CPU discovery is expensive (it runs
+// cpuid), so it is done once per process and shared by all engines.
+struct HostTarget {
+  HostTarget() : dataLayout("") {}
+
+  std::string triple;
+  std::string cpu;
+  std::vector<std::string> attrs;
+  std::string featureStr;
+  DataLayout dataLayout;
+  const Target *target;
+};
+
+static std::once_flag hostTargetOnce;
+static HostTarget *hostTarget = NULL;
+
+static void InitializeHostTarget() {
+  HostTarget *host = new HostTarget();
+  host->triple = sys::getProcessTriple();
+  host->cpu = sys::getHostCPUName();
 
   SubtargetFeatures features;
   StringMap<bool> HostFeatures;
   if (sys::getHostCPUFeatures(HostFeatures))
-    for (auto &F : HostFeatures)
+    for (auto &F : HostFeatures) {
       features.AddFeature(F.first(), F.second);
-  std::string featureStr = features.getString();
+      host->attrs.push_back((F.second ? "+" : "-") + F.first().str());
+    }
+  host->featureStr = features.getString();
+
+  std::string err;
+  const Target *target = TargetRegistry::lookupTarget(host->triple, err);
+  if (target == nullptr)
+    report_fatal_error("lookup host target failed: " + err);
 
   TargetOptions opt;
   auto rm = Optional<Reloc::Model>();
-  auto targetMachine =
-      target->createTargetMachine(targetTriple, cpu, featureStr, opt, rm);
+  std::unique_ptr<TargetMachine> targetMachine(target->createTargetMachine(
+      host->triple, host->cpu, host->featureStr, opt, rm));
+  host->dataLayout = targetMachine->createDataLayout();
+  host->target = target;
 
-  module->setDataLayout(targetMachine->createDataLayout());
+  hostTarget = host;
+}
 
-  // printf("targetTriple = %s\n", targetTriple.c_str());
-  // printf("cpu = %s\n", cpu.begin());
-  // printf("featureStr = %s\n", featureStr.c_str());
+static const HostTarget &GetHostTarget() {
+  std::call_once(hostTargetOnce, InitializeHostTarget);
+  return *hostTarget;
 }
 
-Engine *CreateEngine() {
-  // Parse IR.
-  LLVMContext *context = new LLVMContext();
+void Initialize() {
+  // Initialization.
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmParser();
+  InitializeNativeTargetAsmPrinter();
+  LLVMLinkInMCJIT();
+  LLVMLinkInInterpreter();
 
-  // Create PassManager.
+  sys::DynamicLibrary::AddSymbol("lle_X___nvm_gas_exhausted",
+                                 (void *)InterpretedGasExhausted);
+  sys::DynamicLibrary::AddSymbol("lle_X___nvm_stack_overflow",
+                                 (void *)InterpretedStackOverflow);
+
+  (void)GetHostTarget();
+}
+
+static CodeGenOpt::Level GetCodeGenOptLevel(int level) {
+  switch (level) {
+  case exe_level_g:
+    return CodeGenOpt::None;
+  case exe_level_O1:
+    return CodeGenOpt::Less;
+  case exe_level_O3:
+    return CodeGenOpt::Aggressive;
+  default:
+    return CodeGenOpt::Default;
+  }
+}
+
+// Instruction selection is the bulk of codegen time. At the levels that favor
+// compile latency, use FastISel; it falls back to SelectionDAG per block for
+// whatever it does not handle.
+static TargetOptions GetTargetOptions(int level) {
+  TargetOptions opt;
+  opt.EnableFastISel = level <= exe_level_O1;
+  return opt;
+}
+
+static std::unique_ptr<TargetMachine> CreateHostTargetMachine(int level) {
+  const HostTarget &host = GetHostTarget();
+  return std::unique_ptr<TargetMachine>(host.target->createTargetMachine(
+      host.triple, host.cpu, host.featureStr, GetTargetOptions(level),
+      Optional<Reloc::Model>(), CodeModel::JITDefault,
+      GetCodeGenOptLevel(level)));
+}
+
+void SetTargetAndDataLayout(Module *module) {
+  const HostTarget &host = GetHostTarget();
+  module->setTargetTriple(host.triple);
+  module->setDataLayout(host.dataLayout);
+}
+
+static SandboxMode GetSandboxPassMode(int sandbox) {
+  switch (sandbox) {
+  case sandbox_guard_region:
+    return SandboxMode::GuardRegion;
+  case sandbox_mask:
+    return SandboxMode::Mask;
+  default:
+    return SandboxMode::Truncate;
+  }
+}
+
+// The pipeline ID of kPassPipelineIDs, extended with the sandbox mode.
+static std::string GetPipelineID(const PipelineOptions &options) {
+  std::string id = kPassPipelineIDs[options.Level];
+  if (options.Sandbox != sandbox_none)
+    id += ";sandbox-memory-accesses=" + std::to_string(options.Sandbox) + "/" +
+          std::to_string(options.SandboxSizeBits);
+  return id;
+}
+
+static legacy::PassManager *CreatePassManager(const PipelineOptions &options) {
   legacy::PassManager *passMgr = new legacy::PassManager();
+  int level = options.Level;
+
+  // The NVM passes always run first and on unoptimized IR: gas is charged for
+  // the code as written, so it is the same at every execution level. Memory
+  // accesses are confined once the frames are laid out in the arena, and
+  // before the accesses to indirect call tables and gas counters are added.
   passMgr->add(createExpandAllocasPass());
-  // passMgr->add(createSandboxIndirectCallsPass());
-  // passMgr->add(createSandboxMemoryAccessesPass());
+  if (options.Sandbox != sandbox_none)
+    passMgr->add(createSandboxMemoryAccessesPass(
+        GetSandboxPassMode(options.Sandbox), options.SandboxSizeBits));
+  passMgr->add(createSandboxIndirectCallsPass());
   // passMgr->add(createStripTlsPass());
+  passMgr->add(createGasMeteringPass());
+
+  if (level == exe_level_g)
+    return passMgr;
+
+  if (level == exe_level_O1) {
+    passMgr->add(createPromoteMemoryToRegisterPass());
+    passMgr->add(createInstructionCombiningPass());
+    passMgr->add(createCFGSimplificationPass());
+    passMgr->add(createDeadCodeEliminationPass());
+    return passMgr;
+  }
+
   passMgr->add(createConstantPropagationPass());
   passMgr->add(createInstructionCombiningPass());
   passMgr->add(createPromoteMemoryToRegisterPass());
   passMgr->add(createCFGSimplificationPass());
+  // The NVM passes expand each gas charge and frame address on its own, and
+  // in sandboxed engines each memory access. Merge the repeated computations
+  // and hoist the loop-invariant ones.
+  passMgr->add(createEarlyCSEPass());
+  passMgr->add(createLICMPass());
   passMgr->add(createDeadCodeEliminationPass());
   passMgr->add(createGVNPass());
 
+  if (level == exe_level_O3) {
+    // Callees are already metered, so inlining does not change gas. The NVM
+    // runtime globals (sandbox base, gas limit) are loaded as invariant, so
+    // the inlined callee's loads fold into the caller's in the GVN below.
+    passMgr->add(createFunctionInliningPass(3, 0, false));
+    passMgr->add(createLoopRotatePass());
+    passMgr->add(createLICMPass());
+    passMgr->add(createIndVarSimplifyPass());
+    passMgr->add(createLoopUnrollPass(3));
+    passMgr->add(createInstructionCombiningPass());
+    passMgr->add(createGVNPass());
+    passMgr->add(createDeadStoreEliminationPass());
+    passMgr->add(createCFGSimplificationPass());
+  }
+  return passMgr;
+}
+
+Engine *CreateEngine() {
+  // Parse IR.
+  LLVMContext *context = new LLVMContext();
+
+  // Create PassManager.
+  legacy::PassManager *passMgr = CreatePassManager(PipelineOptions());
+
   // Enable MCJIT.
   MemoryManager *rtDyldMM = new MemoryManager();
 
@@ -105,36 +372,350 @@ Engine *CreateEngine() {
 
   e->llvm_engine = NULL;
   e->llvm_main_module = NULL;
+  e->llvm_object_cache = NULL;
+  e->nvm_runtime = new EngineRuntime();
+  e->llvm_lazy_jit = NULL;
   return e;
 }
 
-int AddModuleFile(Engine *e, const char *irPath) {
-  LLVMContext *context = static_cast<LLVMContext *>(e->llvm_context);
-  legacy::PassManager *passMgr =
-      static_cast<legacy::PassManager *>(e->llvm_pass_manager);
+Engine *CreateInterpreterEngine() {
+  Engine *e = CreateEngine();
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  runtime->interpreted = true;
+  return e;
+}
+
+Engine *CreateLazyEngine() {
+  Engine *e = CreateEngine();
   MemoryManager *rtDyldMM = static_cast<MemoryManager *>(e->llvm_mem_manager);
 
-  SMDiagnostic err;
+  LazyContractJIT *lazyJIT =
+      LazyContractJIT::create(CreateHostTargetMachine(exe_level_O2), rtDyldMM);
+  if (lazyJIT == nullptr) {
+    errs() << "lazy compilation is not supported on this target.";
+    DeleteEngine(e);
+    return NULL;
+  }
+  e->llvm_lazy_jit = lazyJIT;
+  return e;
+}
+
+void EnableObjectCache(Engine *e, const char *cacheDir) {
+  ContractObjectCache *cache = new ContractObjectCache(std::string(cacheDir));
+  delete static_cast<ContractObjectCache *>(e->llvm_object_cache);
+  e->llvm_object_cache = cache;
 
-  std::unique_ptr<Module> pModule =
-      parseIRFile(StringRef(irPath), err, *context);
+  ExecutionEngine *engine = static_cast<ExecutionEngine *>(e->llvm_engine);
+  if (engine != nullptr)
+    engine->setObjectCache(cache);
+}
+
+void EnableSlabCodeMemory(Engine *e) {
+  static_cast<MemoryManager *>(e->llvm_mem_manager)->useSlabs();
+}
+
+int SetExecutionLevel(Engine *e, int level) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  if (level < exe_level_g || level > exe_level_O3) {
+    errs() << "invalid execution level " << level << ".";
+    return 1;
+  }
+  if (!runtime->modules.empty()) {
+    errs() << "execution level must be set before adding modules.";
+    return 1;
+  }
+
+  LazyContractJIT *lazyJIT = static_cast<LazyContractJIT *>(e->llvm_lazy_jit);
+  if (lazyJIT != nullptr) {
+    // The lazy JIT compiles through its own TargetMachine.
+    MemoryManager *rtDyldMM =
+        static_cast<MemoryManager *>(e->llvm_mem_manager);
+    LazyContractJIT *newJIT =
+        LazyContractJIT::create(CreateHostTargetMachine(level), rtDyldMM);
+    if (newJIT == nullptr) {
+      errs() << "lazy compilation is not supported on this target.";
+      return 1;
+    }
+    delete lazyJIT;
+    e->llvm_lazy_jit = newJIT;
+  }
+
+  PipelineOptions options = runtime->pipeline;
+  options.Level = level;
+  delete static_cast<legacy::PassManager *>(e->llvm_pass_manager);
+  e->llvm_pass_manager = CreatePassManager(options);
+  runtime->pipeline = options;
+  return 0;
+}
+
+int SetSandboxMode(Engine *e, int mode) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  if (mode != sandbox_none &&
+      (runtime->interpreted || e->llvm_lazy_jit != NULL)) {
+    errs() << "only MCJIT engines can sandbox memory accesses.";
+    return 1;
+  }
+  if (!runtime->modules.empty() || e->llvm_engine != NULL) {
+    errs() << "sandbox mode must be set before adding modules.";
+    return 1;
+  }
+
+  ContractArena *arena = runtime->arena;
+  if (mode != sandbox_none && arena == nullptr) {
+    errs() << "bind an arena before sandboxing memory accesses.";
+    return 1;
+  }
+  // Every mode adds offsets up to 64 KiB after confinement.
+  if (mode != sandbox_none &&
+      arena->guardSize() < ContractArena::DefaultGuardSize) {
+    errs() << "sandbox arena guard is too small.";
+    return 1;
+  }
+  unsigned sizeBits = 32;
+  switch (mode) {
+  case sandbox_none:
+    break;
+  case sandbox_mask:
+    // Arenas are aligned to their size, which is a power of two of at least
+    // 64 KiB, the smallest sandbox the pass supports.
+    sizeBits = Log2_64(arena->size());
+    if (sizeBits > 32) {
+      errs() << "mask sandboxing needs an arena of at most 4 GiB.";
+      return 1;
+    }
+    break;
+  case sandbox_guard_region:
+    if (arena->guardSize() < ContractArena::GuardRegionGuardSize) {
+      errs() << "guard-region sandboxing needs a 4 GiB + 64 KiB guard.";
+      return 1;
+    }
+    LLVM_FALLTHROUGH;
+  case sandbox_truncate:
+    if (arena->size() != ContractArena::DefaultSize) {
+      errs() << "32-bit sandboxing needs a 4 GiB arena.";
+      return 1;
+    }
+    break;
+  default:
+    errs() << "invalid sandbox mode " << mode << ".";
+    return 1;
+  }
+
+  PipelineOptions options = runtime->pipeline;
+  options.Sandbox = mode;
+  options.SandboxSizeBits = sizeBits;
+  delete static_cast<legacy::PassManager *>(e->llvm_pass_manager);
+  e->llvm_pass_manager = CreatePassManager(options);
+
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  mm->useArena(mode != sandbox_none ? arena : nullptr);
+  runtime->pipeline = options;
+  return 0;
+}
+
+std::string GetObjectCacheKey(StringRef contract,
+                              const PipelineOptions &options,
+                              StringRef importsVersion) {
+  // The key covers everything that affects the emitted object: the contract
+  // itself, the pass pipeline, the codegen level and the host target. The
+  // import table version makes sure cached objects only link against the
+  // imports they were checked against.
+  const HostTarget &host = GetHostTarget();
+
+  SHA1 hasher;
+  hasher.update(GetPipelineID(options));
+  hasher.update(StringRef("|"));
+  hasher.update(StringRef(std::to_string(GetCodeGenOptLevel(options.Level))));
+  hasher.update(StringRef("|"));
+  hasher.update(host.triple);
+  hasher.update(StringRef("|"));
+  hasher.update(host.cpu);
+  hasher.update(StringRef("|"));
+  hasher.update(host.featureStr);
+  hasher.update(StringRef("|"));
+  hasher.update(importsVersion);
+  hasher.update(StringRef("|"));
+  hasher.update(contract);
+  return std::string(ContractObjectCache::KeyPrefix) + toHex(hasher.final());
+}
+
+static std::unique_ptr<Module> ParseContract(MemoryBufferRef contract,
+                                             LLVMContext &context) {
+  const unsigned char *start =
+      reinterpret_cast<const unsigned char *>(contract.getBufferStart());
+  const unsigned char *end =
+      reinterpret_cast<const unsigned char *>(contract.getBufferEnd());
+
+  if (!isBitcode(start, end)) {
+    // The IR lexer relies on a NUL terminator, which a caller's buffer does
+    // not have. Only bitcode is read in place.
+    std::unique_ptr<MemoryBuffer> text = MemoryBuffer::getMemBufferCopy(
+        contract.getBuffer(), contract.getBufferIdentifier());
+    SMDiagnostic err;
+    std::unique_ptr<Module> module =
+        parseIR(text->getMemBufferRef(), err, context);
+    if (module == nullptr)
+      errs() << err.getMessage().data();
+    return module;
+  }
+
+  Expected<std::unique_ptr<Module>> module =
+      getLazyBitcodeModule(contract, context);
+  if (!module) {
+    errs() << toString(module.takeError());
+    return nullptr;
+  }
+
+  // The NVM passes are module passes and have to see every function body, so
+  // materialize everything now. This also drops the module's reference to the
+  // contract buffer.
+  if (Error err = (*module)->materializeAll()) {
+    errs() << toString(std::move(err));
+    return nullptr;
+  }
+  return std::move(*module);
+}
+
+// The admission checks run on the contract as written, before any pass or
+// codegen. Verdicts are cached by contract hash: a contract that was rejected
+// once is rejected again without parsing it, one that passed is not walked
+// again. Returns true if the contract is known to be invalid; otherwise
+// whether it still has to be checked is left in unchecked.
+static bool RejectedBefore(StringRef contract, const HostImportTable *imports,
+                           std::string &verdictKey, bool &unchecked) {
+  verdictKey = nebulas::get_contract_verdict_key(contract, imports);
+  std::string verdict;
+  unchecked = !nebulas::find_contract_verdict(verdictKey, verdict);
+  if (verdict.empty())
+    return false;
+  errs() << verdict;
+  return true;
+}
+
+static int ValidateContract(const Module &module,
+                            const HostImportTable *imports,
+                            const std::string &verdictKey) {
+  std::string verdict;
+  nebulas::check_contract(module, imports, verdict);
+  nebulas::record_contract_verdict(verdictKey, verdict);
+  if (verdict.empty())
+    return 0;
+  errs() << verdict;
+  return 1;
+}
+
+LLVM_ATTRIBUTE_UNUSED static bool IsInterpreterBuiltin(StringRef name) {
+  for (const char *builtin : kInterpreterBuiltins)
+    if (name == builtin)
+      return true;
+  return false;
+}
+
+// Every external the contract refers to, including those the NVM passes
+// added, must be a declared import. Checked before codegen, as the linker has
+// no way to fail gracefully on an unresolved symbol.
+static int CheckImports(Module *module, const HostImportTable &imports) {
+  for (Function &func : *module) {
+    if (!func.isDeclaration() || func.isIntrinsic() || func.use_empty())
+      continue;
+    if (imports.lookup(func.getName()) == 0) {
+      errs() << "contract imports undeclared host function " << func.getName()
+             << ".";
+      return 1;
+    }
+  }
+  for (GlobalVariable &gv : module->globals()) {
+    if (!gv.isDeclaration() || gv.use_empty())
+      continue;
+    if (imports.lookup(gv.getName()) == 0) {
+      errs() << "contract imports undeclared host variable " << gv.getName()
+             << ".";
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int AddInterpretedModule(Engine *e, std::unique_ptr<Module> pModule) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
   Module *module = pModule.get();
-  if (module == nullptr) {
-    errs() << err.getMessage().data();
+
+  // The interpreter lays out globals once, when it is created.
+  if (e->llvm_engine != NULL) {
+    errs() << "interpreted engines take a single module.";
     return 1;
   }
 
-  SetTargetAndDataLayout(module);
+  // It also resolves external globals through the process symbol table only,
+  // so fold this engine's bindings into the module as constant addresses.
+  Type *intPtrType = module->getDataLayout().getIntPtrType(module->getContext());
+  for (Module::global_iterator it = module->global_begin(),
+                               end = module->global_end();
+       it != end;) {
+    GlobalVariable *gv = &*it++;
+    if (!gv->isDeclaration())
+      continue;
+    uint64_t addr = mm->lookupSymbol(gv->getName());
+    if (addr == 0) {
+      errs() << "unresolved external global " << gv->getName() << ".";
+      return 1;
+    }
+    gv->replaceAllUsesWith(ConstantExpr::getIntToPtr(
+        ConstantInt::get(intPtrType, addr), gv->getType()));
+    gv->eraseFromParent();
+  }
 
-  passMgr->run(*module);
+  std::vector<Function *> externals;
+  for (Function &func : *module) {
+    if (!func.isDeclaration() || func.isIntrinsic() || func.use_empty())
+      continue;
+#ifndef HAVE_FFI_CALL
+    if (!IsInterpreterBuiltin(func.getName())) {
+      errs() << "interpreter can not call " << func.getName() << ".";
+      return 1;
+    }
+#endif
+    externals.push_back(&func);
+  }
 
-  module->dump();
+  std::string errMsg;
+  EngineBuilder *builder = new EngineBuilder(std::move(pModule));
+  builder->setErrorStr(&errMsg);
+  builder->setEngineKind(EngineKind::Interpreter);
+  e->llvm_builder = builder;
+  e->llvm_main_module = module;
 
-  if (false) {
-    // TODO: @robin, fail when ir file is invalid.
-    errs() << "running pass failed.";
+  ExecutionEngine *engine = builder->create();
+  if (engine == nullptr) {
+    errs() << "create interpreter failed: " << errMsg;
     return 1;
   }
+  e->llvm_engine = engine;
+
+  // With libffi, calls to external functions go to the mapped addresses.
+  for (Function *func : externals) {
+    uint64_t addr = mm->lookupSymbol(func->getName());
+    if (addr != 0)
+      engine->addGlobalMapping(func, (void *)addr);
+  }
+  runtime->gasExhaustedHook =
+      (void (*)())mm->lookupSymbol("__nvm_gas_exhausted");
+  runtime->stackOverflowHook =
+      (void (*)())mm->lookupSymbol("__nvm_stack_overflow");
+
+  runtime->uninitializedModules.push_back(module);
+  return 0;
+}
+
+// Adds a module to the engine's MCJIT, which is created along with the first
+// one.
+static int AddMCJITModule(Engine *e, std::unique_ptr<Module> pModule) {
+  MemoryManager *rtDyldMM = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  ContractObjectCache *cache =
+      static_cast<ContractObjectCache *>(e->llvm_object_cache);
+  Module *module = pModule.get();
 
   // Create EngineBuilder if not.
   EngineBuilder *builder = static_cast<EngineBuilder *>(e->llvm_builder);
@@ -149,7 +730,12 @@ int AddModuleFile(Engine *e, const char *irPath) {
     builder->setMCJITMemoryManager(
         std::unique_ptr<RTDyldMemoryManager>(rtDyldMM));
 
-    builder->setOptLevel(CodeGenOpt::Default);
+    builder->setOptLevel(GetCodeGenOptLevel(runtime->pipeline.Level));
+    builder->setTargetOptions(GetTargetOptions(runtime->pipeline.Level));
+
+    const HostTarget &host = GetHostTarget();
+    builder->setMCPU(host.cpu);
+    builder->setMAttrs(host.attrs);
 
     e->llvm_builder = builder;
     e->llvm_main_module = module;
@@ -163,33 +749,412 @@ int AddModuleFile(Engine *e, const char *irPath) {
       errs() << "create ExecutionEngine from builder failed.";
       return 1;
     }
+    if (cache != nullptr)
+      engine->setObjectCache(cache);
     e->llvm_engine = engine;
   } else {
     engine->addModule(std::move(pModule));
   }
+  return 0;
+}
+
+static bool HasContractABI(Function *func);
+
+// Exported functions of a contract, split by whether they follow the contract
+// ABI and can be called as entry points.
+static void CollectExports(Module &module, CompiledContract &contract) {
+  for (Function &func : module) {
+    if (func.isDeclaration() || func.hasLocalLinkage())
+      continue;
+    if (HasContractABI(&func))
+      contract.EntryPoints.push_back(func.getName());
+    else
+      contract.NonEntryFunctions.push_back(func.getName());
+  }
+}
+
+static std::string WriteExports(const CompiledContract &contract) {
+  std::string records;
+  for (const std::string &name : contract.EntryPoints)
+    records += "entry " + name + "\n";
+  for (const std::string &name : contract.NonEntryFunctions)
+    records += "function " + name + "\n";
+  return records;
+}
+
+// Manifests hold a record per line. Returns the pipeline hash, if any.
+static StringRef ReadManifestRecords(StringRef manifest,
+                                     CompiledContract &contract) {
+  SmallVector<StringRef, 32> lines;
+  manifest.split(lines, '\n', -1, /*KeepEmpty=*/false);
+  StringRef pipeline;
+  for (StringRef line : lines) {
+    std::pair<StringRef, StringRef> record = line.split(' ');
+    if (record.first == "pipeline")
+      pipeline = record.second;
+    else if (record.first == "ctor")
+      contract.Constructors.push_back(record.second);
+    else if (record.first == "import")
+      contract.Imports.push_back(record.second);
+    else if (record.first == "entry")
+      contract.EntryPoints.push_back(record.second);
+    else if (record.first == "function")
+      contract.NonEntryFunctions.push_back(record.second);
+  }
+  return pipeline;
+}
+
+static int AddContract(Engine *e, MemoryBufferRef contract) {
+  LLVMContext *context = static_cast<LLVMContext *>(e->llvm_context);
+  legacy::PassManager *passMgr =
+      static_cast<legacy::PassManager *>(e->llvm_pass_manager);
+  MemoryManager *rtDyldMM = static_cast<MemoryManager *>(e->llvm_mem_manager);
+
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  LazyContractJIT *lazyJIT = static_cast<LazyContractJIT *>(e->llvm_lazy_jit);
+
+  // Lazily compiled code is emitted per function, never as a whole object,
+  // so the object cache only applies to MCJIT engines.
+  ContractObjectCache *cache =
+      lazyJIT == nullptr && !runtime->interpreted
+          ? static_cast<ContractObjectCache *>(e->llvm_object_cache)
+          : nullptr;
+
+  std::unique_ptr<Module> pModule;
+  bool cacheHit = false;
+
+  TimePoint parseStart = StatsNow(runtime);
+  const HostImportTable &imports = rtDyldMM->getImports();
+  std::string verdictKey;
+  bool unchecked;
+  if (RejectedBefore(contract.getBuffer(), &imports, verdictKey, unchecked))
+    return 1;
+
+  if (cache != nullptr) {
+    std::string cacheKey =
+        GetObjectCacheKey(contract.getBuffer(), runtime->pipeline,
+                          imports.version());
+    std::unique_ptr<MemoryBuffer> manifest;
+    if (cache->hasObject(cacheKey))
+      manifest = cache->getManifest(cacheKey);
+    if (manifest != nullptr) {
+      // Warm hit: skip parsing, passes and codegen. MCJIT picks the object
+      // up from the cache through this empty module when it is finalized.
+      pModule = llvm::make_unique<Module>(cacheKey, *context);
+      cacheHit = true;
+      ++runtime->stats.cache_hits;
+
+      CompiledContract exports;
+      ReadManifestRecords(manifest->getBuffer(), exports);
+      for (const std::string &name : exports.EntryPoints)
+        runtime->objectEntryPoints.insert(name);
+    } else {
+      ++runtime->stats.cache_misses;
+      pModule = ParseContract(contract, *context);
+      if (pModule)
+        pModule->setModuleIdentifier(cacheKey);
+    }
+  } else {
+    pModule = ParseContract(contract, *context);
+  }
+
+  Module *module = pModule.get();
+  if (module == nullptr) {
+    return 1;
+  }
+
+  SetTargetAndDataLayout(module);
+  if (!cacheHit && unchecked &&
+      ValidateContract(*module, &imports, verdictKey) != 0)
+    return 1;
+
+  TimePoint passesStart = StatsNow(runtime);
+  runtime->stats.phases.parse_ns += NanosecondsSince(parseStart, passesStart);
+
+  if (!cacheHit) {
+    passMgr->run(*module);
+    if (CheckImports(module, imports) != 0)
+      return 1;
+  }
+  if (cache != nullptr && !cacheHit) {
+    CompiledContract exports;
+    CollectExports(*module, exports);
+    cache->storeManifest(module->getModuleIdentifier(), WriteExports(exports));
+  }
+  runtime->stats.phases.passes_ns +=
+      NanosecondsSince(passesStart, StatsNow(runtime));
+
+  if (false) {
+    // TODO: @robin, fail when ir file is invalid.
+    errs() << "running pass failed.";
+    return 1;
+  }
+
+  runtime->modules.push_back(module);
+
+  if (lazyJIT != nullptr) {
+    if (e->llvm_main_module == NULL)
+      e->llvm_main_module = module;
+    // Static constructors run as part of adding the module.
+    if (Error err = lazyJIT->addModule(std::move(pModule))) {
+      errs() << toString(std::move(err));
+      return 1;
+    }
+    return 0;
+  }
+
+  if (runtime->interpreted) {
+    return AddInterpretedModule(e, std::move(pModule));
+  }
+
+  if (AddMCJITModule(e, std::move(pModule)) != 0)
+    return 1;
+
+  runtime->uninitializedModules.push_back(module);
 
   return 0;
 }
 
+int AddModuleFile(Engine *e, const char *irPath) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> irBuffer =
+      MemoryBuffer::getFile(irPath);
+  if (!irBuffer) {
+    errs() << irBuffer.getError().message();
+    return 1;
+  }
+  return AddContract(e, irBuffer.get()->getMemBufferRef());
+}
+
+int AddModuleBuffer(Engine *e, const uint8_t *data, size_t len) {
+  StringRef contract(reinterpret_cast<const char *>(data), len);
+  return AddContract(e, MemoryBufferRef(contract, "<contract>"));
+}
+
 void DeleteEngine(Engine *e) {
   // TODO: release llvm resource by call proper llvm dispose function.
+  delete static_cast<LazyContractJIT *>(e->llvm_lazy_jit);
   delete static_cast<MemoryManager *>(e->llvm_mem_manager);
   delete static_cast<EngineBuilder *>(e->llvm_builder);
   delete static_cast<legacy::PassManager *>(e->llvm_pass_manager);
   delete static_cast<LLVMContext *>(e->llvm_context);
+  delete static_cast<ContractObjectCache *>(e->llvm_object_cache);
+  delete static_cast<EngineRuntime *>(e->nvm_runtime);
   free(e);
 }
 
-int RunFunction(Engine *e, const char *funcName, size_t len,
-                const uint8_t *data) {
-  Module *module = static_cast<Module *>(e->llvm_main_module);
+int FinalizeEngine(Engine *e) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  // Lazy engines link function by function, as they are first called.
+  LazyContractJIT *lazyJIT = static_cast<LazyContractJIT *>(e->llvm_lazy_jit);
+  if (lazyJIT != nullptr)
+    return lazyJIT->hasLoadFailed() ? 1 : 0;
   ExecutionEngine *engine = static_cast<ExecutionEngine *>(e->llvm_engine);
+  if (engine == nullptr || runtime->loadFailed ||
+      (runtime->uninitializedModules.empty() && !runtime->unresolvedObjects))
+    return runtime->loadFailed ? 1 : 0;
 
-  // finalize.
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  TimePoint codegenStart = StatsNow(runtime);
+  mm->startLoadTimer();
   engine->finalizeObject();
-  engine->runStaticConstructorsDestructors(false);
+  TimePoint linkEnd = StatsNow(runtime);
+
+  // Code generation may call functions the contract never declared, which
+  // RuntimeDyld could not resolve, and sandboxed data may not have fit.
+  std::vector<std::string> loadErrors = mm->takeLoadErrors();
+  if (!loadErrors.empty()) {
+    errs() << loadErrors.front();
+    runtime->loadFailed = true;
+    runtime->uninitializedModules.clear();
+    runtime->objectConstructors.clear();
+    runtime->unresolvedObjects = false;
+    return 1;
+  }
+
+  // Everything before RuntimeDyld allocated the first section is codegen.
+  // The interpreter does neither.
+  TimePoint linkStart;
+  if (!runtime->collectStats || !mm->getLoadStart(linkStart))
+    linkStart = linkEnd;
+  runtime->stats.phases.codegen_ns += NanosecondsSince(codegenStart, linkStart);
+  runtime->stats.phases.link_ns += NanosecondsSince(linkStart, linkEnd);
+
+  for (Module *module : runtime->uninitializedModules)
+    engine->runStaticConstructorsDestructors(*module, false);
+  runtime->uninitializedModules.clear();
+  for (const std::string &ctor : runtime->objectConstructors) {
+    uint64_t addr = engine->getFunctionAddress(ctor);
+    if (addr != 0)
+      ((void (*)())addr)();
+  }
+  runtime->objectConstructors.clear();
+  runtime->unresolvedObjects = false;
+  runtime->stats.phases.finalize_ns +=
+      NanosecondsSince(linkEnd, StatsNow(runtime));
+  return 0;
+}
+
+int CaptureEngineImage(Engine *e) {
+  FinalizeEngine(e);
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  if (!runtime->interpreted) {
+    MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+    return mm->snapshotDataSections() ? 0 : 1;
+  }
+
+  // The interpreter lays globals out in memory of its own, copy them.
+  runtime->globalImage.clear();
+  ExecutionEngine *engine = static_cast<ExecutionEngine *>(e->llvm_engine);
+  Module *module = static_cast<Module *>(e->llvm_main_module);
+  if (engine == nullptr)
+    return 0;
+  const DataLayout &dl = module->getDataLayout();
+  for (GlobalVariable &gv : module->globals()) {
+    if (gv.isDeclaration() || gv.isConstant())
+      continue;
+    uint8_t *addr = static_cast<uint8_t *>(engine->getPointerToGlobal(&gv));
+    runtime->globalImage.emplace_back(
+        addr, std::string(reinterpret_cast<char *>(addr),
+                          dl.getTypeAllocSize(gv.getValueType())));
+  }
+  return 0;
+}
+
+void RestoreEngineImage(Engine *e) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  for (auto &global : runtime->globalImage)
+    memcpy(global.first, global.second.data(), global.second.size());
+
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  mm->restoreDataSections();
+}
+
+void EnableEngineStats(Engine *e) {
+  static_cast<EngineRuntime *>(e->nvm_runtime)->collectStats = true;
+}
+
+int GetEngineStats(Engine *e, EngineStats *stats) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  if (!runtime->collectStats)
+    return 1;
+
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  *stats = runtime->stats;
+  stats->code_bytes = mm->getCodeBytes();
+  stats->data_bytes = mm->getDataBytes();
+  stats->symbols_resolved = mm->getSymbolsResolved();
+  stats->sandbox_pages_touched =
+      runtime->arena != nullptr ? runtime->arena->residentPages() : 0;
+  return 0;
+}
+
+void BindArena(Engine *e, SandboxArena *a) {
+  ContractArena *arena = static_cast<ContractArena *>(a->nvm_arena);
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  // The globals of sandboxed engines live in their arena.
+  if (runtime->pipeline.Sandbox != sandbox_none && runtime->arena != arena) {
+    errs() << "sandboxed engines cannot be bound to another arena.";
+    return;
+  }
+  runtime->arena = arena;
+  BindSymbol(e, "__sfi_memory_base", arena->memoryBaseCell());
+  BindSymbol(e, "__sfi_stack", arena->stackCell());
+  BindSymbol(e, "__sfi_stack_limit", arena->stackLimitCell());
+  BindSymbol(e, "__nvm_output", arena->outputCell());
+  BindSymbol(e, "__nvm_output_capacity", arena->outputCapacityCell());
+  BindSymbol(e, "__nvm_output_length", arena->outputLengthCell());
+}
+
+static Function *FindContractFunction(Engine *e, const char *funcName) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  for (Module *module : runtime->modules) {
+    Function *func = module->getFunction(funcName);
+    if (func != nullptr && !func->isDeclaration())
+      return func;
+  }
+  return nullptr;
+}
+
+static uint64_t GetFunctionAddress(Engine *e, const char *funcName) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  if (runtime->interpreted)
+    return 0;
+
+  LazyContractJIT *lazyJIT = static_cast<LazyContractJIT *>(e->llvm_lazy_jit);
+  if (lazyJIT != nullptr) {
+    if (lazyJIT->hasLoadFailed())
+      return 0;
+    // This is the address of the function's stub, which compiles the
+    // function on its first call.
+    JITSymbol sym = lazyJIT->findSymbol(funcName);
+    if (!sym) {
+      if (Error err = sym.takeError())
+        errs() << toString(std::move(err));
+      return 0;
+    }
+    Expected<JITTargetAddress> addr = sym.getAddress();
+    if (!addr) {
+      errs() << toString(addr.takeError());
+      return 0;
+    }
+    return *addr;
+  }
+
+  ExecutionEngine *engine = static_cast<ExecutionEngine *>(e->llvm_engine);
+  if (engine == nullptr)
+    return 0;
+
+  FinalizeEngine(e);
+  if (runtime->loadFailed)
+    return 0;
+  return engine->getFunctionAddress(funcName);
+}
+
+static bool HasContractABI(Function *func) {
+  FunctionType *funcType = func->getFunctionType();
+  if (funcType->isVarArg() || funcType->getNumParams() != 2)
+    return false;
+
+  const DataLayout &dl = func->getParent()->getDataLayout();
+  Type *retType = funcType->getReturnType();
+  Type *lenType = funcType->getParamType(0);
+  Type *dataType = funcType->getParamType(1);
+  return retType->isIntegerTy(sizeof(int) * 8) &&
+         lenType->isIntegerTy(sizeof(size_t) * 8) &&
+         dataType->isPointerTy() &&
+         dl.getTypeSizeInBits(dataType) == sizeof(void *) * 8;
+}
+
+ContractEntry GetContractEntry(Engine *e, const char *funcName) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  auto it = runtime->entryPoints.find(funcName);
+  if (it != runtime->entryPoints.end())
+    return it->second;
+
+  // Functions without IR can only be called if their object's manifest
+  // lists them as entry points.
+  Function *func = FindContractFunction(e, funcName);
+  if (func != nullptr ? !HasContractABI(func)
+                      : !runtime->objectEntryPoints.count(funcName))
+    return NULL;
+
+  uint64_t addr = GetFunctionAddress(e, funcName);
+  if (addr == 0)
+    return NULL;
+
+  ContractEntry entry = reinterpret_cast<ContractEntry>(addr);
+  runtime->entryPoints[funcName] = entry;
+  return entry;
+}
+
+int RunFunction(Engine *e, const char *funcName, size_t len,
+                const uint8_t *data) {
+  ContractEntry entry = GetContractEntry(e, funcName);
+  if (entry != NULL)
+    return entry(len, data);
 
-  Function *func = module->getFunction(StringRef(funcName));
+  // Slow path for entry points that do not follow the contract ABI.
+  Function *func = FindContractFunction(e, funcName);
   if (func == nullptr) {
     char msg[128];
     snprintf(msg, 128, "%s function not found.", funcName);
@@ -197,6 +1162,33 @@ int RunFunction(Engine *e, const char *funcName, size_t len,
     return -1;
   }
 
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  if (runtime->interpreted) {
+    FinalizeEngine(e);
+    interpretedRuntime = runtime;
+  }
+
+  if (e->llvm_lazy_jit != NULL) {
+    // Orc has no generic runFunction, only entry points without arguments
+    // can be called on lazy engines.
+    uint64_t addr = GetFunctionAddress(e, funcName);
+    if (addr == 0 || !func->arg_empty()) {
+      errs() << "unsupported entry point signature.";
+      return -1;
+    }
+    if (func->getReturnType()->isIntegerTy(sizeof(int) * 8))
+      return ((int (*)())addr)();
+    ((void (*)())addr)();
+    return 0;
+  }
+
+  ExecutionEngine *engine = static_cast<ExecutionEngine *>(e->llvm_engine);
+
+  if (!runtime->interpreted) {
+    FinalizeEngine(e);
+    if (runtime->loadFailed)
+      return -1;
+  }
   (void)engine->getPointerToFunction(func);
 
   FunctionType *funcType = func->getFunctionType();
@@ -222,7 +1214,312 @@ int RunFunction(Engine *e, const char *funcName, size_t len,
   }
 }
 
+// Identifies everything, besides the contract, that shapes the code of a
+// contract compiled ahead of time: the pass pipeline, the codegen level and
+// the host target.
+static std::string GetPipelineHash(const PipelineOptions &options) {
+  const HostTarget &host = GetHostTarget();
+
+  SHA1 hasher;
+  hasher.update(GetPipelineID(options));
+  hasher.update(StringRef("|"));
+  hasher.update(StringRef(std::to_string(GetCodeGenOptLevel(options.Level))));
+  hasher.update(StringRef("|"));
+  hasher.update(host.triple);
+  hasher.update(StringRef("|"));
+  hasher.update(host.cpu);
+  hasher.update(StringRef("|"));
+  hasher.update(host.featureStr);
+  return toHex(hasher.final());
+}
+
+// Section the manifest of a compiled contract is emitted to.
+static const char *GetManifestSection() {
+  if (Triple(GetHostTarget().triple).isOSBinFormatMachO())
+    return "__NVM,__manifest";
+  return ".nvm_manifest";
+}
+
+static bool IsManifestSection(StringRef name) {
+  return name == ".nvm_manifest" || name == "__manifest";
+}
+
+// The manifest is a line per record: the pipeline hash, then the
+// constructors, imports, entry points and other exported functions.
+static std::string WriteManifest(const CompiledContract &contract,
+                                 const PipelineOptions &options) {
+  std::string manifest = "pipeline " + GetPipelineHash(options) + "\n";
+  for (const std::string &name : contract.Constructors)
+    manifest += "ctor " + name + "\n";
+  for (const std::string &name : contract.Imports)
+    manifest += "import " + name + "\n";
+  return manifest + WriteExports(contract);
+}
+
+static int ReadManifest(const object::ObjectFile &obj,
+                        const PipelineOptions &options,
+                        CompiledContract &contract) {
+  StringRef manifest;
+  bool found = false;
+  for (const object::SectionRef &section : obj.sections()) {
+    StringRef name;
+    if (section.getName(name) || !IsManifestSection(name))
+      continue;
+    found = !section.getContents(manifest);
+    break;
+  }
+  if (!found) {
+    errs() << "object has no contract manifest.";
+    return 1;
+  }
+
+  if (ReadManifestRecords(manifest, contract) != GetPipelineHash(options)) {
+    errs() << "object was compiled for a different pipeline, level, sandbox "
+              "or target.";
+    return 1;
+  }
+  return 0;
+}
+
+PipelineOptions GetPipelineOptions(Engine *e) {
+  return static_cast<EngineRuntime *>(e->nvm_runtime)->pipeline;
+}
+
+uint64_t GetEngineID(Engine *e) {
+  return static_cast<EngineRuntime *>(e->nvm_runtime)->id;
+}
+
+bool CompileContractObject(StringRef contract, const PipelineOptions &options,
+                           CompiledContract &result) {
+  // The imports are checked when the object is linked.
+  std::string verdictKey;
+  bool unchecked;
+  if (RejectedBefore(contract, nullptr, verdictKey, unchecked))
+    return false;
+
+  LLVMContext context;
+  std::unique_ptr<Module> module =
+      ParseContract(MemoryBufferRef(contract, "contract"), context);
+  if (module == nullptr)
+    return false;
+
+  SetTargetAndDataLayout(module.get());
+  if (unchecked && ValidateContract(*module, nullptr, verdictKey) != 0)
+    return false;
+  std::unique_ptr<legacy::PassManager> passMgr(CreatePassManager(options));
+  passMgr->run(*module);
+
+  // The engine never sees this module, so it can not run the constructors
+  // from llvm.global_ctors. Export them under names unique to the contract
+  // instead, and drop the table.
+  if (GlobalVariable *ctors = module->getNamedGlobal("llvm.global_ctors")) {
+    SHA1 hasher;
+    hasher.update(contract);
+    std::string prefix = "__nvm_ctor." + toHex(hasher.final()) + ".";
+
+    ConstantArray *table = dyn_cast<ConstantArray>(ctors->getInitializer());
+    for (unsigned i = 0, n = table ? table->getNumOperands() : 0; i != n;
+         ++i) {
+      ConstantStruct *entry = dyn_cast<ConstantStruct>(table->getOperand(i));
+      if (entry == nullptr)
+        continue;
+      Function *ctor =
+          dyn_cast<Function>(entry->getOperand(1)->stripPointerCasts());
+      if (ctor == nullptr || ctor->isDeclaration())
+        continue;
+      if (ctor->hasLocalLinkage()) {
+        ctor->setName(prefix + Twine(i));
+        ctor->setLinkage(GlobalValue::ExternalLinkage);
+      }
+      result.Constructors.push_back(ctor->getName());
+    }
+    ctors->eraseFromParent();
+  }
+
+  for (Function &func : *module)
+    if (func.isDeclaration() && !func.isIntrinsic() && !func.use_empty())
+      result.Imports.push_back(func.getName());
+  CollectExports(*module, result);
+  for (GlobalVariable &gv : module->globals())
+    if (gv.isDeclaration() && !gv.use_empty())
+      result.Imports.push_back(gv.getName());
+
+  // Embed the manifest, so the object can be loaded on its own later on.
+  Constant *manifest = ConstantDataArray::getString(
+      context, WriteManifest(result, options), /*AddNull=*/false);
+  GlobalVariable *manifestVar = new GlobalVariable(
+      *module, manifest->getType(), /*isConstant=*/true,
+      GlobalValue::PrivateLinkage, manifest, "__nvm_manifest");
+  manifestVar->setSection(GetManifestSection());
+  manifestVar->setAlignment(1);
+
+  // Emit the object the same way MCJIT does, with the same TargetMachine
+  // settings the engine's builder uses.
+  std::unique_ptr<TargetMachine> targetMachine =
+      CreateHostTargetMachine(options.Level);
+  SmallVector<char, 4096> objBuffer;
+  raw_svector_ostream objStream(objBuffer);
+  legacy::PassManager codegen;
+  MCContext *mcContext;
+  if (targetMachine->addPassesToEmitMC(codegen, mcContext, objStream)) {
+    errs() << "target does not support MC emission.";
+    return false;
+  }
+  codegen.run(*module);
+
+  result.Object.reset(new ObjectMemoryBuffer(std::move(objBuffer)));
+  return true;
+}
+
+int AddContractObject(Engine *e, CompiledContract &contract) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  if (runtime->interpreted || e->llvm_lazy_jit != NULL) {
+    errs() << "compiled contracts can only be added to MCJIT engines.";
+    return 1;
+  }
+
+  Expected<std::unique_ptr<object::ObjectFile>> obj =
+      object::ObjectFile::createObjectFile(contract.Object->getMemBufferRef());
+  if (!obj) {
+    errs() << toString(obj.takeError());
+    return 1;
+  }
+
+  // The object was compiled without the engine's imports at hand, so check
+  // them now, before RuntimeDyld gets to see any unresolved symbol. The
+  // symbol table is what gets linked; the manifest only describes it.
+  const HostImportTable &imports = mm->getImports();
+  char globalPrefix = GetHostTarget().dataLayout.getGlobalPrefix();
+  for (const object::SymbolRef &sym : (*obj)->symbols()) {
+    if (!(sym.getFlags() & object::SymbolRef::SF_Undefined))
+      continue;
+    Expected<StringRef> name = sym.getName();
+    if (!name) {
+      errs() << toString(name.takeError());
+      return 1;
+    }
+    StringRef importName = *name;
+    if (importName.empty())
+      continue;
+    if (globalPrefix != '\0' && importName.front() == globalPrefix)
+      importName = importName.drop_front();
+    if (imports.lookup(importName) == 0) {
+      errs() << "contract imports undeclared host symbol " << importName
+             << ".";
+      return 1;
+    }
+  }
+
+  // MCJIT is created along with its first module, start it with an empty
+  // one.
+  if (e->llvm_engine == NULL) {
+    LLVMContext *context = static_cast<LLVMContext *>(e->llvm_context);
+    std::unique_ptr<Module> stub =
+        llvm::make_unique<Module>("nvm-objects", *context);
+    SetTargetAndDataLayout(stub.get());
+    if (AddMCJITModule(e, std::move(stub)) != 0)
+      return 1;
+  }
+
+  ExecutionEngine *engine = static_cast<ExecutionEngine *>(e->llvm_engine);
+  engine->addObjectFile(object::OwningBinary<object::ObjectFile>(
+      std::move(*obj), std::move(contract.Object)));
+
+  runtime->unresolvedObjects = true;
+  runtime->objectConstructors.insert(runtime->objectConstructors.end(),
+                                     contract.Constructors.begin(),
+                                     contract.Constructors.end());
+  for (const std::string &name : contract.EntryPoints)
+    runtime->objectEntryPoints.insert(name);
+  return 0;
+}
+
+static int AddObject(Engine *e, std::unique_ptr<MemoryBuffer> buffer) {
+  EngineRuntime *runtime = static_cast<EngineRuntime *>(e->nvm_runtime);
+  Expected<std::unique_ptr<object::ObjectFile>> obj =
+      object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+  if (!obj) {
+    errs() << toString(obj.takeError());
+    return 1;
+  }
+
+  CompiledContract contract;
+  if (ReadManifest(**obj, runtime->pipeline, contract) != 0)
+    return 1;
+  contract.Object = std::move(buffer);
+  return AddContractObject(e, contract);
+}
+
+int AddObjectFile(Engine *e, const char *objPath) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> objBuffer =
+      MemoryBuffer::getFile(objPath, -1, false);
+  if (!objBuffer) {
+    errs() << objPath << ": " << objBuffer.getError().message() << ".";
+    return 1;
+  }
+  return AddObject(e, std::move(objBuffer.get()));
+}
+
+int AddObjectBuffer(Engine *e, const uint8_t *data, size_t len) {
+  return AddObject(e, MemoryBuffer::getMemBufferCopy(
+                          StringRef(reinterpret_cast<const char *>(data), len)));
+}
+
+int CompileContractToFile(const uint8_t *data, size_t len, int level,
+                          const char *objPath) {
+  if (level < exe_level_g || level > exe_level_O3) {
+    errs() << "invalid execution level " << level << ".";
+    return 1;
+  }
+
+  // Objects compiled ahead of time are not sandboxed, see SetSandboxMode.
+  PipelineOptions options;
+  options.Level = level;
+  CompiledContract contract;
+  if (!CompileContractObject(
+          StringRef(reinterpret_cast<const char *>(data), len), options,
+          contract))
+    return 1;
+
+  std::error_code ec;
+  raw_fd_ostream os(objPath, ec, sys::fs::F_None);
+  if (ec) {
+    errs() << objPath << ": " << ec.message() << ".";
+    return 1;
+  }
+  os << contract.Object->getBuffer();
+  return 0;
+}
+
 void BindSymbol(Engine *e, const char *funcName, void *address) {
   MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
   mm->bindSymbol(funcName, address);
 }
+
+HostImports *CreateHostImports() {
+  HostImports *h = static_cast<HostImports *>(calloc(1, sizeof(HostImports)));
+  h->nvm_imports =
+      new std::shared_ptr<HostImportTable>(new HostImportTable());
+  return h;
+}
+
+void DeleteHostImports(HostImports *h) {
+  delete static_cast<std::shared_ptr<HostImportTable> *>(h->nvm_imports);
+  free(h);
+}
+
+void HostImportsBind(HostImports *h, const char *name, void *address) {
+  std::shared_ptr<HostImportTable> &imports =
+      *static_cast<std::shared_ptr<HostImportTable> *>(h->nvm_imports);
+  // Engines already using the table keep the frozen version they got.
+  if (imports->isFrozen())
+    imports = std::make_shared<HostImportTable>(*imports);
+  imports->bind(name, (uint64_t)address);
+}
+
+void UseHostImports(Engine *e, HostImports *h) {
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  mm->useImports(
+      *static_cast<std::shared_ptr<HostImportTable> *>(h->nvm_imports));
+}
@@ -17,6 +17,8 @@
 // <http://www.gnu.org/licenses/>.
 //
 
+#pragma once
+
 #ifdef _cplusplus
 extern "C" {
 #endif
@@ -31,21 +33,426 @@ typedef struct EngineStruct {
   void *llvm_context;
   void *llvm_pass_manager;
   void *llvm_mem_manager;
+  void *llvm_object_cache;
+  void *nvm_runtime;
+  void *llvm_lazy_jit;
 } Engine;
 
+// Native signature of contract entry points.
+typedef int (*ContractEntry)(size_t len, const uint8_t *data);
+
+// Execution levels, trading compile time for code quality. They never change
+// gas accounting.
+typedef enum {
+  exe_level_g = 0, // NVM passes only, fast instruction selection.
+  exe_level_O1,    // Cheap cleanups, fast instruction selection.
+  exe_level_O2,    // Default; also removes redundant NVM runtime checks.
+  exe_level_O3,    // Adds inlining and loop optimizations.
+} exe_level_t;
+
+// How an engine confines the memory accesses of its contract to the arena it
+// is bound to, see SetSandboxMode.
+typedef enum {
+  sandbox_none = 0,     // Default; accesses are not confined.
+  sandbox_truncate,     // Keep the low 32 bits; 4 GiB arenas.
+  sandbox_guard_region, // Also folds 32-bit indexes; needs a 4 GiB guard.
+  sandbox_mask,         // Keep the bits of the arena size; compact arenas.
+} sandbox_mode_t;
+
+// Time an engine spent loading its contracts, in nanoseconds. Lazy engines
+// compile functions on first call, which is not accounted.
+typedef struct EnginePhaseTimesStruct {
+  uint64_t parse_ns;    // Reading IR or bitcode, and admission checks.
+  uint64_t passes_ns;   // NVM passes, optimizations and import checks.
+  uint64_t codegen_ns;  // Emitting objects, or loading them from the cache.
+  uint64_t link_ns;     // RuntimeDyld loading and relocation.
+  uint64_t finalize_ns; // Static constructors.
+} EnginePhaseTimes;
+
+// Cumulative engine statistics, see EnableEngineStats.
+typedef struct EngineStatsStruct {
+  EnginePhaseTimes phases;
+  uint64_t code_bytes;       // Code sections allocated by RuntimeDyld.
+  uint64_t data_bytes;       // Data sections allocated by RuntimeDyld.
+  uint64_t symbols_resolved; // Host imports linked into the contract code.
+  uint64_t cache_hits;       // Contracts loaded from the object cache.
+  uint64_t cache_misses;     // Contracts compiled despite an object cache.
+  uint64_t sandbox_pages_touched; // Resident pages of the bound arena.
+} EngineStats;
+
+// Declared host imports, shareable between engines.
+typedef struct HostImportsStruct {
+  void *nvm_imports;
+} HostImports;
+
+typedef struct EnginePoolStruct {
+  void *nvm_pool;
+} EnginePool;
+
+typedef struct TieredVMStruct {
+  void *nvm_tiers;
+} TieredVM;
+
+// Sandbox memory for contract executions, recycled through a pool. An arena
+// keeps its address for its whole lifetime.
+typedef struct SandboxArenaStruct {
+  void *nvm_arena;
+} SandboxArena;
+
+typedef struct ArenaPoolStruct {
+  void *nvm_arenas;
+} ArenaPool;
+
+// Shared memory that can be mapped into sandbox arenas.
+typedef struct IOBufferStruct {
+  void *nvm_buffer;
+} IOBuffer;
+
+typedef struct BlockExecutorStruct {
+  void *nvm_executor;
+} BlockExecutor;
+
+typedef struct CompileServiceStruct {
+  void *nvm_compiler;
+} CompileService;
+
+// How a contract call in a sandbox arena ended.
+typedef enum {
+  call_ok = 0,
+  call_memory_fault,  // Accessed a guard region of its arena.
+  call_out_of_gas,
+  call_stack_overflow,
+  call_load_failed,   // The contract could not be loaded.
+  call_invalid_call,  // Called through an invalid function pointer.
+} call_status_t;
+
 Engine *CreateEngine();
 
+// Create an engine that interprets its contract instead of compiling it. It
+// takes a single module. Without libffi it can only call the gas trap hook
+// and the C library functions the interpreter implements itself.
+Engine *CreateInterpreterEngine();
+
+// Create an engine that compiles contract functions lazily, on their first
+// call, instead of JIT-ing whole modules up front. Returns NULL if the target
+// does not support lazy compilation. Lazy engines cannot sandbox memory
+// accesses and are never pooled. A function that fails to link is only found
+// out on its first call, which aborts the contract with call_load_failed, or
+// the process outside of RunFunctionInArena; nothing of e runs afterwards.
+Engine *CreateLazyEngine();
+
+// Select the execution level, exe_level_O2 by default. Must be called before
+// any module is added. Returns non-zero on failure.
+int SetExecutionLevel(Engine *e, int level);
+
+// Cache compiled contract objects under cacheDir. Must be called before
+// AddModuleFile/AddModuleBuffer for the modules it should apply to.
+void EnableObjectCache(Engine *e, const char *cacheDir);
+
+// Allocate JIT code and constants from size-class slabs of one region
+// reserved for the whole process, made executable or read-only slab by slab,
+// and recycled when the engine is deleted. Saves the mappings and protection
+// changes of every load on nodes that keep creating and evicting engines.
+// Must be called before any module is added. Pooled engines always use it.
+void EnableSlabCodeMemory(Engine *e);
+
 int AddModuleFile(Engine *e, const char *irFile);
 
+// Add a contract from memory, normally bitcode. The buffer is only read
+// during the call and may be released by the caller afterwards.
+int AddModuleBuffer(Engine *e, const uint8_t *data, size_t len);
+
+// Ahead-of-time compilation. Compile a contract, IR or bitcode, at the given
+// execution level to a relocatable object for this host, with a manifest of
+// its imports, entry points and the pipeline that built it embedded. Returns
+// non-zero on failure.
+int CompileContractToFile(const uint8_t *data, size_t len, int level,
+                          const char *objPath);
+
+// Add a contract compiled by CompileContractToFile to an MCJIT engine,
+// skipping the NVM passes and codegen. The object is rejected unless it was
+// built by the same pipeline, at e's execution level, for the same target.
+// Objects are trusted to come from CompileContractToFile.
+int AddObjectFile(Engine *e, const char *objPath);
+
+// Same as AddObjectFile, from memory. The buffer is copied.
+int AddObjectBuffer(Engine *e, const uint8_t *data, size_t len);
+
 void DeleteEngine(Engine *e);
 
+// JIT and link all added modules and run the static constructors of those
+// not initialized yet. Called implicitly by GetContractEntry and RunFunction.
+// If the code refers to a symbol the imports do not declare, linking fails
+// and nothing of e runs anymore: GetContractEntry returns NULL and
+// RunFunction -1. Returns non-zero once linking failed.
+int FinalizeEngine(Engine *e);
+
+// Collect statistics for GetEngineStats. Must be called before any module
+// is added; statistics cost nothing until enabled.
+void EnableEngineStats(Engine *e);
+
+// Fill in *stats. Returns non-zero if statistics are not enabled. Counting
+// the sandbox pages touched walks the page tables of the bound arena, so do
+// not call this on every execution.
+int GetEngineStats(Engine *e, EngineStats *stats);
+
+// Capture the contract globals of a finalized engine as a copy-on-write
+// image. RestoreEngineImage brings them back to it without re-running static
+// constructors: it only drops the pages written since. Interpreted engines
+// keep a copy of their globals instead. Returns non-zero on failure.
+int CaptureEngineImage(Engine *e);
+
+void RestoreEngineImage(Engine *e);
+
+// Resolve an entry point once and return its native address, or NULL if it
+// does not exist or does not have the ContractEntry signature. The result is
+// cached and stays valid until the engine is deleted.
+ContractEntry GetContractEntry(Engine *e, const char *funcName);
+
 int RunFunction(Engine *e, const char *funcName, size_t len,
                 const uint8_t *data);
 
+// Declare a host import for this engine. Contracts can only link against
+// declared imports, never against other symbols of the process.
 void BindSymbol(Engine *e, const char *funcName, void *address);
 
+// Import tables declared once and shared by many engines, instead of binding
+// every symbol into each engine. The C library memory functions are declared
+// by default.
+HostImports *CreateHostImports();
+
+void DeleteHostImports(HostImports *h);
+
+// Engines already using the table are not affected.
+void HostImportsBind(HostImports *h, const char *name, void *address);
+
+// Link e against the table. Must be called before any module is added;
+// symbols bound to e afterwards only apply to e.
+void UseHostImports(Engine *e, HostImports *h);
+
+// Initialize the native target and detect the host CPU once for the whole
+// process. Call before creating any engine.
 void Initialize();
 
+// Engine pool. Checked out engines have their contract JIT-ed and finalized,
+// with contract globals reset to their post-initialization state. Return them
+// with ReturnEngine instead of DeleteEngine; idle engines are bounded by
+// capacity and evicted least recently used first.
+EnginePool *CreateEnginePool(size_t capacity);
+
+void DeleteEnginePool(EnginePool *p);
+
+void EnginePoolBindSymbol(EnginePool *p, const char *funcName, void *address);
+
+void EnginePoolEnableObjectCache(EnginePool *p, const char *cacheDir);
+
+// Bind engines the pool creates afterwards to arena a, which must outlive
+// them, sandboxed in mode, see BindArena and SetSandboxMode. Checkouts fail
+// if the mode does not fit the arena.
+void EnginePoolUseArena(EnginePool *p, SandboxArena *a, int mode);
+
+Engine *CheckoutEngine(EnginePool *p, const char *contractHash,
+                       const char *irFile);
+
+void ReturnEngine(EnginePool *p, Engine *e);
+
+// Tiered execution. Contracts are interpreted until they have been called
+// hotThreshold times, then compiled in the background; once the compile is
+// done, calls switch to native code. Every call starts from the contract's
+// post-initialization state, whatever the tier. At most capacity contracts
+// are kept, the least recently used are evicted first. Memory accesses are
+// not sandboxed in either tier.
+TieredVM *CreateTieredVM(unsigned hotThreshold, size_t capacity);
+
+void DeleteTieredVM(TieredVM *vm);
+
+void TieredVMBindSymbol(TieredVM *vm, const char *funcName, void *address);
+
+int TieredVMRunFunction(TieredVM *vm, const char *contractHash,
+                        const uint8_t *contract, size_t contractLen,
+                        const char *funcName, size_t len,
+                        const uint8_t *data);
+
+// Sandbox arena pool. Released arenas are reset, zeroing what the previous
+// execution wrote, and up to capacity of them are kept for reuse.
+ArenaPool *CreateArenaPool(size_t capacity);
+
+// Pool of arenas of arenaSize bytes, a power of two of at least 64 KiB,
+// followed by a guard region of guardSize bytes. Engines sandboxed in
+// guard-region mode need a guard of 4 GiB + 64 KiB; engines sandboxed in
+// mask mode confine to the arena size, up to 4 GiB, and need a 64 KiB guard.
+ArenaPool *CreateArenaPoolWithLayout(size_t capacity, uint64_t arenaSize,
+                                     uint64_t guardSize);
+
+void DeleteArenaPool(ArenaPool *p);
+
+// Returns NULL if no arena can be reserved.
+SandboxArena *AcquireArena(ArenaPool *p);
+
+// Released arenas lose their image, and the globals of engines sandboxed to
+// them, which must be deleted first.
+void ReleaseArena(ArenaPool *p, SandboxArena *a);
+
+// Make the current contents of the arena, outside the globals of sandboxed
+// engines and its I/O windows, the state
+// it is reset to instead of zero, e.g. after running a contract's
+// initialization in it. Returns non-zero on failure.
+int CaptureArenaImage(SandboxArena *a);
+
+// Reset a held arena for the next execution: back to its image or zero, with
+// I/O buffers unmapped and the stack rewound.
+void ResetArena(SandboxArena *a);
+
+// Create up to count idle arenas ahead of time, bounded by the pool capacity.
+// Returns the number of idle arenas.
+size_t ReserveArenas(ArenaPool *p, size_t count);
+
+void *GetArenaBase(SandboxArena *a);
+
+// Bind __sfi_memory_base, __sfi_stack, __sfi_stack_limit and the output
+// cells of e to the arena. The engine can run against it for as long as the
+// arena is held, across resets.
+void BindArena(Engine *e, SandboxArena *a);
+
+// Confine the memory accesses of the contract to the arena the engine is
+// bound to, which it stays bound to: the globals of the contract are
+// allocated inside the arena, and pointers it passes to host functions are
+// confined too, though host functions must still bound what they access
+// through them. The mode has to match the arena layout, see
+// CreateArenaPoolWithLayout: sandbox_truncate needs the default layout,
+// sandbox_guard_region 4 GiB arenas with a guard of 4 GiB + 64 KiB, and
+// sandbox_mask confines to the size of the arena, whatever it is. Objects
+// are only reused from caches and compile services for the same mode and
+// arena size. Only MCJIT engines sandbox; must be called after BindArena and
+// before any module is added. Returns non-zero on failure.
+int SetSandboxMode(Engine *e, int mode);
+
+// RunFunction, with faults on the guard regions of the arena turned into a
+// contract trap. Returns 0 and stores the result in *result, or non-zero if
+// the contract trapped: call_memory_fault for a fault on a guard region, the
+// first page of the arena or read-only data of a sandboxed engine,
+// call_invalid_call for a bad indirect call, call_stack_overflow for running
+// out of the native stack, otherwise the code passed to AbortArenaExecution.
+// Faults are handled on a signal stack installed for the calling thread. A
+// trapped arena must be released or reset before it is reused.
+int RunFunctionInArena(Engine *e, SandboxArena *a, const char *funcName,
+                       size_t len, const uint8_t *data, int *result);
+
+// Zero-copy contract I/O. Every arena has an input and an output window of
+// GetArenaWindowSize bytes at fixed offsets. Mapping an I/O buffer over a
+// window makes its pages part of the sandbox; mappings last until the arena
+// is released or reset. Contracts get the input as their data argument and
+// find the output window in __nvm_output, with its size in
+// __nvm_output_capacity; they store the length of their output in
+// __nvm_output_length.
+IOBuffer *CreateIOBuffer(size_t capacity);
+
+void DeleteIOBuffer(IOBuffer *b);
+
+uint8_t *GetIOBufferData(IOBuffer *b);
+
+// The capacity, rounded up to whole pages.
+size_t GetIOBufferCapacity(IOBuffer *b);
+
+size_t GetArenaWindowSize(SandboxArena *a);
+
+// Contract writes to a mapped input stay private to the arena. A buffer
+// mapped over a window replaces the one mapped before. Return non-zero if the
+// buffer is larger than the window.
+int MapArenaInput(SandboxArena *a, IOBuffer *b);
+
+int MapArenaOutput(SandboxArena *a, IOBuffer *b);
+
+// RunFunctionInArena, passing the first inputLen bytes of the mapped input
+// and storing the length of the output in *outputLen. Returns -1 if inputLen
+// exceeds the mapped input buffer.
+int RunFunctionWithIO(Engine *e, SandboxArena *a, const char *funcName,
+                      size_t inputLen, int *result, size_t *outputLen);
+
+// Unwind out of the innermost RunFunctionInArena of the calling thread, which
+// then returns code, a non-zero call_status_t. For trap hooks and host
+// functions called by the contract. Does not return.
+void AbortArenaExecution(int code);
+
+// For host functions called by a sandboxed contract: abort the innermost
+// RunFunctionInArena of the calling thread with call_memory_fault unless the
+// len bytes at data lie inside its arena. Pointers the contract passes are
+// confined to the arena, lengths are not. Does nothing for contracts that are
+// not sandboxed, or outside of RunFunctionInArena.
+void CheckArenaAccess(const void *data, size_t len);
+
+// Parallel block execution. Calls added to a block run concurrently on
+// workers, each with its own engines and sandbox arena, against a key-value
+// state the contracts reach through the nvm_storage_get and nvm_storage_put
+// imports. Calls whose reads were invalidated by an earlier call of the block
+// are re-executed, so the outcome is the same as running them one by one in
+// order. A workers value of 0 uses one per hardware thread.
+BlockExecutor *CreateBlockExecutor(unsigned workers);
+
+void DeleteBlockExecutor(BlockExecutor *x);
+
+void BlockExecutorBindSymbol(BlockExecutor *x, const char *funcName,
+                             void *address);
+
+void BlockExecutorEnableObjectCache(BlockExecutor *x, const char *cacheDir);
+
+void BlockExecutorSetState(BlockExecutor *x, const uint8_t *key,
+                           size_t keyLen, const uint8_t *value,
+                           size_t valueLen);
+
+// Returns 0 and points *value at the committed value, valid until the next
+// block runs, or non-zero if the key does not exist.
+int BlockExecutorGetState(BlockExecutor *x, const uint8_t *key, size_t keyLen,
+                          const uint8_t **value, size_t *valueLen);
+
+// Queue a call for the next block and return its index in the block. The
+// first call added after a block ran starts a new block. The data is copied
+// into the input window of the worker's arena; calls with more data than
+// fits end with call_memory_fault.
+size_t BlockExecutorAddCall(BlockExecutor *x, const char *contractHash,
+                            const char *irFile, const char *funcName,
+                            size_t len, const uint8_t *data,
+                            uint64_t gasLimit);
+
+// Declare a key the call reads, or writes if isWrite is non-zero. Declared
+// keys only guide scheduling: a call is held back while an earlier call of
+// the block declares a write to one of its keys.
+void BlockExecutorDeclareKey(BlockExecutor *x, size_t call,
+                             const uint8_t *key, size_t keyLen, int isWrite);
+
+// Execute and commit the queued calls. Returns non-zero if there is no
+// worker to run them on.
+int BlockExecutorRun(BlockExecutor *x);
+
+// Outcome of a call of the last block. Calls that did not end with call_ok
+// have no effect on the state.
+void BlockExecutorGetResult(BlockExecutor *x, size_t call, int *status,
+                            int *result, uint64_t *gasUsed);
+
+// Concurrent compilation. Contracts submitted for an engine are parsed,
+// instrumented and compiled on the service's threads, each in an LLVMContext
+// of its own, and linked into the engine by CompileServiceLink. Only MCJIT
+// engines are supported. A threads value of 0 uses one per hardware thread.
+CompileService *CreateCompileService(unsigned threads);
+
+// Waits for the running jobs.
+void DeleteCompileService(CompileService *s);
+
+// Queue a contract, IR or bitcode, to be compiled at the execution level of
+// e. The buffer is copied.
+void CompileServiceSubmit(CompileService *s, Engine *e, const uint8_t *data,
+                          size_t len);
+
+// Link the contracts compiled for e so far, or wait for and link all of them
+// if wait is non-zero. Must be called from the thread that uses e. Returns
+// the number of contracts still compiling for e, or -1 if one failed to
+// compile or link.
+int CompileServiceLink(CompileService *s, Engine *e, int wait);
+
+// Drop the contracts submitted for e that are not linked yet. Call it before
+// deleting e, unless all of them were linked.
+void CompileServiceForget(CompileService *s, Engine *e);
+
 #ifdef _cplusplus
 }
 #endif
@@ -0,0 +1,242 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "engine_pool.h"
+#include "memory_manager.h"
+#include "sandbox_arena.h"
+
+#include <stdlib.h>
+
+ContractEnginePool::ContractEnginePool(size_t Capacity)
+    : capacity(Capacity), idleCount(0), imports(new HostImportTable()),
+      arena(nullptr), sandboxMode(sandbox_none) {}
+
+ContractEnginePool::~ContractEnginePool() {
+  for (auto &it : this->idle) {
+    for (Engine *e : it.second.Engines) {
+      DeleteEngine(e);
+    }
+  }
+  // Engines still checked out are owned by their callers until returned.
+}
+
+void ContractEnginePool::bindSymbol(const std::string &Name, void *Address) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  // Engines already created keep the frozen table they share.
+  if (this->imports->isFrozen())
+    this->imports = std::make_shared<HostImportTable>(*this->imports);
+  this->imports->bind(Name, (uint64_t)Address);
+}
+
+void ContractEnginePool::setObjectCacheDir(const std::string &Dir) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  this->cacheDir = Dir;
+}
+
+void ContractEnginePool::useArena(ContractArena *Arena, int Mode) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  this->arena = Arena;
+  this->sandboxMode = Mode;
+}
+
+Engine *ContractEnginePool::createEngine(const char *irFile) {
+  std::shared_ptr<HostImportTable> engineImports;
+  std::string objectCacheDir;
+  ContractArena *engineArena;
+  int engineSandboxMode;
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    // Frozen once, then shared by every engine of the pool.
+    this->imports->freeze();
+    engineImports = this->imports;
+    objectCacheDir = this->cacheDir;
+    engineArena = this->arena;
+    engineSandboxMode = this->sandboxMode;
+  }
+
+  Engine *e = CreateEngine();
+  // Evicted engines give their code pages back to the next ones created.
+  EnableSlabCodeMemory(e);
+  if (!objectCacheDir.empty()) {
+    EnableObjectCache(e, objectCacheDir.c_str());
+  }
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  mm->useImports(std::move(engineImports));
+  if (engineArena != nullptr) {
+    BindArena(e, engineArena->handle());
+    if (SetSandboxMode(e, engineSandboxMode) != 0) {
+      DeleteEngine(e);
+      return NULL;
+    }
+  }
+
+  if (AddModuleFile(e, irFile) != 0) {
+    DeleteEngine(e);
+    return NULL;
+  }
+
+  // JIT and link the contract now, so checked out engines are ready to run,
+  // and fail the checkout if it does not link rather than every call.
+  if (FinalizeEngine(e) != 0) {
+    DeleteEngine(e);
+    return NULL;
+  }
+
+  // Checked out engines start from this image, without their state being
+  // rebuilt by the static constructors.
+  if (!mm->snapshotDataSections()) {
+    DeleteEngine(e);
+    return NULL;
+  }
+  return e;
+}
+
+Engine *ContractEnginePool::checkout(const std::string &ContractHash,
+                                     const char *irFile) {
+  Engine *e = NULL;
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    auto it = this->idle.find(ContractHash);
+    if (it != this->idle.end()) {
+      e = it->second.Engines.back();
+      it->second.Engines.pop_back();
+      if (it->second.Engines.empty()) {
+        this->lru.erase(it->second.LRUPos);
+        this->idle.erase(it);
+      }
+      --this->idleCount;
+      this->checkedOut[e] = ContractHash;
+    }
+  }
+
+  if (e != NULL) {
+    // Bring the contract globals back to their post-initialization state.
+    MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+    mm->restoreDataSections();
+    return e;
+  }
+
+  e = this->createEngine(irFile);
+  // Idle engines keep their globals in the arena, which may be what the
+  // contract did not fit in; make room and try once more.
+  if (e == NULL && this->evictIdleFromArena())
+    e = this->createEngine(irFile);
+  if (e != NULL) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->checkedOut[e] = ContractHash;
+  }
+  return e;
+}
+
+void ContractEnginePool::checkin(Engine *e) {
+  std::vector<Engine *> evicted;
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    auto it = this->checkedOut.find(e);
+    if (it == this->checkedOut.end()) {
+      evicted.push_back(e);
+    } else {
+      std::string contractHash = std::move(it->second);
+      this->checkedOut.erase(it);
+
+      auto idleIt = this->idle.find(contractHash);
+      if (idleIt == this->idle.end()) {
+        this->lru.push_front(contractHash);
+        IdleEngines &entry = this->idle[contractHash];
+        entry.LRUPos = this->lru.begin();
+        entry.Engines.push_back(e);
+      } else {
+        this->lru.splice(this->lru.begin(), this->lru, idleIt->second.LRUPos);
+        idleIt->second.Engines.push_back(e);
+      }
+      ++this->idleCount;
+      this->evict(evicted, this->capacity);
+    }
+  }
+
+  // Tear down outside the lock, deleting an engine is not cheap.
+  for (Engine *victim : evicted) {
+    DeleteEngine(victim);
+  }
+}
+
+bool ContractEnginePool::evictIdleFromArena() {
+  std::vector<Engine *> evicted;
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->arena == nullptr)
+      return false;
+    this->evict(evicted, 0);
+  }
+  for (Engine *victim : evicted) {
+    DeleteEngine(victim);
+  }
+  return !evicted.empty();
+}
+
+void ContractEnginePool::evict(std::vector<Engine *> &Evicted,
+                               size_t Keep) {
+  while (this->idleCount > Keep && !this->lru.empty()) {
+    auto it = this->idle.find(this->lru.back());
+    Evicted.push_back(it->second.Engines.back());
+    it->second.Engines.pop_back();
+    if (it->second.Engines.empty()) {
+      this->lru.pop_back();
+      this->idle.erase(it);
+    }
+    --this->idleCount;
+  }
+}
+
+EnginePool *CreateEnginePool(size_t capacity) {
+  EnginePool *p = static_cast<EnginePool *>(calloc(1, sizeof(EnginePool)));
+  p->nvm_pool = new ContractEnginePool(capacity);
+  return p;
+}
+
+void DeleteEnginePool(EnginePool *p) {
+  delete static_cast<ContractEnginePool *>(p->nvm_pool);
+  free(p);
+}
+
+void EnginePoolBindSymbol(EnginePool *p, const char *funcName, void *address) {
+  ContractEnginePool *pool = static_cast<ContractEnginePool *>(p->nvm_pool);
+  pool->bindSymbol(std::string(funcName), address);
+}
+
+void EnginePoolEnableObjectCache(EnginePool *p, const char *cacheDir) {
+  ContractEnginePool *pool = static_cast<ContractEnginePool *>(p->nvm_pool);
+  pool->setObjectCacheDir(std::string(cacheDir));
+}
+
+void EnginePoolUseArena(EnginePool *p, SandboxArena *a, int mode) {
+  ContractEnginePool *pool = static_cast<ContractEnginePool *>(p->nvm_pool);
+  pool->useArena(static_cast<ContractArena *>(a->nvm_arena), mode);
+}
+
+Engine *CheckoutEngine(EnginePool *p, const char *contractHash,
+                       const char *irFile) {
+  ContractEnginePool *pool = static_cast<ContractEnginePool *>(p->nvm_pool);
+  return pool->checkout(std::string(contractHash), irFile);
+}
+
+void ReturnEngine(EnginePool *p, Engine *e) {
+  ContractEnginePool *pool = static_cast<ContractEnginePool *>(p->nvm_pool);
+  pool->checkin(e);
+}
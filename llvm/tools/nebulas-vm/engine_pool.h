@@ -0,0 +1,89 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include "engine.h"
+#include "host_imports.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ContractArena;
+
+/// A pool of ready-to-run engines, keyed by contract hash.
+///
+/// Engines handed out by checkout() already have their contract JIT-ed,
+/// finalized and its static constructors run. Returned engines are kept idle
+/// for reuse; the number of idle engines is bounded by the pool capacity and
+/// the least recently used contracts are evicted first.
+class ContractEnginePool {
+  ContractEnginePool(const ContractEnginePool &) = delete;
+  void operator=(const ContractEnginePool &) = delete;
+
+public:
+  explicit ContractEnginePool(size_t Capacity);
+  ~ContractEnginePool();
+
+  /// Symbols bound into every engine created by the pool afterwards.
+  void bindSymbol(const std::string &Name, void *Address);
+  void setObjectCacheDir(const std::string &Dir);
+
+  /// Bind every engine created afterwards to Arena, which must outlive
+  /// them, and sandbox it in Mode, see SetSandboxMode. Checkouts fail if
+  /// the mode does not fit the arena. Idle engines are evicted when the
+  /// globals of a new one do not fit in the arena next to theirs.
+  void useArena(ContractArena *Arena, int Mode);
+
+  Engine *checkout(const std::string &ContractHash, const char *irFile);
+  void checkin(Engine *e);
+
+private:
+  typedef std::list<std::string> LRUList;
+
+  struct IdleEngines {
+    LRUList::iterator LRUPos;
+    std::vector<Engine *> Engines;
+  };
+
+  Engine *createEngine(const char *irFile);
+  // Evict least recently used idle engines until at most Keep are left.
+  void evict(std::vector<Engine *> &Evicted, size_t Keep);
+  // Delete all idle engines if they are bound to an arena. Returns whether
+  // there were any.
+  bool evictIdleFromArena();
+
+  std::mutex lock;
+  size_t capacity;
+  size_t idleCount;
+
+  // Contract hashes with idle engines, most recently used first.
+  LRUList lru;
+  std::unordered_map<std::string, IdleEngines> idle;
+  std::unordered_map<Engine *, std::string> checkedOut;
+
+  std::shared_ptr<HostImportTable> imports;
+  std::string cacheDir;
+  ContractArena *arena;
+  int sandboxMode;
+};
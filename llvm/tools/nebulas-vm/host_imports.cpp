@@ -0,0 +1,184 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "host_imports.h"
+#include "engine.h"
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/SHA1.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+using namespace llvm;
+
+#ifdef __SIZEOF_INT128__
+// Integer and conversion routines of the compiler runtime, which codegen
+// calls for 128-bit division and conversions between i128 and floating
+// point.
+extern "C" {
+__int128 __divti3(__int128, __int128);
+__int128 __modti3(__int128, __int128);
+unsigned __int128 __udivti3(unsigned __int128, unsigned __int128);
+unsigned __int128 __umodti3(unsigned __int128, unsigned __int128);
+__int128 __fixsfti(float);
+__int128 __fixdfti(double);
+__int128 __fixxfti(long double);
+unsigned __int128 __fixunssfti(float);
+unsigned __int128 __fixunsdfti(double);
+unsigned __int128 __fixunsxfti(long double);
+float __floattisf(__int128);
+double __floattidf(__int128);
+long double __floattixf(__int128);
+float __floatuntisf(unsigned __int128);
+double __floatuntidf(unsigned __int128);
+long double __floatuntixf(unsigned __int128);
+}
+#endif
+
+// What memory intrinsics lower to, and what contracts may call directly. The
+// pointers are confined to the arena of a sandboxed contract, the lengths are
+// not.
+static void *ContractMemcpy(void *Dst, const void *Src, size_t Len) {
+  CheckArenaAccess(Dst, Len);
+  CheckArenaAccess(Src, Len);
+  return memcpy(Dst, Src, Len);
+}
+
+static void *ContractMemmove(void *Dst, const void *Src, size_t Len) {
+  CheckArenaAccess(Dst, Len);
+  CheckArenaAccess(Src, Len);
+  return memmove(Dst, Src, Len);
+}
+
+static void *ContractMemset(void *Dst, int Value, size_t Len) {
+  CheckArenaAccess(Dst, Len);
+  return memset(Dst, Value, Len);
+}
+
+// Binds the float, double and long double variants of a C math function.
+#define BIND_MATH_1(name)                                                      \
+  do {                                                                         \
+    bind(#name "f", (uint64_t) static_cast<float (*)(float)>(&name##f));       \
+    bind(#name, (uint64_t) static_cast<double (*)(double)>(&name));            \
+    bind(#name "l",                                                            \
+         (uint64_t) static_cast<long double (*)(long double)>(&name##l));      \
+  } while (0)
+
+#define BIND_MATH_2(name)                                                      \
+  do {                                                                         \
+    bind(#name "f",                                                            \
+         (uint64_t) static_cast<float (*)(float, float)>(&name##f));           \
+    bind(#name, (uint64_t) static_cast<double (*)(double, double)>(&name));    \
+    bind(#name "l",                                                            \
+         (uint64_t) static_cast<long double (*)(long double, long double)>(    \
+             &name##l));                                                       \
+  } while (0)
+
+HostImportTable::HostImportTable() : Frozen(false) {
+  bind("memcpy", (uint64_t)&ContractMemcpy);
+  bind("memmove", (uint64_t)&ContractMemmove);
+  bind("memset", (uint64_t)&ContractMemset);
+
+  // What the floating point intrinsics the validator allows, and frem, lower
+  // to when the target has no instruction for them.
+  BIND_MATH_1(floor);
+  BIND_MATH_1(ceil);
+  BIND_MATH_1(trunc);
+  BIND_MATH_1(rint);
+  BIND_MATH_1(nearbyint);
+  BIND_MATH_1(round);
+  BIND_MATH_2(fmin);
+  BIND_MATH_2(fmax);
+  BIND_MATH_2(fmod);
+  bind("fmaf", (uint64_t) static_cast<float (*)(float, float, float)>(&fmaf));
+  bind("fma",
+       (uint64_t) static_cast<double (*)(double, double, double)>(&fma));
+  bind("fmal", (uint64_t) static_cast<long double (*)(
+                   long double, long double, long double)>(&fmal));
+
+#ifdef __SIZEOF_INT128__
+  bind("__divti3", (uint64_t)&__divti3);
+  bind("__modti3", (uint64_t)&__modti3);
+  bind("__udivti3", (uint64_t)&__udivti3);
+  bind("__umodti3", (uint64_t)&__umodti3);
+  bind("__fixsfti", (uint64_t)&__fixsfti);
+  bind("__fixdfti", (uint64_t)&__fixdfti);
+  bind("__fixxfti", (uint64_t)&__fixxfti);
+  bind("__fixunssfti", (uint64_t)&__fixunssfti);
+  bind("__fixunsdfti", (uint64_t)&__fixunsdfti);
+  bind("__fixunsxfti", (uint64_t)&__fixunsxfti);
+  bind("__floattisf", (uint64_t)&__floattisf);
+  bind("__floattidf", (uint64_t)&__floattidf);
+  bind("__floattixf", (uint64_t)&__floattixf);
+  bind("__floatuntisf", (uint64_t)&__floatuntisf);
+  bind("__floatuntidf", (uint64_t)&__floatuntidf);
+  bind("__floatuntixf", (uint64_t)&__floatuntixf);
+#endif
+}
+
+HostImportTable::HostImportTable(const HostImportTable &Other)
+    : Imports(Other.Imports), Frozen(false) {}
+
+void HostImportTable::bind(StringRef Name, uint64_t Address) {
+  assert(!this->Frozen && "binding into a frozen import table");
+  this->Imports.push_back(std::make_pair(Name.str(), Address));
+}
+
+void HostImportTable::freeze() {
+  if (this->Frozen)
+    return;
+
+  // Later bindings of a name win.
+  std::stable_sort(this->Imports.begin(), this->Imports.end(),
+                   [](const std::pair<std::string, uint64_t> &A,
+                      const std::pair<std::string, uint64_t> &B) {
+                     return A.first < B.first;
+                   });
+  std::vector<std::pair<std::string, uint64_t>> Unique;
+  for (auto &Import : this->Imports) {
+    if (!Unique.empty() && Unique.back().first == Import.first)
+      Unique.back().second = Import.second;
+    else
+      Unique.push_back(std::move(Import));
+  }
+  this->Imports.swap(Unique);
+
+  SHA1 Hasher;
+  for (auto &Import : this->Imports) {
+    Hasher.update(Import.first);
+    Hasher.update(StringRef("|"));
+  }
+  this->Version = "imports-1:" + toHex(Hasher.final());
+  this->Frozen = true;
+}
+
+uint64_t HostImportTable::lookup(StringRef Name) const {
+  assert(this->Frozen && "lookup in an unfrozen import table");
+  auto It = std::lower_bound(
+      this->Imports.begin(), this->Imports.end(), Name,
+      [](const std::pair<std::string, uint64_t> &Import, StringRef Name) {
+        return StringRef(Import.first) < Name;
+      });
+  if (It == this->Imports.end() || It->first != Name)
+    return 0;
+  return It->second;
+}
@@ -0,0 +1,63 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// The host functions and variables contract code may link against.
+///
+/// Imports are declared up front; nothing outside the table is ever resolved,
+/// in particular not through the process symbol table. Once frozen, the table
+/// is sorted and immutable, can be shared by any number of engines, and
+/// lookups are a binary search that does not allocate.
+class HostImportTable {
+public:
+  /// Starts out with the C library and compiler runtime functions code
+  /// generation may emit calls to on its own: for memory intrinsics, for the
+  /// floating point intrinsics contracts may use, frem, and 128-bit division
+  /// and conversions.
+  HostImportTable();
+
+  /// An unfrozen copy, to declare more imports on top of a shared table.
+  HostImportTable(const HostImportTable &Other);
+
+  /// Declare an import, replacing any earlier binding of the same name.
+  void bind(llvm::StringRef Name, uint64_t Address);
+
+  void freeze();
+  bool isFrozen() const { return Frozen; }
+
+  /// Returns the bound address, or 0 if Name is not declared. The table must
+  /// be frozen.
+  uint64_t lookup(llvm::StringRef Name) const;
+
+  /// Identifies the set of declared names. Objects compiled against one
+  /// version only link against tables of the same version.
+  const std::string &version() const { return Version; }
+
+private:
+  std::vector<std::pair<std::string, uint64_t>> Imports;
+  std::string Version;
+  bool Frozen;
+};
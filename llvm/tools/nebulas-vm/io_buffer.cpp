@@ -0,0 +1,105 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "io_buffer.h"
+
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+using namespace llvm;
+
+int CreateSharedMemoryFile(uint64_t Size) {
+  int FD = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+  // MFD_CLOEXEC; called directly since older C libraries lack the wrapper.
+  FD = syscall(SYS_memfd_create, "nvm-io", 1);
+#endif
+  if (FD < 0) {
+    char Name[64];
+    static unsigned Counter = 0;
+    snprintf(Name, sizeof(Name), "/nvm-io-%d-%u", (int)getpid(),
+             __sync_fetch_and_add(&Counter, 1));
+    FD = shm_open(Name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (FD < 0)
+      return -1;
+    shm_unlink(Name);
+  }
+  if (ftruncate(FD, Size) != 0) {
+    close(FD);
+    return -1;
+  }
+  return FD;
+}
+
+ContractIOBuffer *ContractIOBuffer::create(uint64_t Capacity) {
+  uint64_t PageSize = sys::Process::getPageSize();
+  Capacity = alignTo(std::max<uint64_t>(Capacity, 1), PageSize);
+
+  int FD = CreateSharedMemoryFile(Capacity);
+  if (FD < 0) {
+    errs() << "create I/O buffer failed.";
+    return nullptr;
+  }
+  void *Data =
+      mmap(NULL, Capacity, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+  if (Data == MAP_FAILED) {
+    errs() << "map I/O buffer failed.";
+    close(FD);
+    return nullptr;
+  }
+
+  ContractIOBuffer *Buffer = new ContractIOBuffer();
+  Buffer->FD = FD;
+  Buffer->Data = static_cast<uint8_t *>(Data);
+  Buffer->Capacity = Capacity;
+  Buffer->Handle.nvm_buffer = Buffer;
+  return Buffer;
+}
+
+ContractIOBuffer::~ContractIOBuffer() {
+  munmap(Data, Capacity);
+  close(FD);
+}
+
+IOBuffer *CreateIOBuffer(size_t capacity) {
+  ContractIOBuffer *buffer = ContractIOBuffer::create(capacity);
+  return buffer != nullptr ? buffer->handle() : NULL;
+}
+
+void DeleteIOBuffer(IOBuffer *b) {
+  delete static_cast<ContractIOBuffer *>(b->nvm_buffer);
+}
+
+uint8_t *GetIOBufferData(IOBuffer *b) {
+  return static_cast<ContractIOBuffer *>(b->nvm_buffer)->data();
+}
+
+size_t GetIOBufferCapacity(IOBuffer *b) {
+  return static_cast<ContractIOBuffer *>(b->nvm_buffer)->capacity();
+}
@@ -0,0 +1,59 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include "engine.h"
+#include <stdint.h>
+
+/// Create an unlinked, zero-filled file of Size bytes in memory, for mapping
+/// into several places. Returns the descriptor, or -1.
+int CreateSharedMemoryFile(uint64_t Size);
+
+/// Shared memory for contract input and output.
+///
+/// The pages are backed by an anonymous file, so besides being mapped into
+/// the host they can be mapped straight into the I/O windows of a sandbox
+/// arena. Payloads written here reach the contract, and its results come
+/// back, without being copied.
+class ContractIOBuffer {
+  ContractIOBuffer(const ContractIOBuffer &) = delete;
+  void operator=(const ContractIOBuffer &) = delete;
+
+public:
+  /// Returns null if the memory cannot be allocated. Capacity is rounded up
+  /// to whole pages.
+  static ContractIOBuffer *create(uint64_t Capacity);
+  ~ContractIOBuffer();
+
+  uint8_t *data() const { return Data; }
+  uint64_t capacity() const { return Capacity; }
+  int fd() const { return FD; }
+
+  IOBuffer *handle() { return &Handle; }
+
+private:
+  ContractIOBuffer() {}
+
+  int FD;
+  uint8_t *Data;
+  uint64_t Capacity;
+
+  IOBuffer Handle;
+};
@@ -0,0 +1,138 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "lazy_jit.h"
+#include "engine.h"
+#include <llvm/ADT/Triple.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LambdaResolver.h>
+#include <llvm/IR/Mangler.h>
+#include <llvm/Support/raw_ostream.h>
+#include <vector>
+
+LazyContractJIT *LazyContractJIT::create(std::unique_ptr<TargetMachine> TM,
+                                         MemoryManager *Bindings) {
+  Triple T(TM->getTargetTriple());
+
+  auto CompileCallbackMgr = orc::createLocalCompileCallbackManager(T, 0);
+  if (!CompileCallbackMgr)
+    return nullptr;
+
+  auto IndirectStubsMgrBuilder = orc::createLocalIndirectStubsManagerBuilder(T);
+  if (!IndirectStubsMgrBuilder)
+    return nullptr;
+
+  return new LazyContractJIT(std::move(TM), std::move(CompileCallbackMgr),
+                             std::move(IndirectStubsMgrBuilder), Bindings);
+}
+
+LazyContractJIT::LazyContractJIT(
+    std::unique_ptr<TargetMachine> TM,
+    std::unique_ptr<CompileCallbackMgr> CCMgr,
+    IndirectStubsManagerBuilder IndirectStubsMgrBuilder,
+    MemoryManager *Bindings)
+    : TM(std::move(TM)), DL(this->TM->createDataLayout()), Bindings(Bindings),
+      CCMgr(std::move(CCMgr)),
+      // The engine owns the memory manager and deletes it after the JIT.
+      ObjectLayer(
+          [Bindings]() {
+            return std::shared_ptr<RuntimeDyld::MemoryManager>(
+                std::shared_ptr<RuntimeDyld::MemoryManager>(), Bindings);
+          },
+          ObjLayerT::NotifyLoadedFtor(),
+          [this](ObjLayerT::ObjHandleT) { checkLoadErrors(); }),
+      CompileLayer(ObjectLayer, orc::SimpleCompiler(*this->TM)),
+      CODLayer(CompileLayer, extractSingleFunction, *this->CCMgr,
+               std::move(IndirectStubsMgrBuilder),
+               /*CloneStubsIntoPartitions=*/true),
+      HasModules(false), LoadFailed(false), NextCtorId(0) {}
+
+LazyContractJIT::~LazyContractJIT() {}
+
+Error LazyContractJIT::addModule(std::shared_ptr<Module> M) {
+  if (M->getDataLayout().isDefault())
+    M->setDataLayout(DL);
+
+  // Give static constructors unique external names, so they can be looked up
+  // and run once the module is owned by the JIT.
+  std::vector<std::string> CtorNames;
+  for (auto Ctor : orc::getConstructors(*M)) {
+    std::string NewCtorName = ("$static_ctor." + Twine(NextCtorId++)).str();
+    Ctor.Func->setName(NewCtorName);
+    Ctor.Func->setLinkage(GlobalValue::ExternalLinkage);
+    Ctor.Func->setVisibility(GlobalValue::HiddenVisibility);
+    CtorNames.push_back(mangle(NewCtorName));
+  }
+
+  if (!HasModules) {
+    MemoryManager *Bindings = this->Bindings;
+    auto Resolver = orc::createLambdaResolver(
+        [this](const std::string &Name) -> JITSymbol {
+          return CODLayer.findSymbol(Name, true);
+        },
+        [Bindings](const std::string &Name) -> JITSymbol {
+          return Bindings->findSymbol(Name);
+        });
+
+    auto HandleOrErr = CODLayer.addModule(std::move(M), std::move(Resolver));
+    if (HandleOrErr)
+      ModulesHandle = std::move(*HandleOrErr);
+    else
+      return HandleOrErr.takeError();
+    HasModules = true;
+  } else if (auto Err = CODLayer.addExtraModule(ModulesHandle, std::move(M))) {
+    return Err;
+  }
+
+  orc::CtorDtorRunner<CODLayerT> CtorRunner(std::move(CtorNames),
+                                            ModulesHandle);
+  return CtorRunner.runViaLayer(CODLayer);
+}
+
+JITSymbol LazyContractJIT::findSymbol(const std::string &Name) {
+  return CODLayer.findSymbol(mangle(Name), true);
+}
+
+void LazyContractJIT::checkLoadErrors() {
+  // RuntimeDyld left the relocations of unresolved symbols unapplied.
+  std::vector<std::string> Errors = Bindings->takeLoadErrors();
+  if (Errors.empty())
+    return;
+  errs() << Errors.front();
+  LoadFailed = true;
+  // Called from the stub being compiled, which would jump into the broken
+  // code on return. Unwinding skips the JIT's frames; the engine is unusable
+  // from here on anyway.
+  AbortArenaExecution(call_load_failed);
+}
+
+std::string LazyContractJIT::mangle(const std::string &Name) {
+  std::string MangledName;
+  {
+    raw_string_ostream MangledNameStream(MangledName);
+    Mangler::getNameWithPrefix(MangledNameStream, Name, DL);
+  }
+  return MangledName;
+}
+
+std::set<Function *> LazyContractJIT::extractSingleFunction(Function &F) {
+  std::set<Function *> Partition;
+  Partition.insert(&F);
+  return Partition;
+}
@@ -0,0 +1,104 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include "memory_manager.h"
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+#include <memory>
+#include <set>
+#include <string>
+
+using namespace llvm;
+
+/// Orc based JIT that compiles contract functions on first call.
+///
+/// Every function of an added module is replaced by a stub that compiles the
+/// function when it is first called, so the cost of a transaction scales with
+/// the code it executes rather than with the size of the contract. Symbols
+/// are resolved against the JIT-ed code first, then through the bindings of
+/// the engine's MemoryManager, which also allocates the code.
+///
+/// A function that fails to link, e.g. because code generation called a
+/// helper the imports do not declare, is only found out when its stub is
+/// first called and there is no caller left to fail. The JIT then refuses to
+/// run anything more, and aborts the contract with call_load_failed, or the
+/// process outside of RunFunctionInArena.
+class LazyContractJIT {
+  LazyContractJIT(const LazyContractJIT &) = delete;
+  void operator=(const LazyContractJIT &) = delete;
+
+public:
+  typedef orc::JITCompileCallbackManager CompileCallbackMgr;
+  typedef orc::RTDyldObjectLinkingLayer ObjLayerT;
+  typedef orc::IRCompileLayer<ObjLayerT, orc::SimpleCompiler> CompileLayerT;
+  typedef orc::CompileOnDemandLayer<CompileLayerT, CompileCallbackMgr>
+      CODLayerT;
+  typedef CODLayerT::IndirectStubsManagerBuilderT IndirectStubsManagerBuilder;
+  typedef CODLayerT::ModuleHandleT ModuleHandleT;
+
+  /// Returns nullptr if Orc has no lazy compilation support for the target.
+  static LazyContractJIT *create(std::unique_ptr<TargetMachine> TM,
+                                 MemoryManager *Bindings);
+
+  LazyContractJIT(std::unique_ptr<TargetMachine> TM,
+                  std::unique_ptr<CompileCallbackMgr> CCMgr,
+                  IndirectStubsManagerBuilder IndirectStubsMgrBuilder,
+                  MemoryManager *Bindings);
+  ~LazyContractJIT();
+
+  /// Add a module and run its static constructors.
+  Error addModule(std::shared_ptr<Module> M);
+
+  /// Returns the address of a function's stub; calling it compiles the
+  /// function on first use.
+  JITSymbol findSymbol(const std::string &Name);
+
+  /// Whether any function failed to link. Nothing may run afterwards.
+  bool hasLoadFailed() const { return LoadFailed; }
+
+private:
+  std::string mangle(const std::string &Name);
+
+  void checkLoadErrors();
+
+  static std::set<Function *> extractSingleFunction(Function &F);
+
+  std::unique_ptr<TargetMachine> TM;
+  DataLayout DL;
+  MemoryManager *Bindings;
+
+  std::unique_ptr<CompileCallbackMgr> CCMgr;
+  ObjLayerT ObjectLayer;
+  CompileLayerT CompileLayer;
+  CODLayerT CODLayer;
+
+  ModuleHandleT ModulesHandle;
+  bool HasModules;
+  bool LoadFailed;
+  unsigned NextCtorId;
+};
@@ -18,40 +18,424 @@
 //
 
 #include "memory_manager.h"
+#include "io_buffer.h"
+#include "sandbox_arena.h"
+#include <llvm/Support/Error.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Memory.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+#include <mutex>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-MemoryManager::MemoryManager() {}
+namespace {
+// Slabs come in size classes, from one page up, each four times the size of
+// the previous one. Larger sections are left to SectionMemoryManager.
+const unsigned kSlabClasses = 7;
 
-MemoryManager::~MemoryManager() {}
+// Address space reserved for the slabs of all engines of the process. Code
+// and data of every engine are close enough for 32-bit relative relocations.
+const uint64_t kSlabRegionSize = uint64_t(1) << 30;
 
-JITSymbol MemoryManager::findSymbol(const std::string &Name) {
-  const char *NameStr = Name.c_str();
+// Free slabs that keep their pages. Beyond this, the pages of slabs freed are
+// given back, but not the address space.
+const uint64_t kResidentFreeLimit = uint64_t(64) << 20;
 
-// DynamicLibrary::SearchForAddresOfSymbol expects an unmangled 'C' symbol
-// name so ff we're on Darwin, strip the leading '_' off.
-#ifdef __APPLE__
-  if (NameStr[0] == '_') {
-    ++NameStr;
+class SlabRegion {
+public:
+  static SlabRegion &get() {
+    // Never destroyed, engines may outlive static destructors.
+    static SlabRegion *Region = new SlabRegion();
+    return *Region;
   }
-#endif
 
-  printf("Name is %s, NameStr is %s\n", Name.c_str(), NameStr);
+  /// Returns a writable slab of at least Size bytes and sets SlabSize, or
+  /// returns null if Size is too large or the region is exhausted.
+  uint8_t *acquire(uint64_t Size, uint64_t &SlabSize);
+
+  /// Used is how much of the slab may have been written.
+  void release(uint8_t *Slab, uint64_t SlabSize, uint64_t Used);
+
+private:
+  struct FreeSlab {
+    uint8_t *Address;
+    bool Resident;
+  };
+
+  SlabRegion();
+
+  std::mutex Lock;
+  uint64_t PageSize;
+  uint8_t *Base;
+  uint64_t Next;
+  uint64_t FreeResident;
+  std::vector<FreeSlab> Free[kSlabClasses];
+};
+} // namespace
+
+SlabRegion::SlabRegion()
+    : PageSize(sys::Process::getPageSize()), Base(nullptr), Next(0),
+      FreeResident(0) {
+  void *Addr = mmap(NULL, kSlabRegionSize, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (Addr != MAP_FAILED)
+    Base = static_cast<uint8_t *>(Addr);
+}
+
+uint8_t *SlabRegion::acquire(uint64_t Size, uint64_t &SlabSize) {
+  unsigned Class = 0;
+  SlabSize = PageSize;
+  while (SlabSize < Size) {
+    if (++Class == kSlabClasses)
+      return nullptr;
+    SlabSize <<= 2;
+  }
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  // Reuse the most recently freed slab, the one most likely still cached.
+  if (!Free[Class].empty()) {
+    FreeSlab Slab = Free[Class].back();
+    Free[Class].pop_back();
+    if (Slab.Resident)
+      FreeResident -= SlabSize;
+    return Slab.Address;
+  }
+
+  if (Base == nullptr || Next + SlabSize > kSlabRegionSize)
+    return nullptr;
+  uint8_t *Slab = Base + Next;
+  if (mprotect(Slab, SlabSize, PROT_READ | PROT_WRITE) != 0)
+    return nullptr;
+  Next += SlabSize;
+  return Slab;
+}
 
-  uint64_t addr = 0;
+void SlabRegion::release(uint8_t *Slab, uint64_t SlabSize, uint64_t Used) {
+  // Free slabs are writable and never executable, so acquiring one does not
+  // cost a system call.
+  if (mprotect(Slab, SlabSize, PROT_READ | PROT_WRITE) != 0)
+    report_fatal_error("unprotect code slab failed.");
 
-  auto it = this->bindingSymbols.find(std::string(NameStr));
-  if (it == this->bindingSymbols.end()) {
-    addr = getSymbolAddress(Name);
+  unsigned Class = 0;
+  for (uint64_t ClassSize = PageSize; ClassSize < SlabSize; ClassSize <<= 2)
+    ++Class;
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  FreeSlab Entry = {Slab, FreeResident + SlabSize <= kResidentFreeLimit};
+  if (Entry.Resident) {
+    // Do not leave the previous contract's code behind for the next one.
+    memset(Slab, 0, Used);
+    FreeResident += SlabSize;
   } else {
-    addr = it->second;
+    // Dropped pages read back as zeros.
+    madvise(Slab, SlabSize, MADV_DONTNEED);
+  }
+  Free[Class].push_back(Entry);
+}
+
+MemoryManager::MemoryManager()
+    : imports(new HostImportTable()), slabs(false), arena(nullptr), imageFD(-1),
+      imageView(nullptr), imageSize(0), loadStarted(false), codeBytes(0),
+      dataBytes(0), symbolsResolved(0) {}
+
+MemoryManager::~MemoryManager() {
+  for (Slab &S : this->ownedSlabs) {
+    if (S.InArena)
+      this->arena->releaseData(S.Address, S.Size);
+    else
+      SlabRegion::get().release(S.Address, S.Size, S.Used);
   }
+  for (DataRegion &Region : this->dataRegions) {
+    if (Region.InArena)
+      this->arena->releaseData(Region.Address, Region.Size);
+    else
+      munmap(Region.Address, Region.Size);
+  }
+  if (this->imageFD >= 0) {
+    munmap(this->imageView, this->imageSize);
+    close(this->imageFD);
+  }
+}
+
+JITSymbol MemoryManager::findSymbol(const std::string &Name) {
+  StringRef NameStr = Name;
+
+// Imports are declared by their unmangled 'C' symbol name, so if we're on
+// Darwin, strip the leading '_' off.
+#ifdef __APPLE__
+  NameStr.consume_front("_");
+#endif
+
+  // Contracts never see the process symbol table. An undeclared symbol is
+  // returned as an error, which RuntimeDyld records instead of aborting the
+  // process; the engine then fails the load.
+  uint64_t Address = this->lookupSymbol(NameStr);
+  if (Address == 0) {
+    std::string Message =
+        ("contract imports undeclared host symbol " + NameStr + ".").str();
+    this->loadErrors.push_back(Message);
+    return JITSymbol(
+        make_error<StringError>(Message, inconvertibleErrorCode()));
+  }
+  ++this->symbolsResolved;
+  return JITSymbol(Address, JITSymbolFlags::Exported);
+}
+
+uint64_t MemoryManager::lookupSymbol(StringRef Name) {
+  return this->getImports().lookup(Name);
+}
+
+const HostImportTable &MemoryManager::getImports() {
+  // Only the engine's own table can still be unfrozen.
+  this->imports->freeze();
+  return *this->imports;
+}
 
-  return JITSymbol(addr, JITSymbolFlags::Exported);
+void MemoryManager::useImports(std::shared_ptr<HostImportTable> Imports) {
+  Imports->freeze();
+  this->imports = std::move(Imports);
 }
 
 void MemoryManager::bindSymbol(const char *Name, void *Address) {
-  this->bindSymbol(std::string(Name), Address);
+  if (this->imports->isFrozen())
+    this->imports = std::make_shared<HostImportTable>(*this->imports);
+  this->imports->bind(Name, (uint64_t)Address);
 }
 
 void MemoryManager::bindSymbol(const std::string &Name, void *Address) {
-  this->bindingSymbols[Name] = (uint64_t)Address;
+  this->bindSymbol(Name.c_str(), Address);
+}
+
+uint8_t *MemoryManager::allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                            unsigned SectionID,
+                                            StringRef SectionName) {
+  noteAllocation();
+  this->codeBytes += Size;
+  if (this->slabs) {
+    if (uint8_t *Addr = this->allocateFromSlab(Size, Alignment, true))
+      return Addr;
+  }
+  return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID,
+                                                   SectionName);
+}
+
+uint8_t *MemoryManager::allocateDataSection(uintptr_t Size, unsigned Alignment,
+                                            unsigned SectionID,
+                                            StringRef SectionName,
+                                            bool isReadOnly) {
+  noteAllocation();
+  this->dataBytes += Size;
+  bool InArena = this->arena != nullptr && SectionName != ".got";
+  if (!isReadOnly)
+    return this->allocateWritableData(Size, Alignment, InArena);
+  if (this->slabs || InArena) {
+    if (uint8_t *Addr = this->allocateFromSlab(Size, Alignment, false))
+      return Addr;
+  }
+  return SectionMemoryManager::allocateDataSection(
+      Size, Alignment, SectionID, SectionName, isReadOnly);
+}
+
+void MemoryManager::reserveAllocationSpace(
+    uintptr_t CodeSize, uint32_t CodeAlign, uintptr_t RODataSize,
+    uint32_t RODataAlign, uintptr_t RWDataSize, uint32_t RWDataAlign) {
+  // RuntimeDyld reserves space as the first step of loading an object.
+  noteAllocation();
+  // Keep the writable sections of an object together in one region.
+  if (RWDataSize != 0)
+    this->addDataRegion(RWDataSize + RWDataAlign, this->arena != nullptr);
+  // Likewise for code and read-only data, each in one slab.
+  if (this->slabs && CodeSize != 0)
+    this->addSlab(CodeSize + CodeAlign, true);
+  if ((this->slabs || this->arena != nullptr) && RODataSize != 0)
+    this->addSlab(RODataSize + RODataAlign, false);
+}
+
+bool MemoryManager::addSlab(uint64_t Size, bool Code) {
+  Slab S;
+  S.InArena = !Code && this->arena != nullptr;
+  if (S.InArena) {
+    S.Size = alignTo(Size, sys::Process::getPageSize());
+    S.Address = this->allocateArenaData(S.Size);
+    S.InArena = S.Address != nullptr;
+  }
+  if (!S.InArena)
+    S.Address = SlabRegion::get().acquire(Size, S.Size);
+  if (S.Address == nullptr)
+    return false;
+  S.Used = 0;
+  S.Code = Code;
+  S.Finalized = false;
+  this->ownedSlabs.push_back(S);
+  return true;
+}
+
+uint8_t *MemoryManager::allocateFromSlab(uintptr_t Size, unsigned Alignment,
+                                         bool Code) {
+  if (Alignment == 0)
+    Alignment = 16;
+
+  // Finalized slabs are no longer writable, so objects loaded later start
+  // new ones.
+  Slab *Found = nullptr;
+  for (auto I = this->ownedSlabs.rbegin(), E = this->ownedSlabs.rend();
+       I != E && !I->Finalized; ++I) {
+    if (I->Code == Code && alignTo(I->Used, Alignment) + Size <= I->Size) {
+      Found = &*I;
+      break;
+    }
+  }
+  if (Found == nullptr) {
+    if (!this->addSlab(Size + Alignment, Code))
+      return nullptr;
+    Found = &this->ownedSlabs.back();
+  }
+
+  uint64_t Offset = alignTo(Found->Used, Alignment);
+  Found->Used = Offset + Size;
+  return Found->Address + Offset;
+}
+
+bool MemoryManager::finalizeMemory(std::string *ErrMsg) {
+  for (Slab &S : this->ownedSlabs) {
+    if (S.Finalized)
+      continue;
+    if (mprotect(S.Address, S.Size,
+                 S.Code ? PROT_READ | PROT_EXEC : PROT_READ) != 0) {
+      if (ErrMsg)
+        *ErrMsg = "protect code slab failed.";
+      return true;
+    }
+    if (S.Code)
+      sys::Memory::InvalidateInstructionCache(S.Address, S.Used);
+    S.Finalized = true;
+  }
+  return SectionMemoryManager::finalizeMemory(ErrMsg);
+}
+
+uint8_t *MemoryManager::allocateArenaData(uint64_t Size) {
+  uint8_t *Addr = this->arena->allocateData(Size);
+  // RuntimeDyld cannot fail an allocation gracefully, so the data goes to
+  // host memory and the engine fails the load instead.
+  if (Addr == nullptr)
+    this->loadErrors.push_back("contract data does not fit the sandbox arena.");
+  return Addr;
+}
+
+bool MemoryManager::addDataRegion(uint64_t Size, bool InArena) {
+  Size = alignTo(Size, sys::Process::getPageSize());
+  uint8_t *Addr = InArena ? this->allocateArenaData(Size) : nullptr;
+  InArena = Addr != nullptr;
+  if (!InArena) {
+    void *Mapped = mmap(NULL, Size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Mapped == MAP_FAILED)
+      return false;
+    Addr = static_cast<uint8_t *>(Mapped);
+  }
+  DataRegion Region;
+  Region.Address = Addr;
+  Region.Size = Size;
+  Region.Used = 0;
+  Region.ImageOffset = 0;
+  Region.InImage = false;
+  Region.InArena = InArena;
+  this->dataRegions.push_back(Region);
+  return true;
+}
+
+uint8_t *MemoryManager::allocateWritableData(uintptr_t Size,
+                                             unsigned Alignment,
+                                             bool InArena) {
+  if (Alignment == 0)
+    Alignment = 16;
+
+  // The last region of the same kind, unless it is part of an image: those
+  // are never reused for later objects.
+  DataRegion *Found = nullptr;
+  for (auto I = this->dataRegions.rbegin(), E = this->dataRegions.rend();
+       I != E; ++I) {
+    if (I->InArena == InArena) {
+      Found = &*I;
+      break;
+    }
+  }
+  if (Found == nullptr || Found->InImage ||
+      alignTo(Found->Used, Alignment) + Size > Found->Size) {
+    if (!this->addDataRegion(Size + Alignment, InArena))
+      return nullptr;
+    Found = &this->dataRegions.back();
+  }
+
+  uint64_t Offset = alignTo(Found->Used, Alignment);
+  Found->Used = Offset + Size;
+  return Found->Address + Offset;
+}
+
+// Restoring an image this small copies it back; larger ones are remapped,
+// which only costs a fault for every page the next execution touches.
+static const uint64_t kCopyRestoreLimit = 0x4000;
+
+bool MemoryManager::snapshotDataSections() {
+  if (this->imageFD >= 0) {
+    munmap(this->imageView, this->imageSize);
+    close(this->imageFD);
+    this->imageFD = -1;
+  }
+
+  uint64_t Size = 0;
+  for (DataRegion &Region : this->dataRegions)
+    Size += Region.Size;
+  if (Size == 0)
+    return true;
+
+  int FD = CreateSharedMemoryFile(Size);
+  if (FD < 0) {
+    errs() << "create contract image failed.";
+    return false;
+  }
+  void *View = mmap(NULL, Size, PROT_READ, MAP_SHARED, FD, 0);
+  if (View == MAP_FAILED) {
+    errs() << "map contract image failed.";
+    close(FD);
+    return false;
+  }
+
+  // Copy the regions into the image once, then map them back from it.
+  uint64_t Offset = 0;
+  for (DataRegion &Region : this->dataRegions) {
+    if (pwrite(FD, Region.Address, Region.Size, Offset) !=
+            (ssize_t)Region.Size ||
+        mmap(Region.Address, Region.Size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, FD, Offset) == MAP_FAILED)
+      report_fatal_error("capture contract image failed.");
+    Region.ImageOffset = Offset;
+    Region.InImage = true;
+    Offset += Region.Size;
+  }
+
+  this->imageFD = FD;
+  this->imageView = static_cast<uint8_t *>(View);
+  this->imageSize = Size;
+  return true;
+}
+
+void MemoryManager::restoreDataSections() {
+  for (DataRegion &Region : this->dataRegions) {
+    if (!Region.InImage)
+      continue;
+    if (Region.Size <= kCopyRestoreLimit) {
+      memcpy(Region.Address, this->imageView + Region.ImageOffset,
+             Region.Size);
+      continue;
+    }
+    // Replacing the mapping drops every page written since.
+    if (mmap(Region.Address, Region.Size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, this->imageFD,
+             Region.ImageOffset) == MAP_FAILED)
+      report_fatal_error("restore contract image failed.");
+  }
 }
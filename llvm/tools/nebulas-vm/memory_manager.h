@@ -17,12 +17,19 @@
 // <http://www.gnu.org/licenses/>.
 //
 
+#pragma once
+
+#include "host_imports.h"
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <chrono>
+#include <memory>
 #include <string>
-#include <unordered_map>
+#include <vector>
 
 using namespace llvm;
 
+class ContractArena;
+
 class MemoryManager : public SectionMemoryManager {
   MemoryManager(const MemoryManager &) = delete;
   void operator=(const MemoryManager &) = delete;
@@ -34,6 +41,60 @@ public:
   void bindSymbol(const char *Name, void *Address);
   void bindSymbol(const std::string &Name, void *Address);
 
+  /// Share a frozen import table instead of the engine's own bindings.
+  /// Symbols bound afterwards go to a private copy.
+  void useImports(std::shared_ptr<HostImportTable> Imports);
+
+  /// The imports this engine links against, frozen on first use.
+  const HostImportTable &getImports();
+
+  /// Allocate code and read-only data from slabs of a region reserved once
+  /// for the whole process, instead of mapping memory for every section
+  /// group. Slabs are writable until finalizeMemory(), then turned
+  /// executable or read-only as a whole, and recycled when the engine is
+  /// deleted. Must be called before anything is allocated.
+  void useSlabs() { slabs = true; }
+
+  /// Allocate the data sections, writable and read-only, from the data area
+  /// of Arena, so that code sandboxed to the arena can reach the globals of
+  /// the contract. The global offset table holds host addresses and stays
+  /// outside. Must be called before anything is allocated; the arena must
+  /// outlive the engine.
+  void useArena(ContractArena *Arena) { arena = Arena; }
+
+  virtual uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                       unsigned SectionID,
+                                       StringRef SectionName);
+  virtual uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                                       unsigned SectionID,
+                                       StringRef SectionName, bool isReadOnly);
+
+  /// RuntimeDyld allocates the sections of an object as it starts loading
+  /// it, so the first allocation after startLoadTimer() separates code
+  /// generation from linking. Returns false if nothing was allocated since.
+  void startLoadTimer() { loadStarted = false; }
+  bool getLoadStart(std::chrono::steady_clock::time_point &Start) const {
+    Start = loadStart;
+    return loadStarted;
+  }
+
+  virtual bool needsToReserveAllocationSpace() { return true; }
+  virtual void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
+                                      uintptr_t RODataSize,
+                                      uint32_t RODataAlign,
+                                      uintptr_t RWDataSize,
+                                      uint32_t RWDataAlign);
+
+  virtual bool finalizeMemory(std::string *ErrMsg = nullptr);
+
+  /// Capture the writable data sections, i.e. the contract globals, as a
+  /// copy-on-write image, so that restoreDataSections() can later bring them
+  /// back to this state without reloading the object or re-running static
+  /// constructors. Sections allocated afterwards are not part of the image.
+  /// Returns false if the image could not be created.
+  bool snapshotDataSections();
+  void restoreDataSections();
+
   /// This method returns a RuntimeDyld::SymbolInfo for the specified function
   /// or variable. It is used to resolve symbols during module linking.
   ///
@@ -48,6 +109,78 @@ public:
   /// symbols.
   virtual JITSymbol findSymbol(const std::string &Name);
 
+  /// Bytes of sections allocated, and imports resolved, so far.
+  uint64_t getCodeBytes() const { return codeBytes; }
+  uint64_t getDataBytes() const { return dataBytes; }
+  uint64_t getSymbolsResolved() const { return symbolsResolved; }
+
+  /// Why loading failed since the last call: symbols findSymbol could not
+  /// resolve, whose relocations RuntimeDyld leaves unapplied, or data that
+  /// did not fit the arena and went to host memory instead. Code loaded
+  /// with errors must never run.
+  std::vector<std::string> takeLoadErrors() {
+    std::vector<std::string> Errors;
+    Errors.swap(loadErrors);
+    return Errors;
+  }
+
+  /// Returns the address of a bound symbol, or 0 if it is not declared.
+  /// Name is the unmangled 'C' symbol name.
+  uint64_t lookupSymbol(StringRef Name);
+
 private:
-  std::unordered_map<std::string, uint64_t> bindingSymbols;
+  /// Page-aligned memory writable data sections are carved from. Unlike the
+  /// sections of SectionMemoryManager, it can be remapped from an image.
+  struct DataRegion {
+    uint8_t *Address;
+    uint64_t Size;
+    uint64_t Used;
+    // Offset of the region in the image, if InImage.
+    uint64_t ImageOffset;
+    bool InImage;
+    bool InArena;
+  };
+
+  /// Code or read-only data of one or more objects, finalized together.
+  struct Slab {
+    uint8_t *Address;
+    uint64_t Size;
+    uint64_t Used;
+    bool Code;
+    bool Finalized;
+    bool InArena;
+  };
+
+  uint8_t *allocateWritableData(uintptr_t Size, unsigned Alignment,
+                                bool InArena);
+  bool addDataRegion(uint64_t Size, bool InArena);
+  uint8_t *allocateArenaData(uint64_t Size);
+  uint8_t *allocateFromSlab(uintptr_t Size, unsigned Alignment, bool Code);
+  bool addSlab(uint64_t Size, bool Code);
+
+  void noteAllocation() {
+    if (!loadStarted) {
+      loadStart = std::chrono::steady_clock::now();
+      loadStarted = true;
+    }
+  }
+
+  std::shared_ptr<HostImportTable> imports;
+  std::vector<DataRegion> dataRegions;
+  bool slabs;
+  std::vector<Slab> ownedSlabs;
+  ContractArena *arena;
+
+  // Image of the data regions, and a read-only view of it.
+  int imageFD;
+  uint8_t *imageView;
+  uint64_t imageSize;
+
+  bool loadStarted;
+  std::chrono::steady_clock::time_point loadStart;
+
+  uint64_t codeBytes;
+  uint64_t dataBytes;
+  uint64_t symbolsResolved;
+  std::vector<std::string> loadErrors;
 };
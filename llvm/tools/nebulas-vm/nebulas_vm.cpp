@@ -15,12 +15,39 @@
 #include <string>
 #include <system_error>
 
-#include <sys/mman.h>
 
 using namespace llvm;
 
 int roll_dice();
 
+// Reports how a contract trapped in its arena, see call_status_t, and returns
+// the matching exit code.
+static nebulas_code_t ReportTrap(int trap) {
+  switch (trap) {
+  case call_memory_fault:
+    std::cout << "Contract accessed memory outside of its sandbox."
+              << std::endl;
+    return code_memory_fault;
+  case call_out_of_gas:
+    std::cout << "Contract ran out of gas." << std::endl;
+    return code_out_of_gas;
+  case call_stack_overflow:
+    std::cout << "Contract overflowed its stack." << std::endl;
+    return code_stack_overflow;
+  case call_load_failed:
+    std::cout << "Contract failed to link." << std::endl;
+    return code_invalid_assembly_file;
+  case call_invalid_call:
+    std::cout << "Contract called through an invalid function pointer."
+              << std::endl;
+    return code_invalid_call;
+  default:
+    std::cout << "Contract execution aborted with code " << trap << "."
+              << std::endl;
+    return code_contract_aborted;
+  }
+}
+
 cl::opt<std::string> AssemblyFilePath("assembly", cl::desc("The LLVM IR file"),
                                       cl::Required);
 cl::opt<std::string> AssemblyFileSignature(
@@ -29,14 +56,68 @@ cl::opt<std::string> AssemblyFileSignature(
 cl::opt<std::string> ExecutionToken("token",
                                     cl::desc("Token to authorize execution"),
                                     cl::Required);
-enum ExeLevel { g, O1, O2, O3 };
+cl::opt<std::string>
+    ObjectCacheDir("object-cache",
+                   cl::desc("Directory to cache compiled contract objects in"),
+                   cl::init(""));
+
+cl::opt<bool> LazyCompilation(
+    "lazy", cl::desc("Compile contract functions on their first call"),
+    cl::init(false));
+
+cl::opt<bool> Precompiled(
+    "precompiled",
+    cl::desc("The assembly is an object compiled ahead of time by nvm-aot"),
+    cl::init(false));
+
+cl::opt<bool> PrintStats("engine-stats",
+                         cl::desc("Print engine statistics to stderr"),
+                         cl::init(false));
+
+cl::opt<unsigned long long>
+    GasLimit("gas-limit", cl::desc("Maximum gas the contract may spend"),
+             cl::init(1000000000));
+
+// Values line up with exe_level_t.
+enum ExeLevel {
+  g = exe_level_g,
+  O1 = exe_level_O1,
+  O2 = exe_level_O2,
+  O3 = exe_level_O3
+};
 
 cl::opt<ExeLevel> OptimizationLevel(
     cl::desc("Choose execution level:"),
     cl::values(clEnumVal(g, "No optimizations, enable debugging"),
                clEnumVal(O1, "Enable trivial optimizations"),
                clEnumVal(O2, "Enable default optimizations"),
-               clEnumVal(O3, "Enable expensive optimizations")));
+               clEnumVal(O3, "Enable expensive optimizations")),
+    cl::init(O2));
+
+// Values line up with sandbox_mode_t.
+enum MemorySandbox {
+  NoSandbox = sandbox_none,
+  TruncateSandbox = sandbox_truncate,
+  GuardRegionSandbox = sandbox_guard_region,
+  MaskSandbox = sandbox_mask
+};
+
+cl::opt<MemorySandbox> MemorySandboxMode(
+    "memory-sandbox", cl::desc("Confine contract memory accesses:"),
+    cl::values(clEnumValN(NoSandbox, "none",
+                          "Do not confine them; required by -lazy"),
+               clEnumValN(TruncateSandbox, "truncate",
+                          "Truncate pointers to a 4 GiB arena (default)"),
+               clEnumValN(GuardRegionSandbox, "guard-region",
+                          "Also fold indexes, behind a 4 GiB guard"),
+               clEnumValN(MaskSandbox, "mask",
+                          "Mask pointers to an arena of -arena-size-bits")),
+    cl::init(TruncateSandbox));
+
+cl::opt<unsigned> ArenaSizeBits(
+    "arena-size-bits",
+    cl::desc("log2 of the arena size for -memory-sandbox=mask (16 to 32)"),
+    cl::init(28));
 
 int main(int argc, const char *argv[]) {
   // Print a stack trace if we signal out.
@@ -101,32 +182,120 @@ int main(int argc, const char *argv[]) {
     return status;
   }
 
-  //void *__sfi_memory_base = calloc(1024 * 1024, sizeof(int32_t));
-  size_t sandbox_size = ((size_t)1 << 32);
-  void *alloc = mmap(NULL, sandbox_size, PROT_READ | PROT_WRITE,
-                     MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
-  void *__sfi_memory_base = alloc;
-
   // TODO, we should use some better log lib, like glog here
   Initialize();
-  printf("initialized.\n");
 
-  Engine *e = CreateEngine();
-  printf("engine created.\n");
+  Engine *e = LazyCompilation ? CreateLazyEngine() : CreateEngine();
+  if (e == NULL) {
+    std::cout << "Failed to create engine." << std::endl;
+    return 1;
+  }
 
-  BindSymbol(e, "__sfi_stack", __sfi_memory_base);
+  if (SetExecutionLevel(e, OptimizationLevel) != 0) {
+    DeleteEngine(e);
+    return 1;
+  }
+  if (PrintStats) {
+    EnableEngineStats(e);
+  }
+
+  if (!ObjectCacheDir.empty()) {
+    EnableObjectCache(e, ObjectCacheDir.c_str());
+  }
+
+  ArenaPool *arenas;
+  if (MemorySandboxMode == GuardRegionSandbox) {
+    arenas = CreateArenaPoolWithLayout(1, uint64_t(1) << 32,
+                                       (uint64_t(1) << 32) + 0x10000);
+  } else if (MemorySandboxMode == MaskSandbox) {
+    if (ArenaSizeBits < 16 || ArenaSizeBits > 32) {
+      std::cout << "Arena size must be between 2^16 and 2^32 bytes."
+                << std::endl;
+      DeleteEngine(e);
+      return 1;
+    }
+    arenas = CreateArenaPoolWithLayout(1, uint64_t(1) << ArenaSizeBits,
+                                       0x10000);
+  } else {
+    arenas = CreateArenaPool(1);
+  }
+  SandboxArena *arena = AcquireArena(arenas);
+  if (arena == NULL) {
+    std::cout << "Failed to reserve sandbox memory." << std::endl;
+    DeleteEngine(e);
+    DeleteArenaPool(arenas);
+    return 1;
+  }
+  BindArena(e, arena);
+  if (SetSandboxMode(e, MemorySandboxMode) != 0) {
+    errs() << "\n";
+    return 1;
+  }
+
+  uint64_t gas_used = 0;
+  uint64_t gas_limit = GasLimit;
+  BindSymbol(e, "__nvm_gas_used", &gas_used);
+  BindSymbol(e, "__nvm_gas_limit", &gas_limit);
+  BindSymbol(e, "__nvm_gas_exhausted", (void *)nebulas_gas_exhausted);
+  BindSymbol(e, "__nvm_stack_overflow", (void *)nebulas_stack_overflow);
 
   // FIXME: @robin delete test function.
   BindSymbol(e, "roll_dice", (void *)roll_dice);
+  BindSymbol(e, "nvm_log", (void *)nebulas_log);
 
-  AddModuleFile(e, AssemblyFilePath.c_str());
-  printf("added Module file %s\n", AssemblyFilePath.c_str());
+  ErrorOr<std::unique_ptr<MemoryBuffer>> assembly =
+      MemoryBuffer::getFile(AssemblyFilePath);
+  if (!assembly) {
+    std::cout << "Failed to read assembly file: "
+              << assembly.getError().message() << std::endl;
+    return code_invalid_assembly_file;
+  }
+  int added;
+  if (Precompiled) {
+    added = AddObjectBuffer(e,
+                            (const uint8_t *)assembly.get()->getBufferStart(),
+                            assembly.get()->getBufferSize());
+  } else {
+    added = AddModuleBuffer(e,
+                            (const uint8_t *)assembly.get()->getBufferStart(),
+                            assembly.get()->getBufferSize());
+  }
+  if (added != 0) {
+    errs() << "\n";
+    std::cout << "Invalid assembly file, rejected by the validator."
+              << std::endl;
+    return code_invalid_assembly_file;
+  }
 
-  int ret = RunFunction(e, "nebulas_main", 0, NULL);
+  int ret = 0;
+  int trap = RunFunctionInArena(e, arena, "nebulas_main", 0, NULL, &ret);
+  if (trap != 0)
+    return ReportTrap(trap);
   printf("runFunction return %d\n", ret);
+  printf("gas used %llu\n", (unsigned long long)gas_used);
+
+  EngineStats stats;
+  if (GetEngineStats(e, &stats) == 0) {
+    const EnginePhaseTimes &t = stats.phases;
+    errs() << format("parse %.3f ms, passes %.3f ms, codegen %.3f ms, "
+                     "link %.3f ms, finalize %.3f ms\n",
+                     t.parse_ns / 1e6, t.passes_ns / 1e6, t.codegen_ns / 1e6,
+                     t.link_ns / 1e6, t.finalize_ns / 1e6)
+           << format("code %llu bytes, data %llu bytes, %llu symbols "
+                     "resolved, %llu cache hits, %llu misses, %llu sandbox "
+                     "pages touched\n",
+                     (unsigned long long)stats.code_bytes,
+                     (unsigned long long)stats.data_bytes,
+                     (unsigned long long)stats.symbols_resolved,
+                     (unsigned long long)stats.cache_hits,
+                     (unsigned long long)stats.cache_misses,
+                     (unsigned long long)stats.sandbox_pages_touched);
+  }
 
   DeleteEngine(e);
-  printf("engine deleted.\n");
+
+  ReleaseArena(arenas, arena);
+  DeleteArenaPool(arenas);
 
   return code_succ;
 }
@@ -0,0 +1,127 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "object_cache.h"
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+const char ContractObjectCache::KeyPrefix[] = "nvm-object:";
+
+ContractObjectCache::ContractObjectCache(const std::string &CacheDir)
+    : cacheDir(CacheDir) {
+  sys::fs::create_directories(Twine(cacheDir));
+}
+
+ContractObjectCache::~ContractObjectCache() {}
+
+bool ContractObjectCache::hasObject(const std::string &Key) const {
+  std::string CacheName;
+  if (!getCacheFilename(Key, CacheName))
+    return false;
+  return sys::fs::exists(Twine(CacheName)) &&
+         sys::fs::exists(Twine(CacheName) + ".manifest");
+}
+
+void ContractObjectCache::storeManifest(const std::string &Key,
+                                        StringRef Manifest) {
+  std::string CacheName;
+  if (!getCacheFilename(Key, CacheName))
+    return;
+  writeCacheFile(CacheName + ".manifest", Manifest);
+}
+
+std::unique_ptr<MemoryBuffer>
+ContractObjectCache::getManifest(const std::string &Key) const {
+  std::string CacheName;
+  if (!getCacheFilename(Key, CacheName))
+    return nullptr;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Manifest =
+      MemoryBuffer::getFile(CacheName + ".manifest");
+  if (!Manifest)
+    return nullptr;
+  return std::move(Manifest.get());
+}
+
+void ContractObjectCache::notifyObjectCompiled(const Module *M,
+                                               MemoryBufferRef Obj) {
+  std::string CacheName;
+  if (!getCacheFilename(M->getModuleIdentifier(), CacheName))
+    return;
+
+  // A cached object is loaded through an empty stub module, which carries no
+  // llvm.global_ctors, so modules with static constructors are never cached.
+  if (M->getNamedGlobal("llvm.global_ctors") ||
+      M->getNamedGlobal("llvm.global_dtors"))
+    return;
+
+  writeCacheFile(CacheName, Obj.getBuffer());
+}
+
+void ContractObjectCache::writeCacheFile(const std::string &CacheName,
+                                         StringRef Contents) {
+  int FD;
+  SmallString<128> TempName;
+  if (sys::fs::createUniqueFile(Twine(CacheName) + ".tmp-%%%%%%", FD,
+                                TempName))
+    return;
+
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS.write(Contents.data(), Contents.size());
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(Twine(TempName));
+      return;
+    }
+  }
+
+  if (sys::fs::rename(Twine(TempName), Twine(CacheName)))
+    sys::fs::remove(Twine(TempName));
+}
+
+std::unique_ptr<MemoryBuffer> ContractObjectCache::getObject(const Module *M) {
+  std::string CacheName;
+  if (!getCacheFilename(M->getModuleIdentifier(), CacheName))
+    return nullptr;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> ObjBuffer =
+      MemoryBuffer::getFile(CacheName, -1, false);
+  if (!ObjBuffer)
+    return nullptr;
+
+  // RuntimeDyld may write into the buffer while applying relocations, so hand
+  // out a private copy rather than the (possibly mmapped) file itself.
+  return MemoryBuffer::getMemBufferCopy(ObjBuffer.get()->getBuffer());
+}
+
+bool ContractObjectCache::getCacheFilename(const std::string &Key,
+                                           std::string &CacheName) const {
+  StringRef Prefix(KeyPrefix);
+  if (StringRef(Key).substr(0, Prefix.size()) != Prefix)
+    return false;
+
+  SmallString<128> Path(cacheDir);
+  sys::path::append(Path, StringRef(Key).substr(Prefix.size()) + ".o");
+  CacheName = Path.str();
+  return true;
+}
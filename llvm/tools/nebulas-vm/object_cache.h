@@ -0,0 +1,62 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <string>
+
+using namespace llvm;
+
+/// Content-addressed, on-disk cache of compiled contract objects.
+///
+/// Only modules whose identifier starts with the cache key prefix (see
+/// ContractObjectCache::KeyPrefix) take part in caching; the rest of the key
+/// is used as the file name inside the cache directory. Objects are written
+/// to a temporary file first and renamed into place, so that concurrent VM
+/// processes sharing the directory never observe a partial object.
+class ContractObjectCache : public ObjectCache {
+  ContractObjectCache(const ContractObjectCache &) = delete;
+  void operator=(const ContractObjectCache &) = delete;
+
+public:
+  static const char KeyPrefix[];
+
+  explicit ContractObjectCache(const std::string &CacheDir);
+  virtual ~ContractObjectCache();
+
+  /// Returns true if a compiled object and its manifest are available for
+  /// the cache key.
+  bool hasObject(const std::string &Key) const;
+
+  /// Store the manifest for the object of Key. It has to be stored before
+  /// the object is compiled, so that no object is ever cached without it.
+  void storeManifest(const std::string &Key, StringRef Manifest);
+  std::unique_ptr<MemoryBuffer> getManifest(const std::string &Key) const;
+
+  virtual void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj);
+  virtual std::unique_ptr<MemoryBuffer> getObject(const Module *M);
+
+private:
+  bool getCacheFilename(const std::string &Key, std::string &CacheName) const;
+  void writeCacheFile(const std::string &CacheName, StringRef Contents);
+
+  std::string cacheDir;
+};
@@ -0,0 +1,372 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "parallel_executor.h"
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+using namespace llvm;
+
+// Idle engines each worker keeps, across all contracts.
+static const size_t kWorkerEngines = 16;
+
+LLVM_THREAD_LOCAL ParallelExecutor::CallContext *ParallelExecutor::runningCall =
+    nullptr;
+
+static void WorkerGasExhausted() { AbortArenaExecution(call_out_of_gas); }
+
+static void WorkerStackOverflow() { AbortArenaExecution(call_stack_overflow); }
+
+static unsigned GetWorkerCount(unsigned Workers) {
+  if (Workers != 0)
+    return Workers;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+ParallelExecutor::ParallelExecutor(unsigned Workers)
+    : threads(GetWorkerCount(Workers)), version(0), blockDone(false) {
+  for (unsigned i = 0, e = GetWorkerCount(Workers); i != e; ++i) {
+    std::unique_ptr<Worker> W(new Worker());
+    W->Arena = ContractArena::create();
+    if (W->Arena == nullptr)
+      break;
+
+    // The engines of a worker always run in its arena, confined to it.
+    W->Engines.reset(new ContractEnginePool(kWorkerEngines));
+    ContractEnginePool &Engines = *W->Engines;
+    Engines.useArena(W->Arena, sandbox_truncate);
+    Engines.bindSymbol("__nvm_gas_used", &W->GasUsed);
+    Engines.bindSymbol("__nvm_gas_limit", &W->GasLimit);
+    Engines.bindSymbol("__nvm_gas_exhausted", (void *)WorkerGasExhausted);
+    Engines.bindSymbol("__nvm_stack_overflow", (void *)WorkerStackOverflow);
+    Engines.bindSymbol("nvm_storage_get", (void *)storageGet);
+    Engines.bindSymbol("nvm_storage_put", (void *)storagePut);
+    workers.push_back(std::move(W));
+  }
+}
+
+ParallelExecutor::~ParallelExecutor() {
+  threads.wait();
+  for (auto &W : workers) {
+    // Engines go first, they are bound to the arena.
+    W->Engines.reset();
+    delete W->Arena;
+  }
+}
+
+void ParallelExecutor::bindSymbol(const std::string &Name, void *Address) {
+  for (auto &W : workers)
+    W->Engines->bindSymbol(Name, Address);
+}
+
+void ParallelExecutor::setObjectCacheDir(const std::string &Dir) {
+  for (auto &W : workers)
+    W->Engines->setObjectCacheDir(Dir);
+}
+
+void ParallelExecutor::setState(StringRef Key, StringRef Value) {
+  StateEntry &Entry = state[Key];
+  Entry.Value = Value;
+  Entry.Version = ++version;
+}
+
+bool ParallelExecutor::getState(StringRef Key, StringRef &Value) const {
+  auto It = state.find(Key);
+  if (It == state.end())
+    return false;
+  Value = It->second.Value;
+  return true;
+}
+
+size_t ParallelExecutor::addCall(const std::string &ContractHash,
+                                 const std::string &IRFile,
+                                 const std::string &FuncName, StringRef Data,
+                                 uint64_t GasLimit) {
+  if (blockDone) {
+    calls.clear();
+    blockDone = false;
+  }
+  std::unique_ptr<Call> C(new Call());
+  C->ContractHash = ContractHash;
+  C->IRFile = IRFile;
+  C->FuncName = FuncName;
+  C->Data = Data;
+  C->GasLimit = GasLimit;
+  calls.push_back(std::move(C));
+  return calls.size() - 1;
+}
+
+void ParallelExecutor::declareKey(size_t Index, StringRef Key, bool IsWrite) {
+  Call &C = *calls[Index];
+  C.Declared = true;
+  C.HintKeys.insert(Key);
+  if (IsWrite)
+    C.HintWrites.insert(Key);
+}
+
+int64_t ParallelExecutor::storageGet(const uint8_t *Key, uint64_t KeyLen,
+                                     uint8_t *Value, uint64_t Capacity) {
+  CheckArenaAccess(Key, KeyLen);
+  CheckArenaAccess(Value, Capacity);
+  Call &C = *runningCall->Current;
+  StringRef K((const char *)Key, KeyLen);
+
+  // A call reads its own writes; those do not depend on other calls.
+  StringRef V;
+  auto Written = C.Writes.find(K);
+  if (Written != C.Writes.end()) {
+    V = Written->second;
+  } else {
+    C.Reads.insert(K);
+    if (!runningCall->Executor->getState(K, V))
+      return -1;
+  }
+  memcpy(Value, V.data(), std::min<uint64_t>(Capacity, V.size()));
+  return V.size();
+}
+
+void ParallelExecutor::storagePut(const uint8_t *Key, uint64_t KeyLen,
+                                  const uint8_t *Value, uint64_t ValueLen) {
+  CheckArenaAccess(Key, KeyLen);
+  CheckArenaAccess(Value, ValueLen);
+  Call &C = *runningCall->Current;
+  C.Writes[StringRef((const char *)Key, KeyLen)] =
+      std::string((const char *)Value, ValueLen);
+}
+
+bool ParallelExecutor::isValid(const Call &C) const {
+  for (auto &Key : C.Reads) {
+    auto It = state.find(Key.getKey());
+    if (It != state.end() && It->second.Version > C.ReadVersion)
+      return false;
+  }
+  return true;
+}
+
+void ParallelExecutor::execute(Worker &W, Call &C) {
+  C.Reads.clear();
+  C.Writes.clear();
+  C.ReadVersion = version;
+  C.Result = 0;
+  C.GasUsed = 0;
+  C.Executed = true;
+
+  if (C.Data.size() > W.Arena->windowSize()) {
+    C.Status = call_memory_fault;
+    return;
+  }
+
+  Engine *e = W.Engines->checkout(C.ContractHash, C.IRFile.c_str());
+  if (e == NULL) {
+    C.Status = call_load_failed;
+    return;
+  }
+
+  // The contract only reaches memory of the arena, so its input goes to the
+  // input window, which reset() zeroes again.
+  memcpy(W.Arena->inputWindow(), C.Data.data(), C.Data.size());
+
+  W.GasUsed = 0;
+  W.GasLimit = C.GasLimit;
+  CallContext Context = {this, &C};
+  runningCall = &Context;
+  C.Status = RunFunctionInArena(e, W.Arena->handle(), C.FuncName.c_str(),
+                                C.Data.size(), W.Arena->inputWindow(),
+                                &C.Result);
+  runningCall = nullptr;
+  C.GasUsed = W.GasUsed;
+
+  W.Arena->reset();
+  W.Engines->checkin(e);
+
+  if (!C.Declared) {
+    C.HintKeys.clear();
+    C.HintWrites.clear();
+    for (auto &Key : C.Reads)
+      C.HintKeys.insert(Key.getKey());
+    for (auto &Write : C.Writes) {
+      C.HintKeys.insert(Write.getKey());
+      C.HintWrites.insert(Write.getKey());
+    }
+  }
+}
+
+void ParallelExecutor::commit(Call &C) {
+  ++version;
+  // A call that trapped still took part in ordering, but has no effect.
+  if (C.Status != call_ok)
+    return;
+  for (auto &Write : C.Writes) {
+    StateEntry &Entry = state[Write.getKey()];
+    Entry.Value = std::move(Write.getValue());
+    Entry.Version = version;
+  }
+  C.Writes.clear();
+}
+
+bool ParallelExecutor::run() {
+  if (workers.empty()) {
+    errs() << "no worker to execute the block on.";
+    return false;
+  }
+
+  size_t Committed = 0;
+  while (Committed < calls.size()) {
+    // Pick what to execute this round. Calls that may depend on a write of
+    // an earlier pending call would most likely be invalidated, so they wait
+    // for that call to commit; the first pending call never waits.
+    std::vector<Call *> Batch;
+    StringSet<> PendingWrites;
+    for (size_t i = Committed; i < calls.size(); ++i) {
+      Call &C = *calls[i];
+      if (C.Executed && !isValid(C))
+        C.Executed = false;
+
+      bool Deferred = false;
+      if (i != Committed) {
+        for (auto &Key : C.HintKeys) {
+          if (PendingWrites.count(Key.getKey())) {
+            Deferred = true;
+            break;
+          }
+        }
+      }
+      for (auto &Key : C.HintWrites)
+        PendingWrites.insert(Key.getKey());
+
+      if (!C.Executed && !Deferred)
+        Batch.push_back(&C);
+    }
+
+    // The state is only read while the round executes.
+    std::atomic<size_t> Next(0);
+    size_t Active = std::min(workers.size(), Batch.size());
+    for (size_t w = 0; w < Active; ++w) {
+      Worker *W = workers[w].get();
+      threads.async([this, W, &Batch, &Next]() {
+        for (size_t i = Next++; i < Batch.size(); i = Next++)
+          this->execute(*W, *Batch[i]);
+      });
+    }
+    threads.wait();
+
+    while (Committed < calls.size()) {
+      Call &C = *calls[Committed];
+      if (!C.Executed || !isValid(C))
+        break;
+      commit(C);
+      ++Committed;
+    }
+  }
+
+  blockDone = true;
+  return true;
+}
+
+void ParallelExecutor::getResult(size_t Index, int &Status, int &Result,
+                                 uint64_t &GasUsed) const {
+  const Call &C = *calls[Index];
+  Status = C.Status;
+  Result = C.Result;
+  GasUsed = C.GasUsed;
+}
+
+BlockExecutor *CreateBlockExecutor(unsigned workers) {
+  BlockExecutor *x =
+      static_cast<BlockExecutor *>(calloc(1, sizeof(BlockExecutor)));
+  x->nvm_executor = new ParallelExecutor(workers);
+  return x;
+}
+
+void DeleteBlockExecutor(BlockExecutor *x) {
+  delete static_cast<ParallelExecutor *>(x->nvm_executor);
+  free(x);
+}
+
+void BlockExecutorBindSymbol(BlockExecutor *x, const char *funcName,
+                             void *address) {
+  ParallelExecutor *executor =
+      static_cast<ParallelExecutor *>(x->nvm_executor);
+  executor->bindSymbol(std::string(funcName), address);
+}
+
+void BlockExecutorEnableObjectCache(BlockExecutor *x, const char *cacheDir) {
+  ParallelExecutor *executor =
+      static_cast<ParallelExecutor *>(x->nvm_executor);
+  executor->setObjectCacheDir(std::string(cacheDir));
+}
+
+void BlockExecutorSetState(BlockExecutor *x, const uint8_t *key,
+                           size_t keyLen, const uint8_t *value,
+                           size_t valueLen) {
+  ParallelExecutor *executor =
+      static_cast<ParallelExecutor *>(x->nvm_executor);
+  executor->setState(StringRef((const char *)key, keyLen),
+                     StringRef((const char *)value, valueLen));
+}
+
+int BlockExecutorGetState(BlockExecutor *x, const uint8_t *key, size_t keyLen,
+                          const uint8_t **value, size_t *valueLen) {
+  ParallelExecutor *executor =
+      static_cast<ParallelExecutor *>(x->nvm_executor);
+  StringRef v;
+  if (!executor->getState(StringRef((const char *)key, keyLen), v))
+    return 1;
+  *value = (const uint8_t *)v.data();
+  *valueLen = v.size();
+  return 0;
+}
+
+size_t BlockExecutorAddCall(BlockExecutor *x, const char *contractHash,
+                            const char *irFile, const char *funcName,
+                            size_t len, const uint8_t *data,
+                            uint64_t gasLimit) {
+  ParallelExecutor *executor =
+      static_cast<ParallelExecutor *>(x->nvm_executor);
+  return executor->addCall(std::string(contractHash), std::string(irFile),
+                           std::string(funcName),
+                           StringRef((const char *)data, len), gasLimit);
+}
+
+void BlockExecutorDeclareKey(BlockExecutor *x, size_t call,
+                             const uint8_t *key, size_t keyLen, int isWrite) {
+  ParallelExecutor *executor =
+      static_cast<ParallelExecutor *>(x->nvm_executor);
+  executor->declareKey(call, StringRef((const char *)key, keyLen),
+                       isWrite != 0);
+}
+
+int BlockExecutorRun(BlockExecutor *x) {
+  ParallelExecutor *executor =
+      static_cast<ParallelExecutor *>(x->nvm_executor);
+  return executor->run() ? 0 : 1;
+}
+
+void BlockExecutorGetResult(BlockExecutor *x, size_t call, int *status,
+                            int *result, uint64_t *gasUsed) {
+  ParallelExecutor *executor =
+      static_cast<ParallelExecutor *>(x->nvm_executor);
+  executor->getResult(call, *status, *result, *gasUsed);
+}
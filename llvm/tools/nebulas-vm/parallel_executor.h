@@ -0,0 +1,143 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include "engine.h"
+#include "engine_pool.h"
+#include "sandbox_arena.h"
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/Compiler.h>
+#include <llvm/Support/ThreadPool.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Executes blocks of contract calls on several cores.
+///
+/// Every worker owns a sandbox arena and an engine pool bound to it, so
+/// workers never share an LLVMContext, contract globals or sandbox memory.
+/// Contracts are sandboxed to the arena and get their input in its input
+/// window. They see the state through two host imports:
+///
+///   int64_t nvm_storage_get(const uint8_t *key, uint64_t keyLen,
+///                           uint8_t *value, uint64_t capacity);
+///   void nvm_storage_put(const uint8_t *key, uint64_t keyLen,
+///                        const uint8_t *value, uint64_t valueLen);
+///
+/// nvm_storage_get copies up to capacity bytes and returns the full length
+/// of the value, or -1 if the key does not exist.
+///
+/// A block runs in rounds. Each round executes the pending calls in parallel
+/// against the state committed so far, buffering their writes and recording
+/// the keys they read. Calls are then committed in block order for as long as
+/// nothing they read has changed since they executed; the first call that
+/// fails this check, and everything after it, is left for the next round.
+/// Results that are still valid are kept, so only invalidated calls run
+/// again, and the first pending call always commits. The committed state is
+/// therefore the one serial execution in block order produces.
+class ParallelExecutor {
+  ParallelExecutor(const ParallelExecutor &) = delete;
+  void operator=(const ParallelExecutor &) = delete;
+
+public:
+  explicit ParallelExecutor(unsigned Workers);
+  ~ParallelExecutor();
+
+  /// Symbols bound into every engine created afterwards.
+  void bindSymbol(const std::string &Name, void *Address);
+  void setObjectCacheDir(const std::string &Dir);
+
+  void setState(llvm::StringRef Key, llvm::StringRef Value);
+  bool getState(llvm::StringRef Key, llvm::StringRef &Value) const;
+
+  size_t addCall(const std::string &ContractHash, const std::string &IRFile,
+                 const std::string &FuncName, llvm::StringRef Data,
+                 uint64_t GasLimit);
+  void declareKey(size_t Call, llvm::StringRef Key, bool IsWrite);
+
+  /// Execute and commit the block. Returns false if there are no workers.
+  bool run();
+
+  void getResult(size_t Call, int &Status, int &Result,
+                 uint64_t &GasUsed) const;
+
+private:
+  struct StateEntry {
+    std::string Value;
+    // Commit sequence number of the last write.
+    uint64_t Version;
+  };
+
+  struct Call {
+    std::string ContractHash;
+    std::string IRFile;
+    std::string FuncName;
+    std::string Data;
+    uint64_t GasLimit;
+
+    // Keys used for scheduling: declared up front, or else the ones the
+    // previous execution touched.
+    bool Declared = false;
+    llvm::StringSet<> HintKeys;
+    llvm::StringSet<> HintWrites;
+
+    // Outcome of the last execution.
+    bool Executed = false;
+    uint64_t ReadVersion = 0;
+    llvm::StringSet<> Reads;
+    llvm::StringMap<std::string> Writes;
+    int Status = call_ok;
+    int Result = 0;
+    uint64_t GasUsed = 0;
+  };
+
+  struct Worker {
+    ContractArena *Arena = nullptr;
+    std::unique_ptr<ContractEnginePool> Engines;
+    uint64_t GasUsed = 0;
+    uint64_t GasLimit = 0;
+  };
+
+  // What nvm_storage_get and nvm_storage_put of the running call act on.
+  struct CallContext {
+    const ParallelExecutor *Executor;
+    Call *Current;
+  };
+  static LLVM_THREAD_LOCAL CallContext *runningCall;
+
+  static int64_t storageGet(const uint8_t *Key, uint64_t KeyLen,
+                            uint8_t *Value, uint64_t Capacity);
+  static void storagePut(const uint8_t *Key, uint64_t KeyLen,
+                         const uint8_t *Value, uint64_t ValueLen);
+
+  bool isValid(const Call &C) const;
+  void execute(Worker &W, Call &C);
+  void commit(Call &C);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  llvm::ThreadPool threads;
+
+  llvm::StringMap<StateEntry> state;
+  uint64_t version;
+
+  std::vector<std::unique_ptr<Call>> calls;
+  bool blockDone;
+};
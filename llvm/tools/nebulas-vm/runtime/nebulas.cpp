@@ -17,13 +17,37 @@
 // <http://www.gnu.org/licenses/>.
 
 #include "runtime/nebulas.h"
+#include "engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
+// The contract itself is validated when it is added to the engine. These
+// only check what can be checked before that.
 nebulas_code_t check_assembly(const char *filePath, const char *signature) {
-  // TODO implementation
+  // TODO verify the signature once the chain defines its scheme.
+  struct stat st;
+  if (stat(filePath, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return code_invalid_assembly_file;
+  if (signature == NULL || signature[0] == '\0')
+    return code_invalid_assembly_file;
   return code_succ;
 }
 
 nebulas_code_t check_priviliege(const char *signature) {
-  // TODO implementation
+  // TODO verify the token once the chain defines its scheme.
+  if (signature == NULL || signature[0] == '\0')
+    return code_invalid_priviliege;
   return code_succ;
 }
+
+// The contract runs in an arena; unwinding out of it lets the caller report
+// the trap and clean up instead of the process exiting from contract code.
+void nebulas_gas_exhausted() { AbortArenaExecution(call_out_of_gas); }
+
+void nebulas_stack_overflow() { AbortArenaExecution(call_stack_overflow); }
+
+void nebulas_log(const uint8_t *msg, uint64_t len) {
+  CheckArenaAccess(msg, len);
+  fwrite(msg, 1, len, stdout);
+}
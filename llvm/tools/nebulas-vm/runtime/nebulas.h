@@ -22,11 +22,18 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 typedef enum {
   code_succ = 0,
   code_invalid_assembly_file,
   code_invalid_priviliege,
-  code_invalid_with_global_var
+  code_invalid_with_global_var,
+  code_out_of_gas,
+  code_memory_fault,
+  code_stack_overflow,
+  code_invalid_call,
+  code_contract_aborted
 } nebulas_code_t;
 
 // TODO Define all needed apis that communicate with the block chain
@@ -35,6 +42,21 @@ nebulas_code_t check_assembly(const char *filePath, const char *signature);
 
 nebulas_code_t check_priviliege(const char *signature);
 
+// Bound to __nvm_gas_exhausted, called by metered contract code when it runs
+// out of gas. Aborts the RunFunctionInArena running the contract with
+// call_out_of_gas; does not return.
+void nebulas_gas_exhausted();
+
+// Bound to __nvm_stack_overflow, called by contract code whose stack would
+// grow past __sfi_stack_limit. Aborts the RunFunctionInArena running the
+// contract with call_stack_overflow; does not return.
+void nebulas_stack_overflow();
+
+// Bound to nvm_log. Writes the len bytes at msg to stdout as they are; no
+// format string is ever interpreted on behalf of the contract. Aborts a
+// sandboxed contract with call_memory_fault if they leave its arena.
+void nebulas_log(const uint8_t *msg, uint64_t len);
+
 #ifdef _cplusplus
 }
 #endif
@@ -0,0 +1,672 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "sandbox_arena.h"
+#include "compile_service.h"
+
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <llvm/Support/Compiler.h>
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The top of the stack is written by every execution. Zeroing it in place
+// keeps its pages resident across resets instead of faulting them back in.
+static const uint64_t kWarmStackSize = 0x40000;
+
+// The stack takes the top of the arena, up to a quarter of it. ExpandAllocas
+// lets small leaf frames go this far below __sfi_stack_limit unchecked.
+static const uint64_t kMaxStackSize = 0x100000;
+static const uint64_t kStackRedZone = 4096;
+
+// Each I/O window takes an eighth of the arena, up to this much.
+static const uint64_t kMaxWindowSize = 0x4000000;
+
+// The data area takes a quarter of the arena, up to this much.
+static const uint64_t kMaxDataSize = 0x4000000;
+
+// Nothing is ever added to a confined pointer, so the guard before the arena
+// only has to catch stray accesses just below it.
+static const uint64_t kLeadingGuardSize = 0x10000;
+
+// The fault handler runs on a stack of its own, since contract code that
+// overflows the native stack faults with none of it left.
+static const size_t kSignalStackSize = 0x10000;
+
+// Faults this close to the low end of the native stack are taken for it
+// overflowing; a frame may skip the guard page by up to this much.
+static const uintptr_t kNativeStackSlack = 0x10000;
+
+const uint64_t ContractArena::MinSize;
+const uint64_t ContractArena::DefaultSize;
+const uint64_t ContractArena::DefaultGuardSize;
+const uint64_t ContractArena::GuardRegionGuardSize;
+
+using namespace llvm;
+
+ContractArena *ContractArena::create(uint64_t Size, uint64_t GuardSize) {
+  if (!isPowerOf2_64(Size) || Size < MinSize) {
+    errs() << "sandbox arena size must be a power of two of at least 64 KiB.";
+    return nullptr;
+  }
+
+  // Reserve room to align the arena to its size, then give the slack back.
+  uint64_t ReservationSize = kLeadingGuardSize + Size + GuardSize + Size;
+  void *Reservation = mmap(NULL, ReservationSize, PROT_NONE,
+                           MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (Reservation == MAP_FAILED) {
+    errs() << "reserve sandbox arena failed.";
+    return nullptr;
+  }
+
+  uint8_t *Start = static_cast<uint8_t *>(Reservation);
+  uint8_t *Base = reinterpret_cast<uint8_t *>(
+      alignTo(reinterpret_cast<uintptr_t>(Start) + kLeadingGuardSize, Size));
+  uint8_t *Head = Base - kLeadingGuardSize;
+  uint8_t *Tail = Base + Size + GuardSize;
+  if (Head != Start)
+    munmap(Start, Head - Start);
+  if (Tail != Start + ReservationSize)
+    munmap(Tail, Start + ReservationSize - Tail);
+
+  // Only the arena itself is accessible, but for its first page; the guards
+  // stay PROT_NONE.
+  uint64_t PageSize = sys::Process::getPageSize();
+  if (mprotect(Base + PageSize, Size - PageSize, PROT_READ | PROT_WRITE) !=
+      0) {
+    errs() << "map sandbox arena failed.";
+    munmap(Head, Tail - Head);
+    return nullptr;
+  }
+
+  ContractArena *Arena = new ContractArena();
+  Arena->Reservation = Head;
+  Arena->ReservationSize = Tail - Head;
+  Arena->Base = Base;
+  Arena->Size = Size;
+  Arena->GuardSize = GuardSize;
+  Arena->MemoryBase = reinterpret_cast<uint64_t>(Base);
+  // The stack grows down from the top of the arena.
+  Arena->StackPointer = reinterpret_cast<uint64_t>(Base + Size);
+  uint64_t StackSize = std::min(kMaxStackSize, Size / 4);
+  Arena->StackLimit =
+      reinterpret_cast<uint64_t>(Base + Size - StackSize + kStackRedZone);
+  Arena->WindowSize = std::min(kMaxWindowSize, Size / 8);
+  Arena->InputOffset = Size - StackSize - 2 * Arena->WindowSize;
+  Arena->CellsOffset = PageSize;
+  Arena->DataOffset = 2 * PageSize;
+  Arena->DataLimit =
+      Arena->DataOffset + alignTo(std::min(kMaxDataSize, Size / 4), PageSize);
+  Arena->DataUsed = 0;
+  Arena->InputSize = 0;
+  Arena->OutputSize = Arena->WindowSize;
+  Arena->InputMapped = false;
+  Arena->OutputMapped = false;
+  Arena->ImageFD = -1;
+  Arena->Handle.nvm_arena = Arena;
+  Arena->resetCells();
+  return Arena;
+}
+
+ContractArena::~ContractArena() {
+  munmap(Reservation, ReservationSize);
+  if (ImageFD >= 0)
+    close(ImageFD);
+}
+
+uint64_t ContractArena::residentPages() const {
+  static const uint64_t kChunkPages = 4096;
+  uint64_t PageSize = sys::Process::getPageSize();
+  std::vector<unsigned char> Vec(kChunkPages);
+
+  uint64_t Resident = 0;
+  for (uint64_t Offset = 0; Offset < Size; Offset += kChunkPages * PageSize) {
+    uint64_t Length = std::min(Size - Offset, kChunkPages * PageSize);
+    if (mincore(Base + Offset, Length, Vec.data()) != 0)
+      return 0;
+    for (uint64_t i = 0, e = Length / PageSize; i != e; ++i)
+      Resident += Vec[i] & 1;
+  }
+  return Resident;
+}
+
+bool ContractArena::isTrapAddress(uintptr_t Address) const {
+  uintptr_t Start = reinterpret_cast<uintptr_t>(Reservation);
+  uintptr_t Low = reinterpret_cast<uintptr_t>(Base);
+  uintptr_t High = Low + Size;
+  if (Address < Start || Address >= Start + ReservationSize)
+    return false;
+  // The cells and writable data never fault; the first page and read-only
+  // data always do.
+  return Address < Low + CellsOffset ||
+         (Address >= Low + DataOffset && Address < Low + DataLimit) ||
+         Address >= High;
+}
+
+void ContractArena::resetCells() {
+  Cells *C = cells();
+  C->OutputAddress = reinterpret_cast<uint64_t>(outputWindow());
+  C->OutputCapacity = OutputSize;
+  C->OutputLength = 0;
+}
+
+// Map Size bytes of FD over Window, which lies inside the arena.
+static bool MapWindow(uint8_t *Window, uint64_t Size, int FD, int Flags) {
+  void *Mapped = mmap(Window, Size, PROT_READ | PROT_WRITE, MAP_FIXED | Flags,
+                      FD, 0);
+  return Mapped != MAP_FAILED;
+}
+
+// Put fresh zero pages back over a window a buffer was mapped to.
+static void UnmapWindow(uint8_t *Window, uint64_t Size) {
+  if (!MapWindow(Window, Size, -1, MAP_PRIVATE | MAP_ANONYMOUS))
+    report_fatal_error("restore sandbox I/O window failed.");
+}
+
+bool ContractArena::mapInput(ContractIOBuffer &Buffer) {
+  if (Buffer.capacity() > WindowSize) {
+    errs() << "input buffer does not fit the sandbox I/O window.";
+    return false;
+  }
+  // A smaller buffer would leave the tail of the previous one mapped.
+  if (InputMapped) {
+    UnmapWindow(inputWindow(), InputSize);
+    InputMapped = false;
+    InputSize = 0;
+  }
+  // Private, so writes of the contract never reach the caller's buffer.
+  if (!MapWindow(inputWindow(), Buffer.capacity(), Buffer.fd(),
+                 MAP_PRIVATE)) {
+    errs() << "map input buffer failed.";
+    return false;
+  }
+  InputMapped = true;
+  InputSize = Buffer.capacity();
+  return true;
+}
+
+bool ContractArena::mapOutput(ContractIOBuffer &Buffer) {
+  if (Buffer.capacity() > WindowSize) {
+    errs() << "output buffer does not fit the sandbox I/O window.";
+    return false;
+  }
+  if (OutputMapped) {
+    UnmapWindow(outputWindow(), OutputSize);
+    OutputMapped = false;
+    OutputSize = WindowSize;
+    resetCells();
+  }
+  if (!MapWindow(outputWindow(), Buffer.capacity(), Buffer.fd(),
+                 MAP_SHARED)) {
+    errs() << "map output buffer failed.";
+    return false;
+  }
+  OutputMapped = true;
+  OutputSize = Buffer.capacity();
+  resetCells();
+  return true;
+}
+
+void ContractArena::reset() {
+  // The next execution must see neither the previous input nor write into
+  // the previous output buffer.
+  if (InputMapped) {
+    UnmapWindow(inputWindow(), InputSize);
+    InputMapped = false;
+  }
+  if (OutputMapped) {
+    UnmapWindow(outputWindow(), OutputSize);
+    OutputMapped = false;
+  }
+  InputSize = 0;
+  OutputSize = WindowSize;
+  resetCells();
+
+  // Compact arenas are meant to be kept resident by the thousand, so they
+  // keep proportionally less of their stack warm.
+  uint64_t Warm = std::min(kWarmStackSize, Size / 16);
+  if (ImageFD < 0)
+    memset(Base + Size - Warm, 0, Warm);
+  else if (pread(ImageFD, Base + Size - Warm, Warm, Size - Warm) !=
+           (ssize_t)Warm)
+    report_fatal_error("restore sandbox image failed.");
+
+  // Private anonymous pages read back as zero after MADV_DONTNEED, private
+  // file pages as the image. The kernel only walks page tables that exist,
+  // so this costs in proportion to what the execution actually touched, not
+  // to the arena size. The data area below is left alone.
+  madvise(Base + DataLimit, Size - Warm - DataLimit, MADV_DONTNEED);
+
+  StackPointer = reinterpret_cast<uint64_t>(Base + Size);
+}
+
+bool ContractArena::captureImage() {
+  dropImage();
+  int FD = CreateSharedMemoryFile(Size);
+  if (FD < 0) {
+    errs() << "create sandbox image failed.";
+    return false;
+  }
+
+  // Only pages in use are copied; the rest of the file stays a hole and
+  // reads back as zero. The data area and the I/O windows are left out.
+  static const uint64_t kChunkPages = 4096;
+  uint64_t PageSize = sys::Process::getPageSize();
+  uint64_t WindowsStart = InputOffset;
+  uint64_t WindowsEnd = InputOffset + 2 * WindowSize;
+  std::vector<unsigned char> Vec(kChunkPages);
+  for (uint64_t Offset = DataLimit; Offset < Size;
+       Offset += kChunkPages * PageSize) {
+    uint64_t Length = std::min(Size - Offset, kChunkPages * PageSize);
+    if (mincore(Base + Offset, Length, Vec.data()) != 0) {
+      close(FD);
+      return false;
+    }
+    for (uint64_t i = 0, e = Length / PageSize; i != e; ++i) {
+      uint64_t Page = Offset + i * PageSize;
+      if (!(Vec[i] & 1) || (Page >= WindowsStart && Page < WindowsEnd))
+        continue;
+      if (pwrite(FD, Base + Page, PageSize, Page) != (ssize_t)PageSize) {
+        close(FD);
+        return false;
+      }
+    }
+  }
+
+  // Map the image around the windows, which keep their buffers.
+  if (mmap(Base + DataLimit, WindowsStart - DataLimit, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, FD, DataLimit) == MAP_FAILED ||
+      mmap(Base + WindowsEnd, Size - WindowsEnd, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, FD, WindowsEnd) == MAP_FAILED)
+    report_fatal_error("map sandbox image failed.");
+  ImageFD = FD;
+  return true;
+}
+
+void ContractArena::dropImage() {
+  if (ImageFD < 0)
+    return;
+  UnmapWindow(Base + DataLimit, Size - DataLimit);
+  InputMapped = false;
+  OutputMapped = false;
+  close(ImageFD);
+  ImageFD = -1;
+}
+
+uint8_t *ContractArena::allocateData(uint64_t Size) {
+  for (auto It = FreeData.begin(), E = FreeData.end(); It != E; ++It) {
+    if (It->second < Size)
+      continue;
+    uint64_t Offset = It->first;
+    if (It->second > Size)
+      FreeData[Offset + Size] = It->second - Size;
+    FreeData.erase(It);
+    return Base + DataOffset + Offset;
+  }
+  if (Size > dataAvailable())
+    return nullptr;
+  uint8_t *Address = Base + DataOffset + DataUsed;
+  DataUsed += Size;
+  return Address;
+}
+
+void ContractArena::releaseData(uint8_t *Address, uint64_t Size) {
+  // Also drops the protection of read-only data.
+  UnmapWindow(Address, Size);
+
+  // Merge with the free ranges around it.
+  uint64_t Offset = Address - (Base + DataOffset);
+  auto Next = FreeData.lower_bound(Offset);
+  if (Next != FreeData.end() && Next->first == Offset + Size) {
+    Size += Next->second;
+    Next = FreeData.erase(Next);
+  }
+  if (Next != FreeData.begin()) {
+    auto Prev = std::prev(Next);
+    if (Prev->first + Prev->second == Offset) {
+      Offset = Prev->first;
+      Size += Prev->second;
+      FreeData.erase(Prev);
+    }
+  }
+
+  // A range at the end goes back to the unallocated rest.
+  if (Offset + Size == DataUsed)
+    DataUsed = Offset;
+  else
+    FreeData[Offset] = Size;
+}
+
+void ContractArena::clearData() {
+  if (DataUsed != 0)
+    UnmapWindow(Base + DataOffset, DataUsed);
+  DataUsed = 0;
+  FreeData.clear();
+}
+
+ContractArenaPool::ContractArenaPool(size_t Capacity, uint64_t ArenaSize,
+                                     uint64_t GuardSize)
+    : capacity(Capacity), arenaSize(ArenaSize), guardSize(GuardSize) {}
+
+ContractArenaPool::~ContractArenaPool() {
+  for (ContractArena *Arena : this->idle) {
+    delete Arena;
+  }
+  // Arenas still acquired are owned by their callers until released.
+}
+
+ContractArena *ContractArenaPool::acquire() {
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (!this->idle.empty()) {
+      ContractArena *Arena = this->idle.back();
+      this->idle.pop_back();
+      return Arena;
+    }
+  }
+  return ContractArena::create(this->arenaSize, this->guardSize);
+}
+
+void ContractArenaPool::release(ContractArena *Arena) {
+  // The next user may run another contract.
+  Arena->dropImage();
+  Arena->clearData();
+  Arena->reset();
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->idle.size() < this->capacity) {
+      this->idle.push_back(Arena);
+      return;
+    }
+  }
+  delete Arena;
+}
+
+// The arena executing on this thread inside RunFunctionInArena, and where to
+// resume when it faults on a guard region.
+static LLVM_THREAD_LOCAL ContractArena *trappingArena = nullptr;
+static LLVM_THREAD_LOCAL sigjmp_buf *trapJump = nullptr;
+// trappingArena if the engine running in it is sandboxed, for
+// CheckArenaAccess.
+static LLVM_THREAD_LOCAL ContractArena *checkedArena = nullptr;
+// Low end of this thread's native stack, or 0 if unknown.
+static LLVM_THREAD_LOCAL uintptr_t nativeStackLow = 0;
+
+namespace {
+// Installs an alternate signal stack for the thread, unless it has one
+// already, and looks up the bounds of its native stack.
+struct ThreadSignalStack {
+  ThreadSignalStack() {
+    stack_t Current;
+    if (sigaltstack(nullptr, &Current) == 0 &&
+        (Current.ss_flags & SS_DISABLE)) {
+      void *Mapped = mmap(NULL, kSignalStackSize, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+      if (Mapped != MAP_FAILED) {
+        stack_t Stack;
+        Stack.ss_sp = Mapped;
+        Stack.ss_size = kSignalStackSize;
+        Stack.ss_flags = 0;
+        if (sigaltstack(&Stack, nullptr) == 0)
+          Memory = Mapped;
+        else
+          munmap(Mapped, kSignalStackSize);
+      }
+    }
+
+    pthread_attr_t Attr;
+    if (pthread_getattr_np(pthread_self(), &Attr) == 0) {
+      void *Low;
+      size_t Size;
+      if (pthread_attr_getstack(&Attr, &Low, &Size) == 0)
+        nativeStackLow = reinterpret_cast<uintptr_t>(Low);
+      pthread_attr_destroy(&Attr);
+    }
+  }
+
+  ~ThreadSignalStack() {
+    if (Memory == nullptr)
+      return;
+    stack_t Stack;
+    memset(&Stack, 0, sizeof(Stack));
+    Stack.ss_flags = SS_DISABLE;
+    sigaltstack(&Stack, nullptr);
+    munmap(Memory, kSignalStackSize);
+  }
+
+  // The stack installed by us, or null.
+  void *Memory = nullptr;
+};
+} // namespace
+
+// Set up on the first execution of each thread, torn down when it exits.
+static void InstallThreadSignalStack() {
+  static thread_local ThreadSignalStack Stack;
+  (void)Stack;
+}
+
+// Whether a fault on Address is the native stack running out.
+static bool IsNativeStackOverflow(uintptr_t Address) {
+  uintptr_t Low = nativeStackLow;
+  return Low != 0 && Address + kNativeStackSlack >= Low &&
+         Address < Low + kNativeStackSlack;
+}
+
+static std::once_flag guardFaultHandlerOnce;
+static struct sigaction previousSegvAction;
+static struct sigaction previousBusAction;
+static struct sigaction previousIllAction;
+
+static void HandleGuardFault(int sig, siginfo_t *info, void *context) {
+  // Contract code traps with an illegal instruction on a call through a bad
+  // function pointer.
+  ContractArena *arena = trappingArena;
+  if (arena != nullptr && sig == SIGILL)
+    siglongjmp(*trapJump, call_invalid_call);
+  // Contract code recursing deeper than the native stack allows.
+  if (arena != nullptr && sig == SIGSEGV &&
+      IsNativeStackOverflow(reinterpret_cast<uintptr_t>(info->si_addr)))
+    siglongjmp(*trapJump, call_stack_overflow);
+  if (arena != nullptr &&
+      arena->isTrapAddress(reinterpret_cast<uintptr_t>(info->si_addr)))
+    siglongjmp(*trapJump, call_memory_fault);
+
+  // Not a sandbox fault: hand it to whoever was installed before us.
+  struct sigaction *previous =
+      sig == SIGBUS ? &previousBusAction
+                    : sig == SIGILL ? &previousIllAction : &previousSegvAction;
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(sig, info, context);
+  } else if (previous->sa_handler == SIG_DFL ||
+             previous->sa_handler == SIG_IGN) {
+    // Returning re-executes the faulting instruction, which then crashes.
+    signal(sig, SIG_DFL);
+  } else {
+    previous->sa_handler(sig);
+  }
+}
+
+static void InstallGuardFaultHandler() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = HandleGuardFault;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &previousSegvAction);
+  sigaction(SIGBUS, &action, &previousBusAction);
+  sigaction(SIGILL, &action, &previousIllAction);
+}
+
+size_t ContractArenaPool::reserve(size_t Count) {
+  std::vector<ContractArena *> Created;
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    size_t Room = this->capacity - std::min(this->capacity, this->idle.size());
+    Count = std::min(Count, Room);
+  }
+  for (size_t i = 0; i < Count; ++i) {
+    ContractArena *Arena =
+        ContractArena::create(this->arenaSize, this->guardSize);
+    if (Arena == nullptr)
+      break;
+    // Fault in the warm part of the stack now rather than on first use.
+    Arena->reset();
+    Created.push_back(Arena);
+  }
+
+  std::lock_guard<std::mutex> guard(this->lock);
+  this->idle.insert(this->idle.end(), Created.begin(), Created.end());
+  return this->idle.size();
+}
+
+ArenaPool *CreateArenaPool(size_t capacity) {
+  return CreateArenaPoolWithLayout(capacity, ContractArena::DefaultSize,
+                                   ContractArena::DefaultGuardSize);
+}
+
+ArenaPool *CreateArenaPoolWithLayout(size_t capacity, uint64_t arenaSize,
+                                     uint64_t guardSize) {
+  ArenaPool *p = static_cast<ArenaPool *>(calloc(1, sizeof(ArenaPool)));
+  p->nvm_arenas = new ContractArenaPool(capacity, arenaSize, guardSize);
+  return p;
+}
+
+void DeleteArenaPool(ArenaPool *p) {
+  delete static_cast<ContractArenaPool *>(p->nvm_arenas);
+  free(p);
+}
+
+SandboxArena *AcquireArena(ArenaPool *p) {
+  ContractArenaPool *pool = static_cast<ContractArenaPool *>(p->nvm_arenas);
+  ContractArena *arena = pool->acquire();
+  return arena != nullptr ? arena->handle() : NULL;
+}
+
+size_t ReserveArenas(ArenaPool *p, size_t count) {
+  ContractArenaPool *pool = static_cast<ContractArenaPool *>(p->nvm_arenas);
+  return pool->reserve(count);
+}
+
+void ReleaseArena(ArenaPool *p, SandboxArena *a) {
+  ContractArenaPool *pool = static_cast<ContractArenaPool *>(p->nvm_arenas);
+  pool->release(static_cast<ContractArena *>(a->nvm_arena));
+}
+
+int CaptureArenaImage(SandboxArena *a) {
+  ContractArena *arena = static_cast<ContractArena *>(a->nvm_arena);
+  return arena->captureImage() ? 0 : 1;
+}
+
+void ResetArena(SandboxArena *a) {
+  static_cast<ContractArena *>(a->nvm_arena)->reset();
+}
+
+void *GetArenaBase(SandboxArena *a) {
+  return static_cast<ContractArena *>(a->nvm_arena)->base();
+}
+
+int MapArenaInput(SandboxArena *a, IOBuffer *b) {
+  ContractArena *arena = static_cast<ContractArena *>(a->nvm_arena);
+  ContractIOBuffer *buffer = static_cast<ContractIOBuffer *>(b->nvm_buffer);
+  return arena->mapInput(*buffer) ? 0 : 1;
+}
+
+int MapArenaOutput(SandboxArena *a, IOBuffer *b) {
+  ContractArena *arena = static_cast<ContractArena *>(a->nvm_arena);
+  ContractIOBuffer *buffer = static_cast<ContractIOBuffer *>(b->nvm_buffer);
+  return arena->mapOutput(*buffer) ? 0 : 1;
+}
+
+size_t GetArenaWindowSize(SandboxArena *a) {
+  return static_cast<ContractArena *>(a->nvm_arena)->windowSize();
+}
+
+int RunFunctionInArena(Engine *e, SandboxArena *a, const char *funcName,
+                       size_t len, const uint8_t *data, int *result) {
+  std::call_once(guardFaultHandlerOnce, InstallGuardFaultHandler);
+  InstallThreadSignalStack();
+
+  // Save the outer arena, in case a host function runs another contract.
+  ContractArena *outerArena = trappingArena;
+  sigjmp_buf *outerJump = trapJump;
+  ContractArena *outerChecked = checkedArena;
+
+  sigjmp_buf jump;
+  int trap = sigsetjmp(jump, 1);
+  if (trap != 0) {
+    trappingArena = outerArena;
+    trapJump = outerJump;
+    checkedArena = outerChecked;
+    return trap;
+  }
+  ContractArena *arena = static_cast<ContractArena *>(a->nvm_arena);
+  trappingArena = arena;
+  trapJump = &jump;
+  checkedArena =
+      GetPipelineOptions(e).Sandbox != sandbox_none ? arena : nullptr;
+
+  *result = RunFunction(e, funcName, len, data);
+
+  trappingArena = outerArena;
+  trapJump = outerJump;
+  checkedArena = outerChecked;
+  return 0;
+}
+
+void AbortArenaExecution(int code) {
+  if (trapJump == nullptr)
+    report_fatal_error("contract trapped outside of RunFunctionInArena.");
+  siglongjmp(*trapJump, code != 0 ? code : call_memory_fault);
+}
+
+void CheckArenaAccess(const void *data, size_t len) {
+  ContractArena *arena = checkedArena;
+  if (arena != nullptr && !arena->contains(data, len))
+    AbortArenaExecution(call_memory_fault);
+}
+
+int RunFunctionWithIO(Engine *e, SandboxArena *a, const char *funcName,
+                      size_t inputLen, int *result, size_t *outputLen) {
+  ContractArena *arena = static_cast<ContractArena *>(a->nvm_arena);
+  if (inputLen > arena->inputSize()) {
+    errs() << "input is larger than the mapped input buffer.";
+    return -1;
+  }
+
+  *arena->outputLengthCell() = 0;
+  int trap = RunFunctionInArena(e, a, funcName, inputLen,
+                                arena->inputWindow(), result);
+  // The length is written by the contract, never trust it beyond the buffer.
+  *outputLen = trap == 0 ? std::min(*arena->outputLengthCell(),
+                                    arena->outputCapacity())
+                         : 0;
+  return trap;
+}
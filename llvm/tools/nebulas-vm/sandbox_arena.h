@@ -0,0 +1,211 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include "engine.h"
+#include "io_buffer.h"
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+/// The sandbox memory of one contract execution.
+///
+/// The usable region is aligned to its own size and surrounded by
+/// inaccessible guard regions: a small one before it, and one of the
+/// requested size after it, which is where confined accesses that wrap end
+/// up. Faults in either are turned into traps by RunFunctionInArena. Its
+/// address never changes, so engines bound to an arena stay valid across
+/// executions; reset() only throws away what the previous execution wrote.
+///
+/// From the bottom up, the arena holds an inaccessible page, where confined
+/// null pointers land, the page of cells contracts share with the host, the
+/// data area, free memory, the I/O windows and the stack. The data area
+/// holds the globals of engines sandboxed to the arena; it outlives resets
+/// and images, like the globals of any other engine.
+class ContractArena {
+  ContractArena(const ContractArena &) = delete;
+  void operator=(const ContractArena &) = delete;
+
+public:
+  /// Default geometry: the 4 GiB the 32-bit confinement of
+  /// SandboxMemoryAccesses can reach, plus guards covering the constant
+  /// offsets it adds after confinement.
+  static const uint64_t DefaultSize = uint64_t(1) << 32;
+  static const uint64_t DefaultGuardSize = 0x10000;
+
+  /// Trailing guard size for code sandboxed in guard-region mode.
+  static const uint64_t GuardRegionGuardSize = (uint64_t(1) << 32) + 0x10000;
+
+  /// Smallest arena the layout fits in.
+  static const uint64_t MinSize = 0x10000;
+
+  /// Returns null if the address space cannot be reserved. Size must be a
+  /// power of two, at least MinSize; GuardSize a multiple of the page size.
+  static ContractArena *create(uint64_t Size = DefaultSize,
+                               uint64_t GuardSize = DefaultGuardSize);
+  ~ContractArena();
+
+  uint8_t *base() const { return Base; }
+  uint64_t size() const { return Size; }
+  uint64_t guardSize() const { return GuardSize; }
+
+  /// Pages of the arena currently backed by memory: what executions touched
+  /// since the last reset, plus the warm part of the stack.
+  uint64_t residentPages() const;
+
+  /// Whether a fault on Address is the contract's doing: it lies in one of
+  /// the guard regions, on the inaccessible first page or in the read-only
+  /// data of a sandboxed engine.
+  bool isTrapAddress(uintptr_t Address) const;
+
+  /// Whether the Len bytes at Data lie inside the arena.
+  bool contains(const void *Data, uint64_t Len) const {
+    uintptr_t Offset = reinterpret_cast<uintptr_t>(Data) -
+                       reinterpret_cast<uintptr_t>(Base);
+    return Offset <= Size && Len <= Size - Offset;
+  }
+
+  /// Cells bound to __sfi_memory_base, __sfi_stack and __sfi_stack_limit.
+  uint64_t *memoryBaseCell() { return &MemoryBase; }
+  uint64_t *stackCell() { return &StackPointer; }
+  uint64_t *stackLimitCell() { return &StackLimit; }
+
+  /// The I/O windows sit at fixed offsets right below the stack, input
+  /// first. Contracts find the output window through the cells bound to
+  /// __nvm_output and __nvm_output_capacity, and report how much of it they
+  /// wrote in __nvm_output_length. The cells live inside the arena, where
+  /// sandboxed code can reach them, so the contract may overwrite them all;
+  /// the host goes by outputCapacity() instead.
+  uint8_t *inputWindow() const { return Base + InputOffset; }
+  uint8_t *outputWindow() const { return Base + InputOffset + WindowSize; }
+  uint64_t windowSize() const { return WindowSize; }
+  uint64_t inputSize() const { return InputSize; }
+  uint64_t outputCapacity() const { return OutputSize; }
+  uint64_t *outputCell() { return &cells()->OutputAddress; }
+  uint64_t *outputCapacityCell() { return &cells()->OutputCapacity; }
+  uint64_t *outputLengthCell() { return &cells()->OutputLength; }
+
+  /// Take Size bytes, a multiple of the page size, from the data area, first
+  /// fit. Returns null if they do not fit.
+  uint8_t *allocateData(uint64_t Size);
+
+  /// Give back data allocated before, zeroed and writable again, for later
+  /// allocations to reuse.
+  void releaseData(uint8_t *Address, uint64_t Size);
+
+  /// Bytes the data area still has room for past its last allocation.
+  uint64_t dataAvailable() const { return DataLimit - DataOffset - DataUsed; }
+
+  /// Map Buffer over the input window, in place of any buffer mapped
+  /// before. The contract reads the buffer in place; its writes stay private
+  /// to the arena. Returns false if the buffer does not fit.
+  bool mapInput(ContractIOBuffer &Buffer);
+
+  /// Map Buffer over the output window, in place of any buffer mapped
+  /// before, shared, so the contract writes its results straight into it.
+  /// Returns false if the buffer does not fit.
+  bool mapOutput(ContractIOBuffer &Buffer);
+
+  /// Zero the arena, or bring it back to its image, unmap any I/O buffers
+  /// and rewind the stack for the next execution. The data area is kept.
+  void reset();
+
+  /// Make the current contents, outside the data area and the I/O windows,
+  /// the state reset() brings the arena back to. The image is a private
+  /// mapping of a copy of the pages in use, so a reset only drops the pages
+  /// written since. Returns false if the image could not be created.
+  bool captureImage();
+
+  /// Go back to resetting to zero.
+  void dropImage();
+
+  /// Zero the data area and give all of it back, once no engine uses it.
+  void clearData();
+
+  SandboxArena *handle() { return &Handle; }
+
+private:
+  ContractArena() {}
+
+  struct Cells {
+    uint64_t OutputAddress;
+    uint64_t OutputCapacity;
+    uint64_t OutputLength;
+  };
+  Cells *cells() const { return reinterpret_cast<Cells *>(Base + CellsOffset); }
+  void resetCells();
+
+  uint8_t *Reservation;
+  uint64_t ReservationSize;
+  uint8_t *Base;
+  uint64_t Size;
+  uint64_t GuardSize;
+
+  uint64_t MemoryBase;
+  uint64_t StackPointer;
+  uint64_t StackLimit;
+
+  uint64_t CellsOffset;
+  uint64_t DataOffset;
+  uint64_t DataLimit;
+  uint64_t DataUsed;
+  // Released ranges below DataUsed, by offset from the data area, coalesced.
+  std::map<uint64_t, uint64_t> FreeData;
+
+  uint64_t InputOffset;
+  uint64_t WindowSize;
+  uint64_t InputSize;
+  uint64_t OutputSize;
+  bool InputMapped;
+  bool OutputMapped;
+
+  // Backing file of the image, or -1.
+  int ImageFD;
+
+  SandboxArena Handle;
+};
+
+/// Arenas recycled between executions, so that neither the mappings nor the
+/// pages the stack keeps touching have to be set up again every time.
+class ContractArenaPool {
+  ContractArenaPool(const ContractArenaPool &) = delete;
+  void operator=(const ContractArenaPool &) = delete;
+
+public:
+  explicit ContractArenaPool(
+      size_t Capacity, uint64_t ArenaSize = ContractArena::DefaultSize,
+      uint64_t GuardSize = ContractArena::DefaultGuardSize);
+  ~ContractArenaPool();
+
+  ContractArena *acquire();
+  void release(ContractArena *Arena);
+
+  /// Create idle arenas up front, up to the pool capacity. Returns how many
+  /// arenas are idle afterwards.
+  size_t reserve(size_t Count);
+
+private:
+  std::mutex lock;
+  size_t capacity;
+  uint64_t arenaSize;
+  uint64_t guardSize;
+  std::vector<ContractArena *> idle;
+};
@@ -0,0 +1,196 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#include "tiered_vm.h"
+#include "memory_manager.h"
+
+#include <stdlib.h>
+
+TieredContractRunner::TieredContractRunner(unsigned HotThreshold,
+                                           size_t Capacity)
+    : hotThreshold(HotThreshold), capacity(Capacity),
+      imports(new HostImportTable()), compileThreads(1) {}
+
+TieredContractRunner::~TieredContractRunner() {
+  // Background compiles hold on to their contract until they are done.
+  compileThreads.wait();
+}
+
+TieredContractRunner::ContractTiers::~ContractTiers() {
+  if (this->Interpreter != NULL) {
+    DeleteEngine(this->Interpreter);
+  }
+  if (Engine *native = this->Native.load()) {
+    DeleteEngine(native);
+  }
+}
+
+void TieredContractRunner::bindSymbol(const std::string &Name, void *Address) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  // Engines already created keep the frozen table they share.
+  if (this->imports->isFrozen())
+    this->imports = std::make_shared<HostImportTable>(*this->imports);
+  this->imports->bind(Name, (uint64_t)Address);
+}
+
+Engine *TieredContractRunner::createEngine(bool Interpreted,
+                                           const std::string &Contract) {
+  std::shared_ptr<HostImportTable> engineImports;
+  {
+    std::lock_guard<std::mutex> guard(this->lock);
+    // Frozen once, then shared by both tiers of every contract.
+    this->imports->freeze();
+    engineImports = this->imports;
+  }
+
+  Engine *e = Interpreted ? CreateInterpreterEngine() : CreateEngine();
+  // Optimizing IR the interpreter only runs a few times does not pay off.
+  // Execution levels leave gas accounting alone, so the tiers still agree.
+  if (Interpreted)
+    SetExecutionLevel(e, exe_level_g);
+  MemoryManager *mm = static_cast<MemoryManager *>(e->llvm_mem_manager);
+  mm->useImports(std::move(engineImports));
+  if (AddModuleBuffer(e, (const uint8_t *)Contract.data(), Contract.size()) !=
+      0) {
+    DeleteEngine(e);
+    return NULL;
+  }
+
+  // Run the static constructors once, calls start from the state they left.
+  if (CaptureEngineImage(e) != 0) {
+    DeleteEngine(e);
+    return NULL;
+  }
+  return e;
+}
+
+std::shared_ptr<TieredContractRunner::ContractTiers>
+TieredContractRunner::getTiers(const std::string &ContractHash,
+                               const uint8_t *Contract, size_t ContractLen) {
+  std::lock_guard<std::mutex> guard(this->lock);
+  std::shared_ptr<ContractTiers> &tiers = this->contracts[ContractHash];
+  if (tiers) {
+    this->lru.splice(this->lru.begin(), this->lru, tiers->LRUPos);
+    return tiers;
+  }
+
+  tiers = std::make_shared<ContractTiers>();
+  tiers->Contract.assign((const char *)Contract, ContractLen);
+  tiers->LRUPos = this->lru.insert(this->lru.begin(), ContractHash);
+  std::shared_ptr<ContractTiers> result = tiers;
+
+  while (this->contracts.size() > this->capacity) {
+    this->contracts.erase(this->lru.back());
+    this->lru.pop_back();
+  }
+  return result;
+}
+
+Engine *TieredContractRunner::publishNative(ContractTiers *Tiers, Engine *e) {
+  // A contract that can not be interpreted may have been compiled in the
+  // foreground while its background compile was still running.
+  Engine *expected = NULL;
+  if (Tiers->Native.compare_exchange_strong(expected, e,
+                                            std::memory_order_acq_rel)) {
+    return e;
+  }
+  DeleteEngine(e);
+  return expected;
+}
+
+void TieredContractRunner::promote(std::shared_ptr<ContractTiers> Tiers) {
+  compileThreads.async([this, Tiers]() {
+    Engine *e = this->createEngine(false, Tiers->Contract);
+    if (e == NULL) {
+      // Keep interpreting; Promoted stays set so the compile is not retried.
+      return;
+    }
+    this->publishNative(Tiers.get(), e);
+  });
+}
+
+int TieredContractRunner::run(const std::string &ContractHash,
+                              const uint8_t *Contract, size_t ContractLen,
+                              const char *FuncName, size_t Len,
+                              const uint8_t *Data) {
+  std::shared_ptr<ContractTiers> tiers =
+      this->getTiers(ContractHash, Contract, ContractLen);
+  uint64_t calls = ++tiers->Calls;
+
+  std::lock_guard<std::mutex> guard(tiers->RunLock);
+
+  Engine *native = tiers->Native.load(std::memory_order_acquire);
+  if (native == NULL) {
+    if (calls >= this->hotThreshold && !tiers->Promoted.exchange(true)) {
+      this->promote(tiers);
+    }
+
+    if (tiers->Interpreter == NULL) {
+      tiers->Interpreter = this->createEngine(true, tiers->Contract);
+    }
+    if (tiers->Interpreter != NULL) {
+      RestoreEngineImage(tiers->Interpreter);
+      return RunFunction(tiers->Interpreter, FuncName, Len, Data);
+    }
+
+    // The contract can not be interpreted, e.g. it calls host functions the
+    // interpreter can not reach without libffi. Compile it right away rather
+    // than wait behind the background compiles of other contracts.
+    tiers->Promoted.store(true);
+    native = this->createEngine(false, tiers->Contract);
+    if (native == NULL) {
+      return -1;
+    }
+    native = this->publishNative(tiers.get(), native);
+  }
+
+  if (tiers->Interpreter != NULL) {
+    DeleteEngine(tiers->Interpreter);
+    tiers->Interpreter = NULL;
+  }
+  RestoreEngineImage(native);
+  return RunFunction(native, FuncName, Len, Data);
+}
+
+TieredVM *CreateTieredVM(unsigned hotThreshold, size_t capacity) {
+  TieredVM *vm = static_cast<TieredVM *>(calloc(1, sizeof(TieredVM)));
+  vm->nvm_tiers = new TieredContractRunner(hotThreshold, capacity);
+  return vm;
+}
+
+void DeleteTieredVM(TieredVM *vm) {
+  delete static_cast<TieredContractRunner *>(vm->nvm_tiers);
+  free(vm);
+}
+
+void TieredVMBindSymbol(TieredVM *vm, const char *funcName, void *address) {
+  TieredContractRunner *runner =
+      static_cast<TieredContractRunner *>(vm->nvm_tiers);
+  runner->bindSymbol(std::string(funcName), address);
+}
+
+int TieredVMRunFunction(TieredVM *vm, const char *contractHash,
+                        const uint8_t *contract, size_t contractLen,
+                        const char *funcName, size_t len,
+                        const uint8_t *data) {
+  TieredContractRunner *runner =
+      static_cast<TieredContractRunner *>(vm->nvm_tiers);
+  return runner->run(std::string(contractHash), contract, contractLen,
+                     funcName, len, data);
+}
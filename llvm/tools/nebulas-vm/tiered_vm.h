@@ -0,0 +1,105 @@
+// Copyright (C) 2017 go-nebulas authors
+//
+// This file is part of the go-nebulas library.
+//
+// the go-nebulas library is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// the go-nebulas library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with the go-nebulas library.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include "engine.h"
+#include "host_imports.h"
+#include <llvm/Support/ThreadPool.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// Runs contracts in tiers, keyed by contract hash.
+///
+/// A contract starts out in the interpreter, which costs nothing to set up.
+/// Once it has been called HotThreshold times it is compiled with MCJIT on a
+/// background thread, and calls switch to the native code as soon as the
+/// compile finishes. Both tiers execute the same NVM-instrumented IR, the
+/// interpreter at exe_level_g, so gas accounting does not depend on the
+/// tier. Neither do the contract globals: every call starts from their state
+/// after the static constructors ran, restored from an image in either tier.
+///
+/// Memory accesses are not sandboxed in either tier, since the interpreter
+/// cannot confine them to an arena; contracts that need sandboxing run in
+/// MCJIT engines through RunFunctionInArena instead.
+///
+/// At most Capacity contracts are kept, the least recently used are evicted
+/// first.
+class TieredContractRunner {
+  TieredContractRunner(const TieredContractRunner &) = delete;
+  void operator=(const TieredContractRunner &) = delete;
+
+public:
+  TieredContractRunner(unsigned HotThreshold, size_t Capacity);
+  ~TieredContractRunner();
+
+  /// Symbols bound into every engine created afterwards.
+  void bindSymbol(const std::string &Name, void *Address);
+
+  int run(const std::string &ContractHash, const uint8_t *Contract,
+          size_t ContractLen, const char *FuncName, size_t Len,
+          const uint8_t *Data);
+
+private:
+  typedef std::list<std::string> LRUList;
+
+  struct ContractTiers {
+    ContractTiers() : Calls(0), Native(nullptr), Promoted(false) {}
+    ~ContractTiers();
+
+    // Contract bytes, kept for the background compile.
+    std::string Contract;
+
+    std::atomic<uint64_t> Calls;
+    std::atomic<Engine *> Native;
+    std::atomic<bool> Promoted;
+
+    // An engine instance holds the contract's globals and sandbox state, so
+    // calls into it are serialized.
+    std::mutex RunLock;
+    Engine *Interpreter = nullptr;
+
+    LRUList::iterator LRUPos;
+  };
+
+  std::shared_ptr<ContractTiers> getTiers(const std::string &ContractHash,
+                                          const uint8_t *Contract,
+                                          size_t ContractLen);
+  Engine *createEngine(bool Interpreted, const std::string &Contract);
+  void promote(std::shared_ptr<ContractTiers> Tiers);
+  Engine *publishNative(ContractTiers *Tiers, Engine *e);
+
+  std::mutex lock;
+  unsigned hotThreshold;
+  size_t capacity;
+
+  // Contract hashes, most recently used first. Evicted contracts are freed
+  // once the calls and the compile still using them are done.
+  LRUList lru;
+  std::unordered_map<std::string, std::shared_ptr<ContractTiers>> contracts;
+  std::shared_ptr<HostImportTable> imports;
+
+  llvm::ThreadPool compileThreads;
+};
@@ -406,6 +406,7 @@ int main(int argc, char **argv) {
   initializeUnreachableBlockElimLegacyPassPass(Registry);
   initializeExpandReductionsPass(Registry);
   initializeExpandAllocasPass(Registry);
+  initializeGasMeteringPass(Registry);
   initializeStripTlsPass(Registry);
   initializeSandboxIndirectCallsPass(Registry);
   initializeSandboxMemoryAccessesPass(Registry);